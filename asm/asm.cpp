@@ -1,10 +1,20 @@
 #include "asm.h"
+#include <algorithm>
 #include <iomanip>
+#include <utility>
 
 namespace assembly {
 
-Assembler::Assembler(MM::MM& muncher, std::vector<TAC>& _instr, std::ofstream& os) : muncher(muncher), args_on_stack(0), instr(_instr), os(os) {
-    bounds.clear();
+namespace {
+
+// bytes below %rsp a function can use without moving it, signal handlers leave them alone
+constexpr long long RED_ZONE = 128;
+
+}
+
+Assembler::Assembler(MM::MM& muncher, std::vector<TAC>& _instr, std::ofstream& os, bool optimize) : muncher(muncher), args_on_stack(0), instr(_instr), optimize(optimize), os(os) {
+    slots.clear();
+    frame_slots.clear();
     func_of_temp = muncher.get_func_of_temps();
     asm_name.clear();
 }
@@ -15,7 +25,7 @@ void Assembler::assemble() {
         auto name = tac.get_result().substr(1);
         os << "\t.globl " << name << "\n";
         os << "\t.data\n";
-        os << name << ":" << std::setw(8) << ".quad " << std::stoi(tac.get_arg()) << "\n";
+        os << name << ":" << std::setw(8) << ".quad " << std::stoll(tac.get_arg()) << "\n";
     }
 
     // compute the function where each temporary is defined
@@ -27,8 +37,46 @@ void Assembler::assemble() {
             c = (c == ':' ? '_' : c);
         func_name += std::to_string(++func_cnt);
         asm_name[instr[start].get_result()] = instr[start].get_result() != "main" ? func_name : "main";
+
+        // lambdas are named after the functions around them, outer::inner
+        auto name = instr[start].get_result();
+        func_depth[name] = std::count(name.begin(), name.end(), ':') / 2;
     }
     
+    // a constant operand lets mul, div and mod skip imulq and idivq
+    if (optimize) {
+        std::set<MM::Temporary> varying;
+        for (auto &tac : instr) {
+            if (!tac.has_result() || tac.get_opcode() == "proc")
+                continue;
+            auto result = tac.get_result();
+            auto &args = tac.get_args();
+            bool is_number = tac.get_opcode() == "const" && (std::isdigit(args[0][0]) || args[0][0] == '-');
+            if (!is_number || (constants.count(result) && constants[result] != std::stoll(args[0])))
+                varying.insert(result);
+            else
+                constants[result] = std::stoll(args[0]);
+        }
+        for (auto &temp : varying)
+            constants.erase(temp);
+    }
+
+    // temporaries lambdas reach through the static links have to stay in their frame
+    for (auto &[start, finish] : muncher.procs_indexes()) {
+        auto func_name = instr[start].get_result();
+        for (auto i = start + 1; i <= finish; i++) {
+            auto values = instr[i].get_args();
+            if (instr[i].has_result())
+                values.push_back(instr[i].get_result());
+            for (auto &value : values) {
+                if (value.size() > 1 && value[0] == '%' && std::isdigit(value[1]) && func_of_temp[value] != func_name) {
+                    captured.insert(value);
+                    uses_frames.insert(func_name);
+                }
+            }
+        }
+    }
+
     // compute how much we allocate on each function
     for (auto &[start, finish] : muncher.procs_indexes()) {
         process_proc(start, finish);
@@ -42,14 +90,33 @@ void Assembler::assemble() {
         os << "\t.text\n";
         os << name << ":\n";
         assemble_proc(start, finish);
+
+        auto before = code.size();
+        if (optimize)
+            peephole(code);
+        removed += before - code.size();
+        if (optimize)
+            align_loops(code);
+
+        for (auto &line : code) {
+            os << line;
+            emitted += line.kind == MInstr::INSTR;
+        }
+        code.clear();
     }
 
     os.close();
 }
 
 void Assembler::process_proc(std::size_t start, std::size_t finish) {
-    std::size_t mn = 1e9, mx = 0;
     auto func_name = instr[start].get_result();
+
+    // temporaries of the function, ordered by their number
+    auto by_number = [](const MM::Temporary& a, const MM::Temporary& b) {
+        return std::stoll(a.substr(1)) < std::stoll(b.substr(1));
+    };
+    std::set<MM::Temporary, decltype(by_number)> temps(by_number);
+
     for (auto i = start + 1; i <= finish; i++) {
         auto t = instr[i];
         auto args = t.get_args();
@@ -59,26 +126,164 @@ void Assembler::process_proc(std::size_t start, std::size_t finish) {
 #endif
         
         for (auto &temp : args) {
-            if (func_of_temp[temp] == func_name) {
-                auto num = static_cast<std::size_t>(std::stoi(temp.substr(1)));
-                mn = std::min(mn, num);
-                mx = std::max(mx, num);
-            }
+            if (func_of_temp[temp] == func_name)
+                temps.insert(temp);
         }
 
         if (t.has_result()) {
             auto result = t.get_result();
-            if (func_of_temp[result] == func_name) {
-                auto num = static_cast<std::size_t>(std::stoi(result.substr(1)));
-                mn = std::min(mn, num);
-                mx = std::max(mx, num);
-            }
+            if (func_of_temp[result] == func_name)
+                temps.insert(result);
+        }
+    }
+
+    if (optimize)
+        allocate_registers(start, finish);
+
+    // optimizations create temporaries with large numbers, so the slots are kept dense,
+    // temporaries in registers only need one when they are stored around calls; the
+    // callee saved registers we write come first, so they're always in the red zone
+    std::size_t slot = callee_saved[func_name].size();
+    for (auto &temp : temps) {
+        if ((!registers.count(temp) || split.count(temp)) && !immediate_of(temp).has_value())
+            slots[temp] = slot++;
+    }
+    frame_slots[func_name] = slot;
+}
+
+std::string Assembler::saved_slot(std::size_t i) {
+    return frame_address(-8 * static_cast<long long>(i + 2));
+}
+
+void Assembler::restore_callee_saved() {
+    auto &saved = callee_saved[curr_func_name];
+    for (std::size_t i = 0; i < saved.size(); i++) {
+        if (in_frame || saved_early.count(saved[i]))
+            emit("movq", {saved_slot(i), saved[i]});
+    }
+}
+
+bool Assembler::needs_frame(TAC& tac) {
+    auto op = tac.get_opcode();
+    // calls and arguments on the stack move %rsp, get_fp hands our frame to a lambda
+    if (op == "call" || op == "get_fp" || (op == "param" && std::stoi(tac.get_result()) > 6))
+        return true;
+    if (op == "copy" && tac.get_args().size() == 2)
+        return keeps_static_link;
+    if (op == "label" || op == "jmp" || op == "param")
+        return false;
+
+    // slots too deep for the red zone
+    auto values = tac.get_args();
+    if (tac.has_result() && !jumps.count(op))
+        values.push_back(tac.get_result());
+    for (auto &value : values) {
+        auto it = slots.find(value);
+        if (it == slots.end() || registers.count(value) || func_of_temp[value] != curr_func_name)
+            continue;
+        if (-8 * static_cast<long long>(it->second + 2) - 8 < -RED_ZONE)
+            return true;
+    }
+    return false;
+}
+
+void Assembler::place_frame(std::size_t start, std::size_t finish) {
+    framed_labels.clear();
+    saved_early.clear();
+    keeps_static_link = !optimize || uses_frames.count(curr_func_name);
+    for (auto i = start + 1; i <= finish; i++)
+        keeps_static_link |= instr[i].get_opcode() == "get_fp";
+
+    // the blocks between labels, what they jump or fall to and which ones need the frame
+    std::map<std::string, std::set<std::string>> successors;
+    std::vector<std::string> needing;
+    std::string label;
+    bool falls = false;
+    for (auto i = start + 1; i <= finish; i++) {
+        auto &tac = instr[i];
+        auto op = tac.get_opcode();
+        if (op == "label") {
+            if (falls)
+                successors[label].insert(tac.get_arg());
+            label = tac.get_arg();
+            framed_labels.insert(label);
+            falls = true;
+            continue;
+        }
+        if (i < finish && is_tail_call(tac, instr[i + 1])) {
+            if (needs_frame(instr[i + 1]) || slots.count(tac.get_args()[0]))
+                needing.push_back(label);
+            falls = false;
+            i++;
+            continue;
+        }
+
+        if (needs_frame(tac))
+            needing.push_back(label);
+        if (op == "jmp")
+            successors[label].insert(tac.get_args().empty() ? tac.get_result() : tac.get_arg());
+        else if (jumps.count(op))
+            successors[label].insert(tac.get_result());
+        falls &= op != "jmp" && op != "ret";
+    }
+
+    // functions walking out of their frame or handing it to lambdas set it up right away
+    if (keeps_static_link)
+        return;
+
+    // once it's there the frame stays until the function returns
+    std::set<std::string> framed;
+    while (!needing.empty()) {
+        auto next = needing.back();
+        needing.pop_back();
+        if (!framed.insert(next).second)
+            continue;
+        for (auto &succ : successors[next])
+            needing.push_back(succ);
+    }
+
+    // a block only going to ones with the frame sets it up once for all of them
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto &[from, succs] : successors) {
+            if (!framed.count(from) && !succs.empty() && std::all_of(succs.begin(), succs.end(), [&](auto& succ) { return framed.count(succ) > 0; }))
+                changed |= framed.insert(from).second;
+        }
+    }
+    framed_labels = std::move(framed);
+
+    auto &saved = callee_saved[curr_func_name];
+    for (auto i = start + 1; i <= finish; i++) {
+        if (instr[i].get_opcode() == "label")
+            label = instr[i].get_arg();
+        else if (!framed_labels.count(label) && instr[i].has_result() && registers.count(instr[i].get_result())) {
+            auto &reg = registers[instr[i].get_result()];
+            if (std::find(saved.begin(), saved.end(), reg) != saved.end())
+                saved_early.insert(reg);
         }
     }
+}
+
+void Assembler::emit_prologue() {
+    emit("pushq", {"%rbp"});
+    emit("movq", {"%rsp", "%rbp"});
+    emit("subq", {"$" + std::to_string(8 * stack_size), "%rsp"});
 
-    if (mx == 0) mn = mx = 0;
+    // the callee saved registers not saved on entry go through the new frame
+    auto was_in_frame = std::exchange(in_frame, true);
+    auto &saved = callee_saved[curr_func_name];
+    for (std::size_t i = 0; i < saved.size(); i++) {
+        if (!saved_early.count(saved[i]))
+            emit("movq", {saved[i], saved_slot(i)});
+    }
+    in_frame = was_in_frame;
+}
 
-    bounds[func_name] = {mn, mx};
+void Assembler::emit_epilogue() {
+    if (!in_frame)
+        return;
+    emit("movq", {"%rbp", "%rsp"});
+    emit("popq", {"%rbp"});
 }
 
 void Assembler::assemble_proc(std::size_t start, std::size_t finish) {
@@ -86,26 +291,128 @@ void Assembler::assemble_proc(std::size_t start, std::size_t finish) {
     stack_size = 0;
 
     curr_func_name = instr[start].get_result();
+    frame_in.clear();
+    prologues.clear();
 
-    stack_size = bounds[curr_func_name].second - bounds[curr_func_name].first + 2 + instr[start].get_args().size();
+    // -8(%rbp) holds the static link, the temporaries come right after it
+    stack_size = frame_slots[curr_func_name] + 1 + instr[start].get_args().size();
     stack_size = (stack_size + 1) / 2 * 2;
-    stack_offset = bounds[curr_func_name].first;
 
 #ifdef DEBUG
-    std::cout << stack_offset << "->" << bounds[curr_func_name].second << " ";
+    std::cout << frame_slots[curr_func_name] << " slots ";
 #endif
 
-    os << "\tpushq %rbp\n";
-    os << "\tmovq %rsp, %rbp\n";
-    os << "\tsubq $" << 8 * stack_size << ", %rsp\n";
+    // leaf functions never set up a frame, the others only on the paths needing it
+    place_frame(start, finish);
+    in_frame = framed_labels.count(instr[start + 1].get_arg()) > 0;
+    auto &saved = callee_saved[curr_func_name];
+    for (std::size_t i = 0; i < saved.size(); i++) {
+        if (saved_early.count(saved[i]))
+            emit("movq", {saved[i], saved_slot(i)});
+    }
+    if (in_frame)
+        emit_prologue();
 
 #ifdef DEBUG
-    std::cout << stack_size << "\n";
+    std::cout << stack_size << (in_frame ? "\n" : " in the red zone\n");
 #endif
 
+    bool falls = false;
     for (auto i = start + 1; i <= finish; i++) {
+        auto op = instr[i].get_opcode();
+        if (op == "label") {
+            bool framed = framed_labels.count(instr[i].get_arg()) > 0;
+            if (framed && !in_frame && falls)
+                emit_prologue();
+            in_frame = framed;
+        }
+        falls = op != "jmp" && op != "ret";
+
+        // a marked call whose result we return right away leaves through our frame,
+        // unless its arguments are on our stack
+        if (i < finish && args_on_stack == 0 && is_tail_call(instr[i], instr[i + 1])) {
+            assemble_tail_call(instr[i]);
+            falls = false;
+            i++;
+            continue;
+        }
         assemble_instr(instr[i]);
     }
+
+    // jumps from a block without the frame to one with it set it up on the way
+    in_frame = false;
+    for (auto &[target, prologue] : prologues) {
+        code.push_back(MInstr::label(prologue));
+        emit_prologue();
+        emit("jmp", {target.substr(1)});
+    }
+}
+
+Register Assembler::frame_register(int delta) {
+    for (auto &[reg, d] : frame_in) {
+        if (d == delta) {
+            frames_used.insert(reg);
+            return reg;
+        }
+    }
+
+    // the walk starts from the closest frame on the way we already have
+    Register from = "%rbp";
+    int from_delta = 0;
+    for (auto &[reg, d] : frame_in) {
+        if (d < delta && d > from_delta)
+            from = reg, from_delta = d;
+    }
+
+    // another operand of the instruction might still need the frame in a register,
+    // an empty one is taken first
+    Register reg;
+    for (auto &candidate : frame_registers) {
+        if (frames_used.count(candidate))
+            continue;
+        if (reg.empty() || (!frame_in.count(candidate) && frame_in.count(reg)))
+            reg = candidate;
+    }
+    assert(!reg.empty());
+
+    code.push_back(MInstr::comment(std::format("Frame {} static links up from {}", delta, curr_func_name)));
+    emit("movq", {"-8(" + from + ")", reg});
+    for (int i = from_delta + 1; i < delta; i++)
+        emit("movq", {"-8(" + reg + ")", reg});
+
+    frame_in[reg] = delta;
+    frames_used.insert(reg);
+    return reg;
+}
+
+void Assembler::compare(const std::vector<std::string>& args) {
+    auto arg0_temp = stack_register(args[0]);
+    auto arg1_temp = args.size() == 1 ? "$0" : stack_register(args[1]);
+
+    // the compared value can't be an immediate, and only one side can be memory
+    if (is_immediate(arg0_temp) || (is_memory(arg0_temp) && is_memory(arg1_temp))) {
+        emit("movq", {arg0_temp, "%r10"});
+        arg0_temp = "%r10";
+    }
+    emit("cmpq", {arg1_temp, arg0_temp});
+}
+
+bool Assembler::is_tail_call(TAC& tac, TAC& next) {
+    auto &args = tac.get_args();
+    if (tac.get_opcode() != "call" || args.size() != 3 || args[2] != "tail_call_flag" || next.get_opcode() != "ret")
+        return false;
+    if (!tac.has_result())
+        return next.get_args().empty();
+    return next.get_args().size() == 1 && next.get_arg() == tac.get_result();
+}
+
+void Assembler::assemble_tail_call(TAC& tac) {
+    // the code pointer might live in our frame
+    auto arg0_temp = stack_register(tac.get_args()[0]);
+    emit("movq", {arg0_temp, "%r10"});
+    restore_callee_saved();
+    emit_epilogue();
+    emit("jmp", {"*%r10"});
 }
 
 void Assembler::assemble_instr(TAC& tac) {
@@ -116,106 +423,190 @@ void Assembler::assemble_instr(TAC& tac) {
     std::cout << tac << "\n";
 #endif
 
+    // other blocks jump here with other registers
+    frames_used.clear();
+    if (op == "label")
+        frame_in.clear();
+
     if (op == "label") {
         assert(args.size() == 1);
-        os << args[0].substr(1) << ":\n";
+        code.push_back(MInstr::label(args[0].substr(1)));
     }
     else if (op == "const") {
         assert(args.size() == 1 && tac.has_result());
         auto result_temp = stack_register(tac.get_result());
 
+        // its uses read the immediate instead
+        if (is_immediate(result_temp))
+            return;
+
         // convert function names to asm given names
+        bool is_number = std::isdigit(args[0][0]) || args[0][0] == '-';
         args[0] = std::isalpha(args[0][0]) ? asm_name[args[0]] : args[0];
 
-        os << "\tmovq $" << args[0] << ", " << result_temp << "\n";
+        // movq only takes sign extended 32 bit immediates
+        if (is_number && (std::stoll(args[0]) < INT32_MIN || std::stoll(args[0]) > INT32_MAX)) {
+            auto reg = is_register(result_temp) ? result_temp : "%r10";
+            emit("movabsq", {"$" + args[0], reg});
+            move(reg, result_temp);
+        }
+        else
+            emit("movq", {"$" + args[0], result_temp});
     }
     else if (op == "copy") {
         assert(args.size() >= 1 && tac.has_result());
         auto arg0_temp = stack_register(args[0]);
         auto result_temp = stack_register(tac.get_result());
 
-        // special case, if we copy the static link, allocate it at -8(%rbp)
+        // special case, if we copy the static link, allocate it at -8(%rbp), unless
+        // nothing reads it back
         if (args.size() == 2) {
-            result_temp = "-8(%rbp)";
+            if (!keeps_static_link)
+                return;
+            result_temp = frame_address(-8);
         }
 
-        os << "\tmovq " << arg0_temp << ", %r10\n";
-        os << "\tmovq %r10, " << result_temp << "\n";
+        move(arg0_temp, result_temp);
     }
     else if (op == "call") {
         auto arg0_temp = stack_register(args[0]);
-        os << "\tcall *" << arg0_temp << "\n";
+
+        // caller saved registers of temporaries living across the call
+        auto around = saved_around.find(&tac);
+        if (around != saved_around.end()) {
+            for (auto &temp : around->second)
+                emit("movq", {registers[temp], compute_offset(temp)});
+        }
+
+        emit("call", {"*" + arg0_temp});
+        frame_in.clear();
 
         if (args_on_stack)
-            os << "\taddq $" << 8 * ((args_on_stack + 1) / 2 * 2) << ", %rsp\n";
+            emit("addq", {"$" + std::to_string(8 * args_on_stack), "%rsp"});
         args_on_stack = 0;
 
         if (tac.has_result()) {
             auto result_temp = stack_register(tac.get_result());
-            os << "\tmovq %rax, " << result_temp << "\n";
+            emit("movq", {"%rax", result_temp});
+        }
+        if (around != saved_around.end()) {
+            for (auto &temp : around->second)
+                emit("movq", {compute_offset(temp), registers[temp]});
         }
     }
     else if (op == "jmp") {
         assert(args.size() == 1 || (args.empty() && tac.has_result()));
         auto label = args.empty() ? tac.get_result() : args[0];
-        os << "\tjmp " << label.substr(1) << "\n";
+        if (!in_frame && framed_labels.count(label))
+            emit_prologue();
+        emit("jmp", {label.substr(1)});
     }
     else if (jumps.count(op)) {
-        assert(args.size() == 1 && tac.has_result());
-        auto arg0_temp = stack_register(args[0]);
-        os << "\tcmpq $0, " << arg0_temp << "\n";
-        os << "\t" << op << " " << tac.get_result().substr(1) << "\n";
+        assert((args.size() == 1 || args.size() == 2) && tac.has_result());
+        compare(args);
+        auto label = tac.get_result();
+        if (!in_frame && framed_labels.count(label)) {
+            auto [it, inserted] = prologues.try_emplace(label, std::format(".Lframe{}", prologue_count));
+            prologue_count += inserted;
+            emit(op, {it->second});
+        }
+        else
+            emit(op, {label.substr(1)});
+    }
+    else if (set_ops.count(op)) {
+        assert(args.size() == 2 && tac.has_result());
+        compare(args);
+        auto result_temp = stack_register(tac.get_result());
+        emit(op, {"%al"});
+        emit("movzbq", {"%al", is_register(result_temp) ? result_temp : "%r10"});
+        move(is_register(result_temp) ? result_temp : "%r10", result_temp);
     }
     else if (auto it = uniops.find(op); it != uniops.end()) {
         assert(args.size() == 1 && tac.has_result());
         auto arg0_temp = stack_register(args[0]);
         auto result_temp = stack_register(tac.get_result());
-        os << "\tmovq " << arg0_temp << ", %r10\n";
-        os << "\t" << it->second << " %r10\n";
-        os << "\tmovq %r10, " << result_temp << "\n";
+        auto reg = is_register(result_temp) ? result_temp : "%r10";
+        move(arg0_temp, reg);
+        emit(it->second, {reg});
+        move(reg, result_temp);
     }
     else if (auto it = normal_binops.find(op); it != normal_binops.end()) {
         assert(args.size() == 2 && tac.has_result());
         auto arg0_temp = stack_register(args[0]);
         auto arg1_temp = stack_register(args[1]);
         auto result_temp = stack_register(tac.get_result());
-        os << "\tmovq " << arg0_temp << ", %r10\n";
-        os << "\t" << it->second << " " << arg1_temp << ", %r10\n";
-        os << "\tmovq %r10, " << result_temp << "\n";
+
+        // the result can already hold the second operand, b - a is -a + b
+        if (is_register(result_temp) && result_temp == arg1_temp && arg0_temp != arg1_temp) {
+            if (op == "sub")
+                emit("negq", {result_temp});
+            emit(op == "sub" ? "addq" : it->second, {arg0_temp, result_temp});
+        }
+        else {
+            auto reg = is_register(result_temp) ? result_temp : "%r10";
+            move(arg0_temp, reg);
+            emit(it->second, {arg1_temp, reg});
+            move(reg, result_temp);
+        }
     }
     else if (auto it = special_binops.find(op); it != special_binops.end()) {
         assert(args.size() == 2 && tac.has_result());
         auto arg0_temp = stack_register(args[0]);
         auto arg1_temp = stack_register(args[1]);
         auto result_temp = stack_register(tac.get_result());
-        it->second(arg0_temp, arg1_temp, result_temp, os);
+        auto lowered = [&](const MM::Temporary& constant, const Register& other) {
+            auto c = constant_of(constant);
+            return c.has_value() && lower_by_constant(op, other, *c, result_temp, code);
+        };
+
+        // shifts by a constant don't need %cl
+        auto amount = constant_of(args[1]);
+        if ((op == "shl" || op == "shr") && amount.has_value() && *amount >= 0 && *amount < 64) {
+            auto reg = is_register(result_temp) ? result_temp : "%r10";
+            move(arg0_temp, reg);
+            emit(op == "shl" ? "salq" : "sarq", {"$" + std::to_string(*amount), reg});
+            move(reg, result_temp);
+        }
+        else if (op == "shl" || op == "shr" || !(lowered(args[1], arg0_temp) || (op == "mul" && lowered(args[0], arg1_temp)))) {
+            // imulq and idivq take no immediate
+            if (is_immediate(arg1_temp) && op != "shl" && op != "shr") {
+                emit("movq", {arg1_temp, "%r10"});
+                arg1_temp = "%r10";
+            }
+            it->second(arg0_temp, arg1_temp, result_temp, code);
+        }
     }
     else if (op == "ret") {
         if (!args.empty()) {
             auto arg0_temp = stack_register(args[0]);
-            os << "\tmovq " << arg0_temp << ", %rax\n";
+            emit("movq", {arg0_temp, "%rax"});
         } 
         else
-            os << "\tmovq $0, %rax\n";
-        os << "\tmovq %rbp, %rsp\n";
-        os << "\tpopq %rbp\n";
-        os << "\tretq\n";
+            emit("movq", {"$0", "%rax"});
+        restore_callee_saved();
+        emit_epilogue();
+        emit("retq");
     }
     else if (op == "param") {
         auto arg0_temp = stack_register(args[0]);
         auto id = std::stoi(tac.get_result());
 
         if (id <= 6)
-            os << "\tmovq " << arg0_temp << ", " << arg_registers[id - 1] << "\n";
+            move(arg0_temp, arg_registers[id - 1]);
         else {
-            os << "\tpushq " << arg0_temp << "\n";
+            // the arguments are pushed last one first, an odd number of them
+            // gets a padding quad so the call stays 16 byte aligned
+            if (args_on_stack == 0 && (id - 6) % 2 == 1) {
+                emit("subq", {"$8", "%rsp"});
+                args_on_stack++;
+            }
+            emit("pushq", {arg0_temp});
             args_on_stack++;
         }
     }
     else if (op == "get_fp") {
         auto result_temp = stack_register(tac.get_result());
-        os << "\tmovq %rbp, %r10\n";
-        os << "\tmovq %r10, " << result_temp << "\n";
+        move("%rbp", result_temp);
     }
     else {
         throw std::runtime_error("Unrecognized operator " + op);
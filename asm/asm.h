@@ -1,6 +1,7 @@
 #pragma once
 #include "../mm/tac.h"
 #include "../mm/mm.h"
+#include "minstr.h"
 #include <fstream>
 #include <set>
 #include <map>
@@ -8,46 +9,137 @@
 
 namespace assembly {
 
-using Register = std::string;
-
 inline const std::array<Register, 6> arg_registers = {
     "%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"
 };
 
+// registers the frames of enclosing functions are loaded into, an instruction
+// reads from at most three different frames
+inline const std::array<Register, 3> frame_registers = {
+    "%r11", "%r12", "%r13"
+};
+
+// registers the allocator gives to temporaries, %r11 joins them in functions which
+// never reach the frames around them; %rax and %r10 stay scratch, and lambdas write
+// %r12 and %r13 without saving them
+inline const std::array<Register, 6> caller_saved_registers = {
+    "%r8", "%r9", "%rcx", "%rdx", "%rsi", "%rdi"
+};
+inline const std::array<Register, 3> callee_saved_registers = {
+    "%rbx", "%r14", "%r15"
+};
+
 class Assembler {
 private:
     MM::MM muncher;
     int args_on_stack;
-    std::size_t stack_offset, stack_size;
+    std::size_t stack_size;
     
     // current function name
     std::string curr_func_name;
 
-    // last register used for walking the static link chain
-    Register last_capture_register;
+    // how many functions each one is nested in
+    std::map<std::string, int> func_depth;
+
+    // registers holding the frame of the function that many static links up,
+    // until the block ends or a call clobbers them
+    std::map<Register, int> frame_in;
+
+    // frame registers the current instruction reads from
+    std::set<Register> frames_used;
 
     std::vector<TAC> instr;
 
     // function in which temporary is defined
     std::map<MM::Temporary, std::string> func_of_temp;
 
-    // keeps the min and max temporaries which are strictly from a function
-    std::map<std::string, std::pair<std::size_t, std::size_t>> bounds;
+    // stack slot of every temporary inside the frame of the function defining it
+    std::map<MM::Temporary, std::size_t> slots;
+
+    // number of slots needed by each function
+    std::map<std::string, std::size_t> frame_slots;
 
     // keeps the assembly name given to a function
     std::map<std::string, std::string> asm_name;
 
+    // code of the procedure being assembled, printed once it's complete
+    std::vector<MInstr> code;
+
+    // whether the code goes through the peephole pass before being printed
+    bool optimize;
+
+    // temporaries only ever set to the same number, when optimizing
+    std::map<MM::Temporary, long long> constants;
+
+    // temporaries read or written by a function other than the one defining them,
+    // and the functions doing it, which need the frame registers
+    std::set<MM::Temporary> captured;
+    std::set<std::string> uses_frames;
+
+    // register of every temporary the allocator kept out of the frame, when optimizing
+    std::map<MM::Temporary, Register> registers;
+
+    // temporaries in a caller saved register living across calls, stored to their
+    // slot before each of these calls and loaded back after it
+    std::set<MM::Temporary> split;
+    std::map<const TAC*, std::vector<MM::Temporary>> saved_around;
+
+    // callee saved registers each function writes, kept in its first slots
+    std::map<std::string, std::vector<Register>> callee_saved;
+
+    // labels of the blocks of the current function which run with a frame, and whether
+    // the code being emitted does; the others address the red zone below %rsp instead
+    std::set<std::string> framed_labels;
+    bool in_frame = true;
+
+    // callee saved registers the blocks without the frame write, saved on entry
+    // instead of along with the frame
+    std::set<Register> saved_early;
+
+    // whether something reads the static link back from -8(%rbp): the function itself
+    // walking out of its frame, or lambdas it hands its frame to
+    bool keeps_static_link = true;
+
+    // labels jumps from a block without a frame go through to set it up, by target
+    std::map<std::string, std::string> prologues;
+    std::size_t prologue_count = 0;
+
+    // instructions printed, and how many of them the peephole pass saved
+    std::size_t emitted = 0, removed = 0;
+
     std::ofstream& os;
 
 public:
-    Assembler(MM::MM& muncher, std::vector<TAC>& _instr, std::ofstream& os);
+    Assembler(MM::MM& muncher, std::vector<TAC>& _instr, std::ofstream& os, bool optimize = false);
+
+    [[nodiscard]] std::size_t instructions() const {
+        return emitted;
+    }
+
+    [[nodiscard]] std::size_t peephole_removed() const {
+        return removed;
+    }
 
     void assemble();
 
 private:
 
-    Register compute_offset(MM::Temporary temp, std::size_t offset, Register offset_register = "%rbp") {
-        return "-" + std::to_string(8 * (std::stoi(temp.substr(1)) - offset + 2)) + "(" + offset_register + ")";
+    void emit(std::string op, std::vector<std::string> operands = {}) {
+        code.push_back(MInstr(std::move(op), std::move(operands)));
+    }
+
+    // offset(%rbp), or the same address through %rsp before the frame is set up,
+    // %rbp would then be right below the return address
+    [[nodiscard]] std::string frame_address(long long offset) const {
+        if (in_frame)
+            return std::to_string(offset) + "(%rbp)";
+        return std::to_string(offset - 8) + "(%rsp)";
+    }
+
+    Register compute_offset(MM::Temporary temp, Register offset_register = "%rbp") {
+        if (offset_register == "%rbp")
+            return frame_address(-8 * static_cast<long long>(slots[temp] + 2));
+        return "-" + std::to_string(8 * (slots[temp] + 2)) + "(" + offset_register + ")";
     }
 
     Register stack_register(const MM::Temporary &temp) {
@@ -57,61 +149,106 @@ private:
 
         assert(temp[0] == '%');
 
+        if (auto it = registers.find(temp); it != registers.end())
+            return it->second;
+        if (auto imm = immediate_of(temp))
+            return *imm;
+
         // parameter
         if (temp[1] == 'p') {
             auto id = std::stoi(temp.substr(2));
             if (id < 6)
                 return arg_registers[id];
-            return std::to_string(8 * (id - 6 + 2)) + "(%rbp)";
+            return frame_address(8 * (id - 6 + 2));
         }
 
         auto origin_func = func_of_temp[temp];
         if (origin_func == curr_func_name)
-            return compute_offset(temp, stack_offset);
-        else {
-            int delta = 0;
-            auto curr = curr_func_name;
-
-            auto get_parent_function = [&](std::string &func_name) {
-                for (auto i = func_name.size() - 1; i >= 0; i--) {
-                    if (func_name[i] == ':')
-                        return func_name.substr(0, i-1);
-                }
-                return std::string();
-            };
-
-            while (curr != origin_func) {
-                curr = get_parent_function(curr);
-                delta++;
-            }
-
-            // special case:
-            // when doing a binary operation with captures and removing dead-copies
-            // we actually remove capture copies
-            // since we were using the same %r11 to iterate on the static link chain
-            // we actually overwrite stuff. a simple solution is to alternate to %r12
-            last_capture_register = last_capture_register != "%r11" ? "%r11" : "%r12";
-
-            os << "\n\t# Capture access, delta = " << delta << " from " << curr_func_name << " to " << origin_func << "\n";
-            os << "\tmovq -8(%rbp), " << last_capture_register << "\n";
-            for (int i = 1; i < delta; i++)
-                os << "\tmovq -8(" << last_capture_register << "), " << last_capture_register << "\n";
-
-            return compute_offset(temp, bounds[curr].first, last_capture_register);
+            return compute_offset(temp);
+        return compute_offset(temp, frame_register(func_depth[curr_func_name] - func_depth[origin_func]));
+    }
+
+    [[nodiscard]] std::optional<long long> constant_of(const MM::Temporary& temp) const {
+        auto it = constants.find(temp);
+        if (it == constants.end())
+            return std::nullopt;
+        return it->second;
+    }
+
+    // constants fitting in an instruction are used as immediates, their const is never emitted
+    [[nodiscard]] std::optional<std::string> immediate_of(const MM::Temporary& temp) const {
+        auto c = constant_of(temp);
+        if (!c.has_value() || *c < INT32_MIN || *c > INT32_MAX)
+            return std::nullopt;
+        return "$" + std::to_string(*c);
+    }
+
+    // movq, through %r10 when both sides are memory
+    void move(const std::string& src, const std::string& dest) {
+        if (src == dest)
+            return;
+        if (is_memory(src) && is_memory(dest)) {
+            emit("movq", {src, "%r10"});
+            emit("movq", {"%r10", dest});
+            return;
         }
+        emit("movq", {src, dest});
     }
 
+    // a register holding the frame delta static links up, loaded from the closest frame we have
+    [[nodiscard]] Register frame_register(int delta);
+
     void process_proc(std::size_t start, std::size_t finish);
 
+    // linear scan over the live ranges of the temporaries of a procedure, fills
+    // registers, split, saved_around and callee_saved (asm/regalloc.cpp)
+    void allocate_registers(std::size_t start, std::size_t finish);
+
+    // slot of the i-th callee saved register the current function writes
+    [[nodiscard]] std::string saved_slot(std::size_t i);
+
+    // whether tac can only run with the frame of the current function set up
+    [[nodiscard]] bool needs_frame(TAC& tac);
+
+    // fills framed_labels: the blocks needing a frame and everything they lead to,
+    // the other blocks run without one (shrink-wrapping)
+    void place_frame(std::size_t start, std::size_t finish);
+
+    void emit_prologue();
+
+    // leaves the frame, if the code being emitted has one
+    void emit_epilogue();
+
+    // the callee saved registers back from their slots, before leaving the function
+    void restore_callee_saved();
+
     void assemble_proc(std::size_t start, std::size_t finish);
 
     void assemble_instr(TAC& tac);
+
+    // sets the flags from the first argument compared with the second one, or with 0
+    void compare(const std::vector<std::string>& args);
+
+    // whether tac is a call marked as a tail call, with next returning its result
+    [[nodiscard]] bool is_tail_call(TAC& tac, TAC& next);
+
+    // jumps to the callee of a tail call, which returns straight to our caller
+    void assemble_tail_call(TAC& tac);
 };
 
+// shifts, lea and multiplications for mul, div and mod by a constant, bit exact with imulq and idivq,
+// false when idivq has to stay
+bool lower_by_constant(const std::string& op, Register a, long long c, Register res, std::vector<MInstr>& code);
+
 static const std::set<std::string> jumps = {
     "jz", "jnz", "jl", "jle", "jg", "jge"
 };
 
+// same names as the jumps, setz is sete
+static const std::set<std::string> set_ops = {
+    "setz", "setnz", "setl", "setle", "setg", "setge"
+};
+
 static const std::map<std::string, std::string> uniops = {
     {"neg", "negq"}, {"not", "notq"}
 };
@@ -120,35 +257,35 @@ static const std::map<std::string, std::string> normal_binops = {
     {"add", "addq"}, {"sub", "subq"}, {"and", "andq"}, {"or", "orq"}, {"xor", "xorq"}
 };
 
-static const std::map<std::string, std::function<void(Register, Register, Register, std::ofstream&)>> special_binops = {
-    {"mul", [](Register a, Register b, Register res, std::ofstream& os) {
-        os << "\tmovq " << a << ", %rax\n";
-        os << "\timulq " << b << "\n";
-        os << "\tmovq %rax, " << res << "\n";
+static const std::map<std::string, std::function<void(Register, Register, Register, std::vector<MInstr>&)>> special_binops = {
+    {"mul", [](Register a, Register b, Register res, std::vector<MInstr>& code) {
+        code.push_back(MInstr("movq", {a, "%rax"}));
+        code.push_back(MInstr("imulq", {b}));
+        code.push_back(MInstr("movq", {"%rax", res}));
     }},
-    {"div", [](Register a, Register b, Register res, std::ofstream& os) {
-        os << "\tmovq " << a << ", %rax\n";
-        os << "\tcqto\n";
-        os << "\tidivq " << b << "\n";
-        os << "\tmovq %rax, " << res << "\n";
+    {"div", [](Register a, Register b, Register res, std::vector<MInstr>& code) {
+        code.push_back(MInstr("movq", {a, "%rax"}));
+        code.push_back(MInstr("cqto"));
+        code.push_back(MInstr("idivq", {b}));
+        code.push_back(MInstr("movq", {"%rax", res}));
     }},
-    {"mod", [](Register a, Register b, Register res, std::ofstream& os) {
-        os << "\tmovq " << a << ", %rax\n";
-        os << "\tcqto\n";
-        os << "\tidivq " << b << "\n";
-        os << "\tmovq %rdx, " << res << "\n";
+    {"mod", [](Register a, Register b, Register res, std::vector<MInstr>& code) {
+        code.push_back(MInstr("movq", {a, "%rax"}));
+        code.push_back(MInstr("cqto"));
+        code.push_back(MInstr("idivq", {b}));
+        code.push_back(MInstr("movq", {"%rdx", res}));
     }},
-    {"shl", [](Register a, Register b, Register res, std::ofstream& os) {
-        os << "\tmovq " << a << ", %r10\n";
-        os << "\tmovq " << b << ", %rcx\n";
-        os << "\tsalq %cl, %r10\n";
-        os << "\tmovq %r10, " << res << "\n";
+    {"shl", [](Register a, Register b, Register res, std::vector<MInstr>& code) {
+        code.push_back(MInstr("movq", {a, "%r10"}));
+        code.push_back(MInstr("movq", {b, "%rcx"}));
+        code.push_back(MInstr("salq", {"%cl", "%r10"}));
+        code.push_back(MInstr("movq", {"%r10", res}));
     }},
-    {"shr", [](Register a, Register b, Register res, std::ofstream& os) {
-        os << "\tmovq " << a << ", %r10\n";
-        os << "\tmovq " << b << ", %rcx\n";
-        os << "\tsarq %cl, %r10\n";
-        os << "\tmovq %r10, " << res << "\n";
+    {"shr", [](Register a, Register b, Register res, std::vector<MInstr>& code) {
+        code.push_back(MInstr("movq", {a, "%r10"}));
+        code.push_back(MInstr("movq", {b, "%rcx"}));
+        code.push_back(MInstr("sarq", {"%cl", "%r10"}));
+        code.push_back(MInstr("movq", {"%r10", res}));
     }}
 };
 
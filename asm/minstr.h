@@ -0,0 +1,72 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <iostream>
+
+namespace assembly {
+
+using Register = std::string;
+
+[[nodiscard]] inline bool is_register(const std::string& operand) {
+    return operand.size() > 1 && operand[0] == '%';
+}
+
+[[nodiscard]] inline bool is_immediate(const std::string& operand) {
+    return !operand.empty() && operand[0] == '$';
+}
+
+// the target of an indirect jump or call isn't an operand in memory
+[[nodiscard]] inline bool is_memory(const std::string& operand) {
+    return !operand.empty() && operand.back() == ')' && operand[0] != '*';
+}
+
+// one line of assembly, kept apart from its text until the whole procedure is
+// emitted so the peephole pass can look at the operands
+struct MInstr {
+    enum Kind { INSTR, LABEL, COMMENT, DIRECTIVE };
+
+    Kind kind;
+    std::string op;
+    std::vector<std::string> operands;
+
+    MInstr(std::string op, std::vector<std::string> operands = {}) : kind(INSTR), op(std::move(op)), operands(std::move(operands)) {}
+
+    [[nodiscard]] static MInstr label(std::string name) {
+        MInstr instr(std::move(name));
+        instr.kind = LABEL;
+        return instr;
+    }
+
+    [[nodiscard]] static MInstr comment(std::string text) {
+        MInstr instr(std::move(text));
+        instr.kind = COMMENT;
+        return instr;
+    }
+
+    [[nodiscard]] static MInstr directive(std::string name, std::vector<std::string> operands = {}) {
+        MInstr instr(std::move(name), std::move(operands));
+        instr.kind = DIRECTIVE;
+        return instr;
+    }
+
+    friend std::ostream& operator << (std::ostream& os, const MInstr& instr) {
+        if (instr.kind == LABEL)
+            return os << instr.op << ":\n";
+        if (instr.kind == COMMENT)
+            return os << "\n\t# " << instr.op << "\n";
+
+        os << "\t" << instr.op;
+        for (std::size_t i = 0; i < instr.operands.size(); i++)
+            os << (i == 0 ? " " : ", ") << instr.operands[i];
+        return os << "\n";
+    }
+};
+
+// rewrites the code of a procedure into a shorter equivalent, what registers hold
+// is only tracked within a block, and only %r10 is known to be dead at its end
+void peephole(std::vector<MInstr>& code);
+
+// aligns the labels which a later jump goes back to, the tops of loops
+void align_loops(std::vector<MInstr>& code);
+
+};
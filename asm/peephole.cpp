@@ -0,0 +1,528 @@
+#include "minstr.h"
+#include <map>
+#include <set>
+#include <optional>
+
+namespace assembly {
+
+namespace {
+
+// %r10 only ever carries a value inside the template of one TAC instruction
+const Register SCRATCH = "%r10";
+
+const std::map<std::string, std::string> inverted_jumps = {
+    {"jz", "jnz"}, {"jnz", "jz"}, {"jl", "jge"}, {"jge", "jl"},
+    {"jle", "jg"}, {"jg", "jle"}, {"js", "jns"}, {"jns", "js"}
+};
+
+const std::map<Register, Register> full_registers = {
+    {"%eax", "%rax"}, {"%ebx", "%rbx"}, {"%ecx", "%rcx"}, {"%edx", "%rdx"},
+    {"%esi", "%rsi"}, {"%edi", "%rdi"}, {"%al", "%rax"}, {"%cl", "%rcx"},
+    {"%r8d", "%r8"}, {"%r9d", "%r9"}, {"%r10d", "%r10"}, {"%r11d", "%r11"}
+};
+
+const std::map<Register, Register> low_registers = {
+    {"%rax", "%eax"}, {"%rbx", "%ebx"}, {"%rcx", "%ecx"}, {"%rdx", "%edx"}, {"%rsi", "%esi"}, {"%rdi", "%edi"},
+    {"%r8", "%r8d"}, {"%r9", "%r9d"}, {"%r10", "%r10d"}, {"%r11", "%r11d"}, {"%r12", "%r12d"}, {"%r13", "%r13d"},
+    {"%r14", "%r14d"}, {"%r15", "%r15d"}
+};
+
+[[nodiscard]] Register full(const Register& reg) {
+    auto it = full_registers.find(reg);
+    return it == full_registers.end() ? reg : it->second;
+}
+
+// every register an operand reads, the base of a memory operand included
+[[nodiscard]] std::set<Register> registers_of(const std::string& operand) {
+    std::set<Register> regs;
+    for (std::size_t i = 0; i < operand.size(); i++) {
+        if (operand[i] != '%')
+            continue;
+        auto j = i + 1;
+        while (j < operand.size() && std::isalnum(operand[j]))
+            j++;
+        regs.insert(full(operand.substr(i, j - i)));
+        i = j - 1;
+    }
+    return regs;
+}
+
+// stack slots and globals are whole quads, two slots off the same base with
+// different offsets are different memory, anything else off a register might be the same
+[[nodiscard]] bool may_alias(const std::string& a, const std::string& b) {
+    if (a == b)
+        return true;
+    auto base = [](const std::string& operand) {
+        return operand.substr(operand.find('('));
+    };
+    bool a_global = base(a) == "(%rip)", b_global = base(b) == "(%rip)";
+    if (a_global || b_global)
+        return false;
+    return base(a) != base(b);
+}
+
+// what an instruction reads and writes, unknown instructions end the tracking
+struct Effect {
+    bool known = true;
+    std::set<Register> reads, writes;
+    std::optional<std::string> store;
+    bool reads_flags = false, writes_flags = false;
+    // the flags describe the value written, and OF is cleared like cmpq $0 would
+    bool logic_flags = false, arith_flags = false;
+};
+
+[[nodiscard]] Effect effect_of(const MInstr& instr) {
+    Effect effect;
+    if (instr.kind != MInstr::INSTR) {
+        effect.known = instr.kind == MInstr::COMMENT;
+        return effect;
+    }
+
+    auto &op = instr.op;
+    auto &operands = instr.operands;
+    for (auto &operand : operands) {
+        auto regs = registers_of(operand);
+        // a register destination is read only by the instructions combining it
+        if (&operand == &operands.back() && is_register(operand) && operands.size() == 2)
+            continue;
+        effect.reads.insert(regs.begin(), regs.end());
+    }
+
+    auto write_destination = [&]() {
+        auto &dest = operands.back();
+        if (is_register(dest))
+            effect.writes.insert(full(dest));
+        else if (is_memory(dest))
+            effect.store = dest;
+        else
+            effect.known = false;
+    };
+
+    if (op == "movq" || op == "movabsq" || op == "movl" || op == "movzbq" || op == "leaq") {
+        write_destination();
+    }
+    else if (op == "addq" || op == "subq" || op == "andq" || op == "orq" || op == "xorq" || op == "xorl" ||
+             op == "salq" || op == "sarq" || op == "shrq" || (op == "imulq" && operands.size() == 2)) {
+        if (is_register(operands.back()))
+            effect.reads.insert(full(operands.back()));
+        write_destination();
+        effect.writes_flags = true;
+        effect.logic_flags = op == "andq" || op == "orq" || op == "xorq";
+        effect.arith_flags = op == "addq" || op == "subq";
+    }
+    else if (op == "negq" || op == "notq") {
+        write_destination();
+        effect.writes_flags = op == "negq";
+        effect.arith_flags = op == "negq";
+    }
+    else if (op == "imulq" && operands.size() == 3) {
+        write_destination();
+        effect.writes_flags = true;
+    }
+    else if (op == "imulq" && operands.size() == 1) {
+        effect.reads.insert("%rax");
+        effect.writes = {"%rax", "%rdx"};
+        effect.writes_flags = true;
+    }
+    else if (op == "idivq") {
+        effect.reads.insert({"%rax", "%rdx"});
+        effect.writes = {"%rax", "%rdx"};
+        effect.writes_flags = true;
+    }
+    else if (op == "cqto") {
+        effect.reads.insert("%rax");
+        effect.writes.insert("%rdx");
+    }
+    else if (op == "cmpq" || op == "testq") {
+        effect.reads.insert(full(operands.back()));
+        effect.writes_flags = true;
+    }
+    else if (inverted_jumps.count(op)) {
+        effect.reads_flags = true;
+    }
+    else if (op.starts_with("set")) {
+        // only the low byte, the rest of the register is still there
+        effect.reads.insert(full(operands[0]));
+        write_destination();
+        effect.reads_flags = true;
+    }
+    else if (op == "pushq") {
+        effect.reads.insert("%rsp");
+        effect.writes.insert("%rsp");
+        effect.store = "0(%rsp)";
+    }
+    else if (op == "popq") {
+        effect.reads.insert("%rsp");
+        effect.writes.insert("%rsp");
+        write_destination();
+    }
+    else
+        effect.known = false;
+
+    if (effect.store.has_value() && !effect.known)
+        effect.store.reset();
+    return effect;
+}
+
+[[nodiscard]] bool is_control(const MInstr& instr) {
+    return instr.kind == MInstr::LABEL || instr.op == "jmp" || instr.op == "retq" || instr.op == "call" ||
+           inverted_jumps.count(instr.op);
+}
+
+// whether the scratch register holds nothing needed after position pos, it only
+// carries a value inside one template, so it dies at the end of the block or at a
+// call not going through it
+[[nodiscard]] bool scratch_dead_after(const std::vector<MInstr>& code, std::size_t pos) {
+    for (auto i = pos + 1; i < code.size(); i++) {
+        auto &instr = code[i];
+        if (instr.kind == MInstr::COMMENT)
+            continue;
+        if (is_control(instr)) {
+            // a tail call jumps through the scratch register
+            for (auto &operand : instr.operands) {
+                if (registers_of(operand).count(SCRATCH))
+                    return false;
+            }
+            return true;
+        }
+        auto effect = effect_of(instr);
+        if (!effect.known || effect.reads.count(SCRATCH))
+            return false;
+        if (effect.writes.count(SCRATCH))
+            return true;
+    }
+    return true;
+}
+
+// whether the flags are set again before anything reads them
+[[nodiscard]] bool flags_dead_after(const std::vector<MInstr>& code, std::size_t pos) {
+    for (auto i = pos + 1; i < code.size(); i++) {
+        auto &instr = code[i];
+        if (instr.kind == MInstr::COMMENT)
+            continue;
+        if (inverted_jumps.count(instr.op))
+            return false;
+        if (is_control(instr))
+            return true;
+        auto effect = effect_of(instr);
+        if (!effect.known || effect.reads_flags)
+            return false;
+        if (effect.writes_flags)
+            return true;
+    }
+    return true;
+}
+
+// the operand with the scratch register read through reg instead, nothing when
+// it only uses a part of the scratch register
+[[nodiscard]] std::optional<std::string> through(const std::string& operand, const Register& reg) {
+    std::string result;
+    for (std::size_t i = 0; i < operand.size(); i++) {
+        if (operand[i] != '%') {
+            result += operand[i];
+            continue;
+        }
+        auto j = i + 1;
+        while (j < operand.size() && std::isalnum(operand[j]))
+            j++;
+        auto name = operand.substr(i, j - i);
+        if (name != SCRATCH && full(name) == SCRATCH)
+            return std::nullopt;
+        result += name == SCRATCH ? reg : name;
+        i = j - 1;
+    }
+    return result;
+}
+
+// registers known to hold the same value as a memory operand or an immediate,
+// and the register the flags were last set from
+struct Values {
+    std::map<Register, std::string> mirror;
+    std::optional<Register> flags_of;
+    bool logic_flags = false;
+
+    void clear() {
+        mirror.clear();
+        flags_of.reset();
+    }
+
+    void write_register(const Register& reg) {
+        mirror.erase(reg);
+        std::erase_if(mirror, [&](auto &entry) { return registers_of(entry.second).count(reg) > 0; });
+        if (flags_of == reg)
+            flags_of.reset();
+    }
+
+    void write_memory(const std::string& memory) {
+        std::erase_if(mirror, [&](auto &entry) { return is_memory(entry.second) && may_alias(entry.second, memory); });
+    }
+
+    [[nodiscard]] std::optional<Register> holding(const std::string& value) const {
+        for (auto &[reg, mirrored] : mirror) {
+            if (mirrored == value)
+                return reg;
+        }
+        return std::nullopt;
+    }
+};
+
+// drops reloads of values already in a register and compares of values the
+// flags already describe
+bool forward_values(std::vector<MInstr>& code) {
+    bool changed = false;
+    std::vector<MInstr> result;
+    Values values;
+
+    for (std::size_t i = 0; i < code.size(); i++) {
+        auto instr = code[i];
+        auto &operands = instr.operands;
+
+        if (instr.kind == MInstr::COMMENT) {
+            result.push_back(instr);
+            continue;
+        }
+
+        if (instr.op == "movq" && instr.kind == MInstr::INSTR) {
+            auto &src = operands[0], &dest = operands[1];
+            // the destination already has the value
+            if (src == dest || (is_register(dest) && values.mirror.count(dest) && values.mirror[dest] == src) ||
+                (is_register(src) && values.mirror.count(src) && values.mirror[src] == dest)) {
+                changed = true;
+                continue;
+            }
+            // a load of something a register still has
+            if (is_memory(src) && is_register(dest)) {
+                if (auto reg = values.holding(src)) {
+                    src = *reg;
+                    changed = true;
+                }
+            }
+        }
+
+        if (instr.op == "cmpq" && operands[0] == "$0" && i + 1 < code.size() && inverted_jumps.count(code[i + 1].op)) {
+            auto &value = operands[1];
+            auto reg = is_register(value) ? std::optional<Register>(value) : values.holding(value);
+            auto flags_of = values.flags_of;
+            if (flags_of.has_value() && (*flags_of == value || (values.mirror.count(*flags_of) && values.mirror[*flags_of] == value))) {
+                // add and sub leave OF set on overflow, a compare with zero clears it
+                auto &jump = code[i + 1].op;
+                if (values.logic_flags || jump == "jz" || jump == "jnz") {
+                    changed = true;
+                    continue;
+                }
+                if (jump == "jl" || jump == "jge") {
+                    jump = jump == "jl" ? "js" : "jns";
+                    changed = true;
+                    continue;
+                }
+            }
+            if (reg.has_value()) {
+                instr = MInstr("testq", {*reg, *reg});
+                changed = true;
+            }
+        }
+
+        // a callee can write our frame through a static link, and other blocks jump to labels
+        auto effect = effect_of(instr);
+        if (!effect.known || is_control(instr)) {
+            values.clear();
+            result.push_back(instr);
+            continue;
+        }
+
+        for (auto &reg : effect.writes)
+            values.write_register(reg);
+        if (effect.store.has_value())
+            values.write_memory(*effect.store);
+
+        if (instr.op == "movq" || instr.op == "movabsq") {
+            auto &src = operands[0], &dest = operands[1];
+            // walking the static links loads a register through itself
+            if (is_register(dest) && (is_memory(src) || is_immediate(src)) && !registers_of(src).count(dest))
+                values.mirror[dest] = src;
+            else if (is_register(dest) && values.mirror.count(src))
+                values.mirror[dest] = values.mirror[src];
+            else if (is_register(src) && is_memory(dest))
+                values.mirror[src] = dest;
+        }
+
+        if (effect.writes_flags) {
+            values.flags_of.reset();
+            auto &dest = operands.back();
+            if ((effect.logic_flags || effect.arith_flags) && is_register(dest))
+                values.flags_of = dest, values.logic_flags = effect.logic_flags;
+            if (instr.op == "testq" && operands[0] == operands[1])
+                values.flags_of = operands[0], values.logic_flags = true;
+        }
+
+        result.push_back(instr);
+    }
+
+    code = std::move(result);
+    return changed;
+}
+
+// movq %reg, %r10 when %r10 is only read until it dies or is set again, and %reg
+// keeps its value until then: the reads take %reg and the copy goes away
+bool forward_scratch(std::vector<MInstr>& code) {
+    bool changed = false;
+    std::vector<MInstr> result;
+
+    // the instructions after the copy at pos up to where the copy isn't needed anymore
+    auto forward = [&](std::size_t pos) -> std::optional<std::vector<MInstr>> {
+        auto source = code[pos].operands[0];
+        std::vector<MInstr> rewritten;
+        for (auto i = pos + 1; i < code.size(); i++) {
+            auto instr = code[i];
+            if (instr.kind == MInstr::COMMENT) {
+                rewritten.push_back(instr);
+                continue;
+            }
+            // like in scratch_dead_after, the scratch register dies at the end of a block
+            if (is_control(instr)) {
+                for (auto &operand : instr.operands) {
+                    if (registers_of(operand).count(SCRATCH))
+                        return std::nullopt;
+                }
+                return rewritten;
+            }
+
+            auto effect = effect_of(instr);
+            if (!effect.known)
+                return std::nullopt;
+            // a register destination which is set keeps its name
+            bool sets_scratch = effect.writes.count(SCRATCH) > 0;
+            auto &operands = instr.operands;
+            for (std::size_t j = 0; j + sets_scratch < operands.size(); j++) {
+                auto operand = through(operands[j], source);
+                if (!operand.has_value())
+                    return std::nullopt;
+                operands[j] = *operand;
+            }
+            effect = effect_of(instr);
+            if (!effect.known || effect.reads.count(SCRATCH))
+                return std::nullopt;
+            rewritten.push_back(instr);
+
+            if (sets_scratch)
+                return rewritten;
+            if (effect.writes.count(source))
+                return scratch_dead_after(code, i) ? std::optional(rewritten) : std::nullopt;
+        }
+        return rewritten;
+    };
+
+    for (std::size_t i = 0; i < code.size(); i++) {
+        auto &instr = code[i];
+        if (instr.kind == MInstr::INSTR && instr.op == "movq" && instr.operands[1] == SCRATCH &&
+            is_register(instr.operands[0]) && full(instr.operands[0]) == instr.operands[0] && instr.operands[0] != SCRATCH) {
+            if (auto rewritten = forward(i)) {
+                result.insert(result.end(), rewritten->begin(), rewritten->end());
+                i += rewritten->size();
+                changed = true;
+                continue;
+            }
+        }
+        result.push_back(instr);
+    }
+
+    code = std::move(result);
+    return changed;
+}
+
+// rewrites looking at a few instructions at once
+bool combine(std::vector<MInstr>& code) {
+    bool changed = false;
+    std::vector<MInstr> result;
+
+    auto next_label = [&](std::size_t pos) -> std::optional<std::string> {
+        for (auto i = pos + 1; i < code.size(); i++) {
+            if (code[i].kind == MInstr::LABEL)
+                return code[i].op;
+            if (code[i].kind != MInstr::COMMENT)
+                return std::nullopt;
+        }
+        return std::nullopt;
+    };
+
+    for (std::size_t i = 0; i < code.size(); i++) {
+        auto instr = code[i];
+        auto &operands = instr.operands;
+
+        if (instr.kind != MInstr::INSTR) {
+            result.push_back(instr);
+            continue;
+        }
+
+        // falls through anyway
+        if (instr.op == "jmp" && next_label(i) == operands[0]) {
+            changed = true;
+            continue;
+        }
+
+        // jcc L1; jmp L2; L1: becomes the opposite jump to L2
+        if (inverted_jumps.count(instr.op) && i + 1 < code.size() && code[i + 1].op == "jmp" &&
+            code[i + 1].kind == MInstr::INSTR && next_label(i + 1) == operands[0]) {
+            result.push_back(MInstr(inverted_jumps.at(instr.op), {code[i + 1].operands[0]}));
+            changed = true;
+            i++;
+            continue;
+        }
+
+        // a value passing through the scratch register, at most one side can be memory
+        if (instr.op == "movq" && operands[1] == SCRATCH && i + 1 < code.size() && code[i + 1].kind == MInstr::INSTR &&
+            code[i + 1].op == "movq" && code[i + 1].operands[0] == SCRATCH && scratch_dead_after(code, i + 1)) {
+            auto &src = operands[0], &dest = code[i + 1].operands[1];
+            if (!is_memory(src) || !is_memory(dest)) {
+                result.push_back(MInstr("movq", {src, dest}));
+                changed = true;
+                i++;
+                continue;
+            }
+        }
+
+        // xorl is shorter and clears the whole register, but it sets the flags
+        if (instr.op == "movq" && operands[0] == "$0" && low_registers.count(operands[1]) && flags_dead_after(code, i)) {
+            auto &low = low_registers.at(operands[1]);
+            result.push_back(MInstr("xorl", {low, low}));
+            changed = true;
+            continue;
+        }
+
+        result.push_back(instr);
+    }
+
+    code = std::move(result);
+    return changed;
+}
+
+}
+
+void peephole(std::vector<MInstr>& code) {
+    for (bool changed = true; changed;) {
+        changed = forward_values(code);
+        changed |= forward_scratch(code);
+        changed |= combine(code);
+    }
+}
+
+void align_loops(std::vector<MInstr>& code) {
+    std::set<std::string> seen, targets;
+    for (auto &instr : code) {
+        if (instr.kind == MInstr::LABEL)
+            seen.insert(instr.op);
+        else if (instr.kind == MInstr::INSTR && (instr.op == "jmp" || inverted_jumps.count(instr.op)) && seen.count(instr.operands[0]))
+            targets.insert(instr.operands[0]);
+    }
+
+    // padded to 16 bytes unless that takes more than 10, like gcc does
+    std::vector<MInstr> result;
+    for (auto &instr : code) {
+        if (instr.kind == MInstr::LABEL && targets.count(instr.op))
+            result.push_back(MInstr::directive(".p2align", {"4", "", "10"}));
+        result.push_back(std::move(instr));
+    }
+    code = std::move(result);
+}
+
+};
@@ -0,0 +1,467 @@
+#include "asm.h"
+#include <algorithm>
+
+namespace assembly {
+
+namespace {
+
+// the k-th instruction of a procedure reads its operands at 4k, loses the registers
+// it clobbers at 4k + 1 and writes its result at 4k + 2
+constexpr std::size_t STEP = 4, READ = 0, CLOBBER = 1, WRITE = 2;
+
+// uses in loops count 10 times more than around them, up to this depth
+constexpr std::size_t MAX_WEIGHT_DEPTH = 5;
+
+// positions something is live at, sorted, inclusive on both ends
+struct Ranges {
+    std::vector<std::pair<std::size_t, std::size_t>> list;
+
+    void add(std::size_t from, std::size_t to) {
+        list.emplace_back(from, to);
+    }
+
+    void normalize() {
+        std::sort(list.begin(), list.end());
+        std::vector<std::pair<std::size_t, std::size_t>> merged;
+        for (auto &[from, to] : list) {
+            if (!merged.empty() && from <= merged.back().second + 1)
+                merged.back().second = std::max(merged.back().second, to);
+            else
+                merged.emplace_back(from, to);
+        }
+        list = std::move(merged);
+    }
+
+    // both lists are sorted, so one pass over them keeps them that way
+    void merge(const Ranges& other) {
+        std::vector<std::pair<std::size_t, std::size_t>> merged;
+        merged.reserve(list.size() + other.list.size());
+        std::size_t i = 0, j = 0;
+        while (i < list.size() || j < other.list.size()) {
+            auto &next = j == other.list.size() || (i < list.size() && list[i] < other.list[j]) ? list[i++] : other.list[j++];
+            if (!merged.empty() && next.first <= merged.back().second + 1)
+                merged.back().second = std::max(merged.back().second, next.second);
+            else
+                merged.push_back(next);
+        }
+        list = std::move(merged);
+    }
+
+    [[nodiscard]] std::size_t start() const {
+        return list.front().first;
+    }
+
+    [[nodiscard]] std::size_t end() const {
+        return list.back().second;
+    }
+
+    // the first range not ending before pos
+    [[nodiscard]] std::size_t find(std::size_t pos) const {
+        return std::lower_bound(list.begin(), list.end(), pos, [](auto& range, std::size_t p) { return range.second < p; }) - list.begin();
+    }
+
+    [[nodiscard]] bool covers(std::size_t pos) const {
+        auto i = find(pos);
+        return i < list.size() && list[i].first <= pos;
+    }
+
+    [[nodiscard]] bool intersects(const Ranges& other) const {
+        if (list.empty() || other.list.empty())
+            return false;
+        std::size_t i = find(other.start()), j = other.find(start());
+        while (i < list.size() && j < other.list.size()) {
+            if (list[i].second < other.list[j].first)
+                i++;
+            else if (other.list[j].second < list[i].first)
+                j++;
+            else
+                return true;
+        }
+        return false;
+    }
+};
+
+// a temporary competing for a register, what it costs to leave it in memory is
+// its reads and writes, weighted by the loops around them
+struct Interval {
+    MM::Temporary temp;
+    Ranges ranges;
+    double cost = 0;
+    // calls it lives across, and what storing and reloading it around them costs
+    std::vector<std::size_t> calls;
+    double split_cost = 0;
+};
+
+[[nodiscard]] bool ends_block(const TAC& tac) {
+    auto op = tac.get_opcode();
+    return op == "jmp" || op == "ret" || jumps.count(op);
+}
+
+[[nodiscard]] std::optional<std::size_t> param_index(const std::string& value) {
+    if (value.size() < 3 || value[0] != '%' || value[1] != 'p')
+        return std::nullopt;
+    auto id = std::stoul(value.substr(2));
+    if (id >= arg_registers.size())
+        return std::nullopt;
+    return id;
+}
+
+}
+
+void Assembler::allocate_registers(std::size_t start, std::size_t finish) {
+    auto func_name = instr[start].get_result();
+    auto n = finish - start;
+    auto at = [&](std::size_t k) -> TAC& { return instr[start + 1 + k]; };
+
+    // the temporaries of the function nobody else reaches and which aren't immediates,
+    // and the parameters still in the registers they came in
+    auto candidate = [&](const std::string& value) {
+        return value.size() > 1 && value[0] == '%' && std::isdigit(value[1]) && func_of_temp[value] == func_name &&
+               !captured.count(value) && !immediate_of(value).has_value();
+    };
+    auto tracked = [&](const std::string& value) {
+        return candidate(value) || param_index(value).has_value();
+    };
+
+    std::vector<std::vector<std::string>> uses(n), defs(n);
+    for (std::size_t k = 0; k < n; k++) {
+        auto &tac = at(k);
+        for (auto &arg : tac.get_args()) {
+            if (tracked(arg))
+                uses[k].push_back(arg);
+        }
+        // the copy of the static link goes to -8(%rbp), not to its result
+        bool static_link = tac.get_opcode() == "copy" && tac.get_args().size() == 2;
+        if (tac.has_result() && !static_link && tracked(tac.get_result()))
+            defs[k].push_back(tac.get_result());
+    }
+
+    // blocks of the flat code, and the ones control goes to after each of them
+    std::vector<std::size_t> first, last;
+    std::map<std::string, std::size_t> block_of;
+    for (std::size_t k = 0; k < n; k++) {
+        if (k == 0 || at(k).get_opcode() == "label" || ends_block(at(k - 1))) {
+            if (k > 0)
+                last.push_back(k - 1);
+            first.push_back(k);
+        }
+        if (at(k).get_opcode() == "label")
+            block_of[at(k).get_arg()] = first.size() - 1;
+    }
+    last.push_back(n - 1);
+
+    auto blocks = first.size();
+    std::vector<std::vector<std::size_t>> succs(blocks);
+    for (std::size_t b = 0; b < blocks; b++) {
+        auto &tac = at(last[b]);
+        auto op = tac.get_opcode();
+        if (op == "jmp" || jumps.count(op)) {
+            auto label = tac.get_args().empty() || jumps.count(op) ? tac.get_result() : tac.get_arg();
+            succs[b].push_back(block_of.at(label));
+        }
+        if (op != "jmp" && op != "ret" && b + 1 < blocks)
+            succs[b].push_back(b + 1);
+    }
+
+    // liveness over the blocks, backwards until nothing changes
+    std::vector<std::set<std::string>> gen(blocks), kill(blocks), live_in(blocks), live_out(blocks);
+    for (std::size_t b = 0; b < blocks; b++) {
+        for (auto k = first[b]; k <= last[b]; k++) {
+            for (auto &use : uses[k]) {
+                if (!kill[b].count(use))
+                    gen[b].insert(use);
+            }
+            kill[b].insert(defs[k].begin(), defs[k].end());
+        }
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto b = blocks; b-- > 0;) {
+            std::set<std::string> out;
+            for (auto s : succs[b])
+                out.insert(live_in[s].begin(), live_in[s].end());
+            auto in = gen[b];
+            for (auto &temp : out) {
+                if (!kill[b].count(temp))
+                    in.insert(temp);
+            }
+            if (in != live_in[b] || out != live_out[b]) {
+                live_in[b] = std::move(in);
+                live_out[b] = std::move(out);
+                changed = true;
+            }
+        }
+    }
+
+    // the operands of imulq and idivq are read after %rax and %rdx are gone, a
+    // multiplication by a constant becomes shifts and adds which leave %rdx alone
+    auto read_late = [&](const TAC& tac) {
+        auto op = tac.get_opcode();
+        if (op == "mul")
+            return !constant_of(tac.get_args()[0]).has_value() && !constant_of(tac.get_args()[1]).has_value();
+        return op == "div" || op == "mod";
+    };
+
+    // shifts by a constant don't go through %cl
+    auto shifts_by_cl = [&](const TAC& tac) {
+        auto op = tac.get_opcode();
+        if (op != "shl" && op != "shr")
+            return false;
+        auto amount = constant_of(tac.get_args()[1]);
+        return !amount.has_value() || *amount < 0 || *amount >= 64;
+    };
+
+    // live ranges, each block from its end to its start
+    std::map<std::string, Ranges> ranges;
+    for (std::size_t b = 0; b < blocks; b++) {
+        std::map<std::string, std::size_t> end;
+        for (auto &temp : live_out[b])
+            end[temp] = STEP * last[b] + STEP - 1;
+        for (auto k = last[b] + 1; k-- > first[b];) {
+            for (auto &def : defs[k]) {
+                auto it = end.find(def);
+                ranges[def].add(STEP * k + WRITE, it == end.end() ? STEP * k + WRITE : it->second);
+                if (it != end.end())
+                    end.erase(it);
+            }
+            for (auto &use : uses[k])
+                end.emplace(use, STEP * k + (read_late(at(k)) ? CLOBBER : READ));
+        }
+        for (auto &[temp, to] : end)
+            ranges[temp].add(STEP * first[b], to);
+    }
+    for (auto &[_, r] : ranges)
+        r.normalize();
+
+    // loops of the flat code are the stretches jumped back over
+    std::vector<std::size_t> depth(n);
+    for (std::size_t k = 0; k < n; k++) {
+        auto &tac = at(k);
+        if (tac.get_opcode() != "jmp" && !jumps.count(tac.get_opcode()))
+            continue;
+        auto label = tac.get_args().empty() || jumps.count(tac.get_opcode()) ? tac.get_result() : tac.get_arg();
+        auto top = first[block_of.at(label)];
+        for (auto j = top; j <= k && top <= k; j++)
+            depth[j]++;
+    }
+    auto weight = [&](std::size_t k) {
+        double w = 1;
+        for (std::size_t d = 0; d < std::min(depth[k], MAX_WEIGHT_DEPTH); d++)
+            w *= 10;
+        return w;
+    };
+
+    // what the instructions take from the allocator: parameters still in their
+    // registers, arguments waiting for their call, and the registers clobbered
+    bool frames = uses_frames.count(func_name) > 0;
+    std::vector<Register> caller(caller_saved_registers.begin(), caller_saved_registers.end());
+    std::vector<Register> callee(callee_saved_registers.begin(), callee_saved_registers.end());
+    if (!frames)
+        caller.insert(caller.begin(), frame_registers[0]);
+
+    std::map<Register, Ranges> fixed;
+    std::vector<std::size_t> calls;
+    for (auto &[temp, r] : ranges) {
+        if (auto id = param_index(temp))
+            fixed[arg_registers[*id]].merge(r);
+    }
+    for (std::size_t k = 0; k < n; k++) {
+        auto &tac = at(k);
+        auto op = tac.get_opcode();
+        if (op == "call")
+            calls.push_back(k);
+        else if (read_late(tac))
+            fixed["%rdx"].add(STEP * k + CLOBBER, STEP * k + CLOBBER);
+        else if (shifts_by_cl(tac))
+            fixed["%rcx"].add(STEP * k + CLOBBER, STEP * k + CLOBBER);
+        else if (op == "param" && std::stoul(tac.get_result()) <= arg_registers.size()) {
+            auto call = k;
+            while (call + 1 < n && at(call).get_opcode() != "call")
+                call++;
+            fixed[arg_registers[std::stoul(tac.get_result()) - 1]].add(STEP * k + CLOBBER, STEP * call + READ);
+        }
+    }
+    for (auto &[_, r] : fixed)
+        r.normalize();
+
+    std::vector<Interval> intervals;
+    for (auto &[temp, r] : ranges) {
+        if (!candidate(temp))
+            continue;
+        auto &interval = intervals.emplace_back();
+        interval.temp = temp;
+        interval.ranges = r;
+        // calls are sorted, only the ones between its ends are looked at
+        auto from = std::lower_bound(calls.begin(), calls.end(), r.start() / STEP);
+        for (std::size_t i = 0; from != calls.end() && i < r.list.size(); ) {
+            auto pos = STEP * *from + CLOBBER;
+            if (pos < r.list[i].first)
+                from++;
+            else if (pos > r.list[i].second)
+                i++;
+            else {
+                interval.calls.push_back(*from);
+                interval.split_cost += 2 * weight(*from);
+                from++;
+            }
+        }
+    }
+    std::map<std::string, Interval*> interval_of;
+    for (auto &interval : intervals)
+        interval_of[interval.temp] = &interval;
+
+    // copies between temporaries, parameters and arguments want to end up in the same register
+    std::map<std::string, std::vector<std::string>> hints;
+    for (std::size_t k = 0; k < n; k++) {
+        auto &tac = at(k);
+        for (auto &value : uses[k]) {
+            if (interval_of.count(value))
+                interval_of[value]->cost += weight(k);
+        }
+        for (auto &value : defs[k]) {
+            if (interval_of.count(value))
+                interval_of[value]->cost += weight(k);
+        }
+        if (tac.get_opcode() == "copy" && tac.get_args().size() == 1 && tac.has_result())
+            hints[tac.get_result()].push_back(tac.get_arg());
+        if (tac.get_opcode() == "param" && std::stoul(tac.get_result()) <= arg_registers.size())
+            hints[tac.get_arg()].push_back("%p" + std::to_string(std::stoul(tac.get_result()) - 1));
+    }
+
+    std::sort(intervals.begin(), intervals.end(), [](auto& a, auto& b) {
+        return a.ranges.list.front() < b.ranges.list.front();
+    });
+    interval_of.clear();
+    for (auto &interval : intervals)
+        interval_of[interval.temp] = &interval;
+
+    // intervals holding a register where the current one starts (active) or in a hole
+    // there (inactive), the ones ending before it are done with (Traub et al.)
+    std::vector<Interval*> active, inactive;
+    std::set<Register> saved;
+    std::map<std::string, Register> assigned;
+    auto is_caller_saved = [&](const Register& reg) {
+        return std::find(caller.begin(), caller.end(), reg) != caller.end();
+    };
+    auto assign = [&](Interval& interval, const Register& reg) {
+        assigned[interval.temp] = reg;
+        active.push_back(&interval);
+        if (!is_caller_saved(reg))
+            saved.insert(reg);
+    };
+    // the intervals already in reg which overlap this one
+    auto in_the_way = [&](const Interval& interval, const Register& reg) {
+        std::vector<Interval*> others;
+        for (auto list : {&active, &inactive}) {
+            for (auto other : *list) {
+                if (assigned.at(other->temp) == reg && other->ranges.intersects(interval.ranges))
+                    others.push_back(other);
+            }
+        }
+        return others;
+    };
+    auto taken = [&](const Interval& interval, const Register& reg) {
+        return fixed[reg].intersects(interval.ranges) || !in_the_way(interval, reg).empty();
+    };
+    auto free_for = [&](const Interval& interval, const Register& reg) {
+        return !taken(interval, reg) && (!is_caller_saved(reg) || interval.calls.empty());
+    };
+
+    for (auto &interval : intervals) {
+        auto pos = interval.ranges.start();
+        std::vector<Interval*> now_active, now_inactive;
+        for (auto list : {&active, &inactive}) {
+            for (auto other : *list) {
+                if (other->ranges.end() >= pos)
+                    (other->ranges.covers(pos) ? now_active : now_inactive).push_back(other);
+            }
+        }
+        active = std::move(now_active);
+        inactive = std::move(now_inactive);
+
+        // the register of a copy first, then a caller saved one when no call is in
+        // the way, then a callee saved one already paid for
+        std::vector<Register> order;
+        for (auto &hint : hints[interval.temp]) {
+            if (auto id = param_index(hint))
+                order.push_back(arg_registers[*id]);
+            else if (assigned.count(hint))
+                order.push_back(assigned[hint]);
+        }
+        order.insert(order.end(), caller.begin(), caller.end());
+        for (auto &reg : callee) {
+            if (saved.count(reg))
+                order.push_back(reg);
+        }
+        order.insert(order.end(), callee.begin(), callee.end());
+
+        std::erase_if(order, [&](auto& r) {
+            return !is_caller_saved(r) && std::find(callee.begin(), callee.end(), r) == callee.end();
+        });
+        auto reg = std::find_if(order.begin(), order.end(), [&](auto& r) { return free_for(interval, r); });
+        if (reg != order.end()) {
+            assign(interval, *reg);
+            continue;
+        }
+
+        // otherwise the cheapest of leaving it in memory, keeping it in a caller saved
+        // register stored around the calls (splitting it at them), or taking the
+        // register of the intervals costing less
+        double best = interval.cost;
+        std::optional<Register> split_into, evict_from;
+        for (auto &r : caller) {
+            if (!taken(interval, r) && interval.split_cost < best)
+                best = interval.split_cost, split_into = r;
+        }
+        for (auto &r : order) {
+            if (fixed[r].intersects(interval.ranges) || (is_caller_saved(r) && !interval.calls.empty()))
+                continue;
+            double cost = 0;
+            for (auto other : in_the_way(interval, r))
+                cost += other->cost;
+            if (cost < best)
+                best = cost, split_into.reset(), evict_from = r;
+        }
+
+        if (split_into.has_value()) {
+            split.insert(interval.temp);
+            assigned[interval.temp] = *split_into;
+            active.push_back(&interval);
+        }
+        else if (evict_from.has_value()) {
+            for (auto other : in_the_way(interval, *evict_from)) {
+                assigned.erase(other->temp);
+                split.erase(other->temp);
+                std::erase(active, other);
+                std::erase(inactive, other);
+#ifdef DEBUG
+                std::cout << "Evicted " << other->temp << " from " << *evict_from << "\n";
+#endif
+            }
+            assign(interval, *evict_from);
+        }
+    }
+
+    for (auto &[temp, reg] : assigned) {
+        registers[temp] = reg;
+        if (!split.count(temp))
+            continue;
+        for (auto call : interval_of[temp]->calls)
+            saved_around[&at(call)].push_back(temp);
+    }
+    for (auto &reg : callee) {
+        if (saved.count(reg))
+            callee_saved[func_name].push_back(reg);
+    }
+
+#ifdef DEBUG
+    std::cout << "Registers of " << func_name << ":";
+    for (auto &interval : intervals) {
+        auto it = assigned.find(interval.temp);
+        std::cout << " " << interval.temp << "=" << (it == assigned.end() ? "spilled" : it->second) << (split.count(interval.temp) ? "/split" : "");
+    }
+    std::cout << "\n";
+#endif
+}
+
+};
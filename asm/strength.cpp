@@ -0,0 +1,202 @@
+#include "asm.h"
+#include <bit>
+#include <cstdint>
+
+namespace assembly {
+
+namespace {
+
+// the operand is loaded here first, %rax and %rdx are free to use
+const Register SCRATCH = "%r10";
+
+[[nodiscard]] std::string immediate(long long value) {
+    return "$" + std::to_string(value);
+}
+
+[[nodiscard]] bool fits_imm32(long long value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+[[nodiscard]] std::uint64_t magnitude(long long value) {
+    return value < 0 ? -static_cast<std::uint64_t>(value) : static_cast<std::uint64_t>(value);
+}
+
+// puts value into reg, with the long form when it doesn't fit in a sign extended 32 bit immediate
+void load_constant(long long value, const Register& reg, std::vector<MInstr>& code) {
+    code.push_back(MInstr(fits_imm32(value) ? "movq" : "movabsq", {immediate(value), reg}));
+}
+
+// multiplier and shift of a signed division by d, 2 <= |d| and |d| not a power of two,
+// Hacker's Delight figure 10-1 on 64 bits
+struct Magic {
+    long long multiplier;
+    int shift;
+};
+
+[[nodiscard]] Magic magic(long long d) {
+    const std::uint64_t two63 = 1ULL << 63;
+    std::uint64_t ad = magnitude(d);
+    std::uint64_t t = two63 + (static_cast<std::uint64_t>(d) >> 63);
+    std::uint64_t anc = t - 1 - t % ad;
+    int p = 63;
+    std::uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc;
+    std::uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;
+    std::uint64_t delta;
+    do {
+        p++;
+        q1 *= 2, r1 *= 2;
+        if (r1 >= anc)
+            q1++, r1 -= anc;
+        q2 *= 2, r2 *= 2;
+        if (r2 >= ad)
+            q2++, r2 -= ad;
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+
+    std::uint64_t multiplier = q2 + 1;
+    if (d < 0)
+        multiplier = -multiplier;
+    return {static_cast<long long>(multiplier), p - 64};
+}
+
+// %r10 times c, in %r10
+void multiply(long long c, std::vector<MInstr>& code) {
+    // wraps around the same way for -c, including INT64_MIN
+    auto m = magnitude(c);
+    auto k = std::countr_zero(m);
+    auto odd = m >> k;
+    bool done = true;
+
+    if (odd == 1) {
+        if (k > 0)
+            code.push_back(MInstr("salq", {immediate(k), SCRATCH}));
+    }
+    else if (odd == 3 || odd == 5 || odd == 9) {
+        code.push_back(MInstr("leaq", {"(" + SCRATCH + "," + SCRATCH + "," + std::to_string(odd - 1) + ")", SCRATCH}));
+        if (k > 0)
+            code.push_back(MInstr("salq", {immediate(k), SCRATCH}));
+    }
+    else if (k == 0 && (std::has_single_bit(m - 1) || std::has_single_bit(m + 1))) {
+        // 2^s + 1 or 2^s - 1
+        bool plus = std::has_single_bit(m - 1);
+        auto shift = std::countr_zero(plus ? m - 1 : m + 1);
+        code.push_back(MInstr("movq", {SCRATCH, "%rax"}));
+        code.push_back(MInstr("salq", {immediate(shift), SCRATCH}));
+        code.push_back(MInstr(plus ? "addq" : "subq", {"%rax", SCRATCH}));
+    }
+    else
+        done = false;
+
+    if (done) {
+        if (c < 0)
+            code.push_back(MInstr("negq", {SCRATCH}));
+        return;
+    }
+
+    // the two operand imulq keeps %rdx alone and doesn't go through %rax
+    if (fits_imm32(c))
+        code.push_back(MInstr("imulq", {immediate(c), SCRATCH, SCRATCH}));
+    else {
+        load_constant(c, "%rax", code);
+        code.push_back(MInstr("imulq", {"%rax", SCRATCH}));
+    }
+}
+
+// %r10 divided by d rounding towards zero like idivq, |d| a power of two, returns
+// the register with the quotient or the remainder
+[[nodiscard]] Register divide_power_of_two(long long d, bool remainder, std::vector<MInstr>& code) {
+    auto ad = magnitude(d);
+    auto k = std::countr_zero(ad);
+
+    // negative dividends get |d| - 1 added first, so the shift rounds up instead of down
+    code.push_back(MInstr("movq", {SCRATCH, "%rax"}));
+    if (k > 1)
+        code.push_back(MInstr("sarq", {"$63", "%rax"}));
+    code.push_back(MInstr("shrq", {immediate(64 - k), "%rax"}));
+    code.push_back(MInstr("addq", {SCRATCH, "%rax"}));
+
+    if (!remainder) {
+        code.push_back(MInstr("sarq", {immediate(k), "%rax"}));
+        if (d < 0)
+            code.push_back(MInstr("negq", {"%rax"}));
+        return "%rax";
+    }
+
+    // x - (x + bias) rounded down to a multiple of |d|, the sign of d doesn't matter
+    auto mask = static_cast<long long>(-ad);
+    if (fits_imm32(mask))
+        code.push_back(MInstr("andq", {immediate(mask), "%rax"}));
+    else {
+        load_constant(mask, "%rdx", code);
+        code.push_back(MInstr("andq", {"%rdx", "%rax"}));
+    }
+    code.push_back(MInstr("subq", {"%rax", SCRATCH}));
+    return SCRATCH;
+}
+
+// %r10 divided by d rounding towards zero, through the high half of a multiplication
+[[nodiscard]] Register divide_magic(long long d, bool remainder, std::vector<MInstr>& code) {
+    auto [multiplier, shift] = magic(d);
+
+    load_constant(multiplier, "%rax", code);
+    code.push_back(MInstr("imulq", {SCRATCH}));
+    if (d > 0 && multiplier < 0)
+        code.push_back(MInstr("addq", {SCRATCH, "%rdx"}));
+    if (d < 0 && multiplier > 0)
+        code.push_back(MInstr("subq", {SCRATCH, "%rdx"}));
+    if (shift > 0)
+        code.push_back(MInstr("sarq", {immediate(shift), "%rdx"}));
+
+    // one more for negative quotients, which were rounded down
+    code.push_back(MInstr("movq", {"%rdx", "%rax"}));
+    code.push_back(MInstr("shrq", {"$63", "%rax"}));
+    code.push_back(MInstr("addq", {"%rdx", "%rax"}));
+
+    if (!remainder)
+        return "%rax";
+
+    // x - q * d
+    if (fits_imm32(d))
+        code.push_back(MInstr("imulq", {immediate(d), "%rax", "%rax"}));
+    else {
+        load_constant(d, "%rdx", code);
+        code.push_back(MInstr("imulq", {"%rdx", "%rax"}));
+    }
+    code.push_back(MInstr("subq", {"%rax", SCRATCH}));
+    return SCRATCH;
+}
+
+}
+
+bool lower_by_constant(const std::string& op, Register a, long long c, Register res, std::vector<MInstr>& code) {
+    // idivq traps on 0, and on INT64_MIN / -1, which has to stay that way
+    if (op != "mul" && (c == 0 || c == -1))
+        return false;
+
+    if (op == "mul" && c == 0) {
+        code.push_back(MInstr("movq", {"$0", res}));
+        return true;
+    }
+    if (op == "mod" && c == 1) {
+        code.push_back(MInstr("movq", {"$0", res}));
+        return true;
+    }
+
+    code.push_back(MInstr("movq", {a, SCRATCH}));
+    if (op == "mul") {
+        multiply(c, code);
+        code.push_back(MInstr("movq", {SCRATCH, res}));
+        return true;
+    }
+
+    if (c == 1) {
+        code.push_back(MInstr("movq", {SCRATCH, res}));
+        return true;
+    }
+
+    auto result = std::has_single_bit(magnitude(c)) ? divide_power_of_two(c, op == "mod", code) : divide_magic(c, op == "mod", code);
+    code.push_back(MInstr("movq", {result, res}));
+    return true;
+}
+
+};
@@ -6,6 +6,44 @@
 
 namespace AST {
 
+namespace {
+
+// the extra arguments of a call to a lifted lambda
+[[nodiscard]] std::vector<MM::Temporary> lifted_args(MM::MM& muncher, const std::string& name) {
+    std::vector<MM::Temporary> args;
+    if (!muncher.is_defined(name) || muncher.get_temp(name)[0] != '%')
+        return args;
+
+    for (auto &capture : muncher.get_lifted(muncher.get_temp(name))) {
+        args.push_back(muncher.get_temp(capture.name));
+        if (capture.is_function)
+            args.push_back(muncher.get_temp(capture.name + "$static_link"));
+    }
+    return args;
+}
+
+// a short circuiting condition as a value, 1 if it holds and 0 otherwise
+[[nodiscard]] std::vector<TAC> materialize(Expression& expr, MM::MM& muncher) {
+    auto label_true = muncher.new_label();
+    auto label_false = muncher.new_label();
+    auto label_end = muncher.new_label();
+    auto result_temp = muncher.new_temp();
+
+    auto instr = expr.munch_bool(muncher, label_true, label_false);
+    instr.push_back(TAC("label", { label_true }));
+    instr.push_back(TAC("const", { "1" }, result_temp));
+    instr.push_back(TAC("jmp", {}, label_end));
+    instr.push_back(TAC("label", { label_false }));
+    instr.push_back(TAC("const", { "0" }, result_temp));
+    instr.push_back(TAC("label", { label_end }));
+
+    // the value is read from the last instruction
+    instr.push_back(TAC("copy", { result_temp }, muncher.new_temp()));
+    return instr;
+}
+
+}
+
 /*
 Expressions
 */
@@ -44,6 +82,14 @@ Expressions
     return instr;
 }
 
+[[nodiscard]] std::vector<TAC> BoolExpression::munch(MM::MM& muncher) {
+    return {TAC(
+        "const",
+        { value ? "1" : "0" },
+        muncher.new_temp()
+    )};
+}
+
 [[nodiscard]] std::vector<TAC> BoolExpression::munch_bool([[maybe_unused]] MM::MM& muncher, std::string label_true, std::string label_false) {
     return {TAC(
         "jmp",
@@ -56,6 +102,15 @@ Expressions
     auto op = token.get_type();
     std::vector<TAC> expr_munch = expr->munch(muncher);
 
+    // booleans are 0 or 1
+    if (op == lexer::NOT) {
+        auto one = muncher.new_temp();
+        auto value = expr_munch.back().get_result();
+        expr_munch.push_back(TAC("const", { "1" }, one));
+        expr_munch.push_back(TAC("xor", { value, one }, muncher.new_temp()));
+        return expr_munch;
+    }
+
     expr_munch.push_back(TAC(
         op == lexer::DASH ? "neg" : lexer::op_code.find(op)->second,
         { expr_munch.back().get_result() },
@@ -71,15 +126,22 @@ Expressions
 
 [[nodiscard]] std::vector<TAC> BinOpExpression::munch(MM::MM& muncher) {
     auto op = token.get_type();
+
+    // the right side might not run
+    if (op == lexer::ANDAND || op == lexer::OROR)
+        return materialize(*this, muncher);
+
     std::vector<TAC> left_munch = left->munch(muncher);
     std::vector<TAC> right_munch = right->munch(muncher);
 
     auto tl = left_munch.back().get_result(), tr = right_munch.back().get_result();
 
     utils::concat(left_munch, right_munch);
-    
+
+    // comparisons give 1 or 0, jl becomes setl
+    auto jump = lexer::jump_code.find(op);
     left_munch.push_back(TAC(
-        lexer::op_code.find(op)->second,
+        jump != lexer::jump_code.end() ? "set" + jump->second.substr(1) : lexer::op_code.find(op)->second,
         { tl, tr },
         muncher.new_temp()
     ));
@@ -115,17 +177,11 @@ Expressions
     auto tl = left_munch.back().get_result(), tr = right_munch.back().get_result();
 
     utils::concat(left_munch, right_munch);
-    
-    auto res_temp = muncher.new_temp();
-    left_munch.push_back(TAC(
-        "sub",
-        { tl, tr },
-        res_temp
-    ));
 
+    // compared directly, their difference could overflow
     left_munch.push_back(TAC(
         lexer::jump_code.find(op)->second,
-        { res_temp },
+        { tl, tr },
         label_true
     ));
 
@@ -158,7 +214,8 @@ Function/Procedure evaluation
     for (auto &expr : params) {
         auto arg_type = expr->get_type();
 
-        if (arg_type.is_int()) {
+        // booleans are already 0 or 1
+        if (arg_type.is_int() || arg_type.is_bool()) {
             auto expr_munch = expr->munch(muncher);
             auto result_temp = expr_munch.back().get_result();
 
@@ -166,51 +223,6 @@ Function/Procedure evaluation
             param_temps.push_back(result_temp);
             param_count++;
         }
-        else if (arg_type.is_bool()) {
-            auto label_true = muncher.new_label();
-            auto label_false = muncher.new_label();
-            auto label_end = muncher.new_label();
-            auto expr_munch = expr->munch_bool(muncher, label_true, label_false);
-            auto result_temp = muncher.new_temp();
-
-            utils::concat(instr, expr_munch);
-
-            instr.push_back(TAC(
-                "label",
-                { label_true }
-            ));
-
-            instr.push_back(TAC(
-                "const",
-                { "1" },
-                result_temp
-            ));
-
-            instr.push_back(TAC(
-                "jmp",
-                {},
-                label_end
-            ));
-
-            instr.push_back(TAC(
-                "label",
-                { label_false }
-            ));
-
-            instr.push_back(TAC(
-                "const",
-                { "0" },
-                result_temp
-            ));
-
-            instr.push_back(TAC(
-                "label",
-                { label_end }
-            ));
-
-            param_temps.push_back(result_temp);
-            param_count++;
-        }
         else if (arg_type.is_function()) {
             std::string func_name = dynamic_cast<IdentExpression*>(expr.get())->name;
             std::string code_pointer = muncher.new_temp();
@@ -249,6 +261,12 @@ Function/Procedure evaluation
         }
     }
 
+    // a lifted lambda gets what it captures after its arguments
+    for (auto &temp : lifted_args(muncher, name)) {
+        param_temps.push_back(temp);
+        param_count++;
+    }
+
     std::string code_pointer;
     std::string static_link;
 
@@ -339,7 +357,8 @@ Function/Procedure evaluation
     for (auto &expr : params) {
         auto arg_type = expr->get_type();
 
-        if (arg_type.is_int()) {
+        // booleans are already 0 or 1
+        if (arg_type.is_int() || arg_type.is_bool()) {
             auto expr_munch = expr->munch(muncher);
             auto result_temp = expr_munch.back().get_result();
 
@@ -347,51 +366,6 @@ Function/Procedure evaluation
             param_temps.push_back(result_temp);
             param_count++;
         }
-        else if (arg_type.is_bool()) {
-            auto label_true = muncher.new_label();
-            auto label_false = muncher.new_label();
-            auto label_end = muncher.new_label();
-            auto expr_munch = expr->munch_bool(muncher, label_true, label_false);
-            auto result_temp = muncher.new_temp();
-
-            utils::concat(instr, expr_munch);
-
-            instr.push_back(TAC(
-                "label",
-                { label_true }
-            ));
-
-            instr.push_back(TAC(
-                "const",
-                { "1" },
-                result_temp
-            ));
-
-            instr.push_back(TAC(
-                "jmp",
-                {},
-                label_end
-            ));
-
-            instr.push_back(TAC(
-                "label",
-                { label_false }
-            ));
-
-            instr.push_back(TAC(
-                "const",
-                { "0" },
-                result_temp
-            ));
-
-            instr.push_back(TAC(
-                "label",
-                { label_end }
-            ));
-
-            param_temps.push_back(result_temp);
-            param_count++;
-        }
         else if (arg_type.is_function()) {
             std::string func_name = dynamic_cast<IdentExpression*>(expr.get())->name;
             std::string code_pointer = muncher.new_temp();
@@ -430,6 +404,12 @@ Function/Procedure evaluation
         }
     }
 
+    // a lifted lambda gets what it captures after its arguments
+    for (auto &temp : lifted_args(muncher, name)) {
+        param_temps.push_back(temp);
+        param_count++;
+    }
+
     std::string code_pointer;
     std::string static_link;
 
@@ -541,60 +521,14 @@ Statements
 
 [[nodiscard]] std::vector<TAC> Assign::munch(MM::MM& muncher) {
     auto temp = muncher.get_temp(name);
-    auto var_type = muncher.get_type(name);
-
-    if (var_type.is_int()) {
-        auto expr_munch = expr->munch(muncher);
-        
-        expr_munch.push_back(TAC(
-            "copy",
-            { expr_munch.back().get_result() },
-            temp
-        ));
-        return expr_munch;
-    }
-
-    // bool assignment
-
-    auto label_true = muncher.new_label();
-    auto label_false = muncher.new_label();
-    auto label_end = muncher.new_label();
-
-    auto expr_munch = expr->munch_bool(muncher, label_true, label_false);
-
-    expr_munch.push_back(TAC(
-        "label",
-        { label_true }
-    ));
-
-    expr_munch.push_back(TAC(
-        "const",
-        { "1" },
-        temp
-    ));
-
-    expr_munch.push_back(TAC(
-        "jmp",
-        {},
-        label_end
-    ));
-
-    expr_munch.push_back(TAC(
-        "label",
-        { label_false }
-    ));
 
+    // booleans are computed as 0 or 1 like integers
+    auto expr_munch = expr->munch(muncher);
     expr_munch.push_back(TAC(
-        "const",
-        { "0" },
+        "copy",
+        { expr_munch.back().get_result() },
         temp
     ));
-
-    expr_munch.push_back(TAC(
-        "label",
-        { label_end }
-    ));
-
     return expr_munch;
 }
 
@@ -754,17 +688,34 @@ Lambdas
         code_pointer
     ));
 
-    // get current static link
+    // get current static link, a lambda which doesn't reach our frame gets none
     auto static_link = muncher.new_temp();
-    instr.push_back(TAC(
-        "get_fp",
-        { },
-        static_link
-    ));
+    if (capture_kind == STATIC_LINK) {
+        instr.push_back(TAC(
+            "get_fp",
+            { },
+            static_link
+        ));
+    }
+    else {
+        instr.push_back(TAC(
+            "const",
+            { "0" },
+            static_link
+        ));
+    }
+
+    // what a lifted lambda reads, as seen from here
+    std::vector<std::tuple<MM::Type, MM::Temporary, std::vector<MM::Capture>>> outer;
+    for (auto &capture : lifted) {
+        auto temp = muncher.get_temp(capture.name);
+        outer.push_back({muncher.get_type(capture.name), temp, muncher.get_lifted(temp)});
+    }
 
     // declare function and its static_link
     muncher.scope().declare(name, return_type->to_mm_type(), code_pointer);
     muncher.scope().declare(name + "$static_link", MM::Type::Int(), static_link);
+    muncher.lift(code_pointer, lifted);
 
     body_instr.push_back(TAC(
         "proc",
@@ -814,6 +765,29 @@ Lambdas
         }
     }
 
+    // the captures of a lifted lambda come after its own parameters
+    for (std::size_t i = 0; i < lifted.size(); i++) {
+        auto &[type, temp, captures] = outer[i];
+        auto param_temp = muncher.new_temp();
+        body_instr.push_back(TAC(
+            "copy",
+            { muncher.new_param_temp() },
+            param_temp
+        ));
+        muncher.scope().declare(lifted[i].name, type, param_temp);
+        muncher.lift(param_temp, captures);
+
+        if (lifted[i].is_function) {
+            param_temp = muncher.new_temp();
+            body_instr.push_back(TAC(
+                "copy",
+                { muncher.new_param_temp() },
+                param_temp
+            ));
+            muncher.scope().declare(lifted[i].name + "$static_link", MM::Type::Int(), param_temp);
+        }
+    }
+
     // mark this copy so it doesnt get removed in CFG
     body_instr.push_back(TAC(
         "copy",
@@ -892,6 +866,7 @@ Declarations
     std::vector<std::string> args;
 
     auto static_link = muncher.new_temp();
+    analyze_captures();
 
     muncher.push_scope();
     muncher.push_function_scope();
@@ -995,7 +970,7 @@ Declarations
     // we have a return expression
     // compare with current function's type
     auto type = muncher.get_curr_function_type();
-    if (type.is_int()) {
+    if (type.is_int() || type.is_bool()) {
         instr = expr->munch(muncher);
         args = { instr.back().get_result() };
         instr.push_back(TAC(
@@ -1009,44 +984,6 @@ Declarations
             { instr.back().get_result() }
         ));
     }
-    else if (type.is_bool()) {
-        auto label_true = muncher.new_label();
-        auto label_false = muncher.new_label();
-
-        instr = expr->munch_bool(muncher, label_true, label_false);
-
-        instr.push_back(TAC(
-            "label",
-            { label_true }
-        ));
-
-        instr.push_back(TAC(
-            "const",
-            { "1" },
-            { muncher.new_temp() }
-        ));
-
-        instr.push_back(TAC(
-            "ret",
-            { instr.back().get_result() }
-        ));
-
-        instr.push_back(TAC(
-            "label",
-            { label_false }
-        ));
-
-        instr.push_back(TAC(
-            "const",
-            { "0" },
-            { muncher.new_temp() }
-        ));
-
-        instr.push_back(TAC(
-            "ret",
-            { instr.back().get_result() }
-        ));
-    }
     else {
         // even with a void function we can do
         // return fun();
@@ -10,6 +10,8 @@
 
 namespace AST {
 
+struct Captures;
+
 struct AST {
     virtual ~AST() = default;
     
@@ -153,6 +155,9 @@ public:
     }
 
     virtual void type_check(MM::MM& muncher) override = 0;
+
+    // names used by a lambda but declared outside of it, see typing/capture.cpp
+    virtual void capture(Captures& captures) = 0;
 };
 
 struct NumberExpression : Expression {
@@ -169,6 +174,8 @@ struct NumberExpression : Expression {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check([[maybe_unused]] MM::MM& muncher) override;
+
+    void capture([[maybe_unused]] Captures& captures) override {}
 };
 
 struct IdentExpression : Expression {
@@ -185,6 +192,8 @@ struct IdentExpression : Expression {
   
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 struct BoolExpression : Expression {
@@ -199,13 +208,13 @@ struct BoolExpression : Expression {
         os << std::string(2 * spaces, ' ') << "[BOOL] " << value << "\n";
     }
 
-    [[nodiscard]] std::vector<TAC> munch([[maybe_unused]] MM::MM& muncher) override {
-        return {};
-    }
+    [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;
 
     [[nodiscard]] std::vector<TAC> munch_bool([[maybe_unused]] MM::MM& muncher, std::string label_true, std::string label_false) override;    
 
     void type_check([[maybe_unused]] MM::MM& muncher) override;
+
+    void capture([[maybe_unused]] Captures& captures) override {}
 };
 
 struct UniOpExpression : Expression {
@@ -226,6 +235,8 @@ struct UniOpExpression : Expression {
     [[nodiscard]] std::vector<TAC> munch_bool(MM::MM& muncher, std::string label_true, std::string label_false) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 struct BinOpExpression : Expression {
@@ -249,6 +260,8 @@ struct BinOpExpression : Expression {
     [[nodiscard]] std::vector<TAC> munch_bool(MM::MM& muncher, std::string label_true, std::string label_false) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 /*
@@ -273,6 +286,8 @@ struct Eval : Expression {
     [[nodiscard]] std::vector<TAC> munch_bool(MM::MM& muncher, std::string label_true, std::string label_false) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 /*
@@ -284,6 +299,8 @@ struct Statement : AST {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override = 0;    
 
     void type_check(MM::MM& muncher) override = 0;
+
+    virtual void capture(Captures& captures) = 0;
 };
 
 struct Param {
@@ -322,6 +339,8 @@ struct ExpressionStatement : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 struct VarDecl : Statement {
@@ -343,6 +362,8 @@ struct VarDecl : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 struct Assign : Statement {
@@ -360,6 +381,8 @@ struct Assign : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 struct Call : Statement {
@@ -376,6 +399,8 @@ struct Call : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 struct Jump : Statement {
@@ -392,6 +417,8 @@ struct Jump : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check([[maybe_unused]] MM::MM& muncher) override {}
+
+    void capture([[maybe_unused]] Captures& captures) override {}
 };
 
 struct Return : Statement {
@@ -409,6 +436,8 @@ struct Return : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 /*
@@ -431,6 +460,8 @@ struct Block : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 /*
@@ -465,6 +496,8 @@ struct IfElse : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 /*
@@ -488,6 +521,8 @@ struct While : Statement {
     }    
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 /*
@@ -499,6 +534,12 @@ struct Lambda : Statement {
     std::vector<Param> params;
     std::unique_ptr<Block> block;
 
+    // decided by the capture analysis of the enclosing procedure: a lambda using nothing
+    // from outside gets no static link, one only reading variables nobody else writes gets
+    // their values as extra parameters, the others walk the static link chain
+    enum CaptureKind { NO_CAPTURE, LIFTED, STATIC_LINK } capture_kind = STATIC_LINK;
+    std::vector<MM::Capture> lifted;
+
     Lambda(std::string name, std::unique_ptr<Type> return_type, std::vector<Param> params, std::unique_ptr<Block> block) 
         : name(name), return_type(std::move(return_type)), params(std::move(params)), block(std::move(block)) {}
 
@@ -513,6 +554,8 @@ struct Lambda : Statement {
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;
 
     void type_check(MM::MM& muncher) override;
+
+    void capture(Captures& captures) override;
 };
 
 /*
@@ -577,6 +620,9 @@ struct ProcDecl : Declaration {
 
     [[nodiscard]] std::vector<TAC> munch(MM::MM& muncher) override;
 
+    // decides how every lambda inside gets to the variables it captures
+    void analyze_captures();
+
     void declare(MM::MM& muncher) override {
         if (muncher.is_declared(name)) {
             throw std::runtime_error(std::format(
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Writes a BX program with one very large CFG to stdout, to time the CFG passes on it:
+#   diamonds N   N if/else in a row, 4 blocks each
+#   chains N     ifs on the same test nested N deep, N times in a row: jtcond folds
+#                the inner tests, jtseq and coalesce the exits jumping to each other
+#   loops N      N loops in a row, each around a loop of its own, for the dominator,
+#                post-dominator and loop nesting analyses
+# e.g.
+#   bench/gen_cfg.sh diamonds 12000 > diamonds.bx
+#   bxc.exe diamonds.bx -O1
+#   bench/gen_cfg.sh loops 3000 > loops.bx
+#   bxc.exe loops.bx -passes=ssa,adce
+
+kind=$1
+n=${2:-1000}
+
+echo "def f(x : int, y : int) : int {"
+echo "  var s = 0 : int;"
+case "$kind" in
+    diamonds)
+        for ((k = 0; k < n; k++)); do
+            echo "  if (x < $k) { s = s + $k; } else { s = s - x; }"
+        done
+        ;;
+    chains)
+        for ((k = 0; k < n; k++)); do
+            for ((d = 0; d < n; d++)); do
+                echo "  if (x > y) {"
+            done
+            echo "  s = s + $k;"
+            for ((d = 0; d < n; d++)); do
+                echo "  }"
+            done
+        done
+        ;;
+    loops)
+        for ((k = 0; k < n; k++)); do
+            echo "  var i$k = 0 : int;"
+            echo "  while (i$k < x) {"
+            echo "    var j$k = 0 : int;"
+            echo "    while (j$k < y) { s = s + j$k; j$k = j$k + 1; }"
+            echo "    i$k = i$k + 1;"
+            echo "  }"
+        done
+        ;;
+    *)
+        echo "Unknown kind '$kind'!" >&2
+        exit 1
+        ;;
+esac
+echo "  return s;"
+echo "}"
+echo
+echo "def main() {"
+echo "  print(f(7, 3));"
+echo "}"
@@ -5,15 +5,33 @@
 #include "lexer/lexer.h"
 #include "ast/declarations.h"
 #include "asm/asm.h"
-#include "optimizations/cfg.h"
+#include "optimizations/pass_manager.h"
 
 int main(int argc, char** argv) {
     if (argc < 2 || argc > 3) {
-        std::cout << "Wrong usage! Call " << argv[0] << " [filename.bx] <-fenable-opt>\n";
+        std::cout << "Wrong usage! Call " << argv[0] << " [filename.bx] <-O0|-O1|-O2|-fenable-opt|-passes=...>\n";
         return 1;
     }
 
     const std::string filename(argv[1]);
+
+    // optimization pipeline, -fenable-opt is kept as an alias of -O2
+    std::vector<std::string> passes;
+    if (argc == 3) {
+        const std::string flag(argv[2]);
+        if (flag == "-fenable-opt")
+            passes = opt::PassManager::pipeline_for_level(2);
+        else if (flag.size() == 3 && flag.starts_with("-O") && std::isdigit(flag[2]))
+            passes = opt::PassManager::pipeline_for_level(flag[2] - '0');
+        else if (flag.starts_with("-passes="))
+            passes = opt::PassManager::parse_pipeline(flag.substr(std::strlen("-passes=")));
+        else {
+            std::cout << "Unknown option " << flag << "!\n";
+            return 1;
+        }
+    }
+    opt::PassManager pass_manager(passes);
+
     std::cout << "Hello! Lexing file " << filename << "...\n";
 
 #ifdef TEST
@@ -71,7 +89,23 @@ int main(int argc, char** argv) {
     // munch instructions
     std::cout << "Munching AST...\n";
     auto instr = ast->munch(muncher);
-    muncher.jsonify(file_prefix + ".tac.json", instr); 
+    muncher.process(instr);
+
+    // the CFG is built once, every pass runs on it and we flatten it back only at the end
+    if (!pass_manager.empty()) {
+        std::cout << "Applying optimizations...\n";
+        std::cout << std::format("Before optimizations, we have {} operations.\n", instr.size());
+
+        opt::CFG cfg(muncher);
+        cfg.make_cfg(instr);
+        pass_manager.run(cfg);
+        instr = cfg.make_tac();
+
+        std::cout << std::format("After optimizations, we have {} operations.\n", instr.size());
+        pass_manager.report(std::cout);
+    }
+
+    muncher.jsonify(file_prefix + ".tac.json", instr);
 
     // for (auto &tac : instr)
     //     std::cout << tac << "\n";
@@ -79,21 +113,11 @@ int main(int argc, char** argv) {
     // assembling
     std::cout << "Assembling...\n";
     std::ofstream asm_file(file_prefix + ".s");
-    assembly::Assembler assembler(muncher, instr, asm_file);
+    assembly::Assembler assembler(muncher, instr, asm_file, !pass_manager.empty());
     assembler.assemble();
 
-    if (argc == 3 && !std::strcmp(argv[2], "-fenable-opt")) {
-        std::cout << "Applying optimizations...\n";
+    if (!pass_manager.empty())
+        std::cout << std::format("Peephole pass removed {} instructions, {} are left.\n", assembler.peephole_removed(), assembler.instructions());
 
-        for (int i = 1; i <= 1; i++) {
-            std::cout << std::format("Before round #{} of optimizations, we have {} operations.\n", i, instr.size());
-
-            opt::optimize<opt::OptimizationType::DEAD_COPY_REMOVAL>(muncher, instr, file_prefix);
-            opt::optimize<opt::OptimizationType::JT_SEQ_UNCOND>(muncher, instr, file_prefix);
-            opt::optimize<opt::OptimizationType::JT_COND_TO_UNCOND>(muncher, instr, file_prefix);
-            opt::optimize<opt::OptimizationType::COALESCE>(muncher, instr, file_prefix);
-            std::cout << std::format("After round #{} of optimizations, we have {} operations.\n", i, instr.size());
-        }
-    }
     return 0;
 }
\ No newline at end of file
@@ -12,6 +12,13 @@
 
 namespace MM {
 
+// a variable a lifted lambda gets as an extra parameter, a function comes
+// with its static link
+struct Capture {
+    std::string name;
+    bool is_function;
+};
+
 class MM {
     int temp_ind, label_ind, param_temp_ind, function_ind;
     std::vector<Scope> scopes;
@@ -26,6 +33,9 @@ class MM {
     std::vector<std::pair<std::string, std::vector<TAC>>> lambdas;
     std::map<Temporary, std::string> func_of_temp;
 
+    // extra parameters of the lifted lambdas, by the temporary holding their code pointer
+    std::map<Temporary, std::vector<Capture>> lifted;
+
 public:
     MM() : temp_ind(0), label_ind(0), function_ind(0), break_point_stack({}), continue_point_stack({}) {}
 
@@ -54,6 +64,15 @@ public:
         lambdas.push_back({name, lambda_instr});
     }
 
+    void lift(const Temporary& code_pointer, const std::vector<Capture>& captures) {
+        lifted[code_pointer] = captures;
+    }
+
+    [[nodiscard]] std::vector<Capture> get_lifted(const Temporary& code_pointer) const {
+        auto it = lifted.find(code_pointer);
+        return it != lifted.end() ? it->second : std::vector<Capture>{};
+    }
+
     [[nodiscard]] std::string get_break_point() const {
         assert(!break_point_stack.empty());
         return break_point_stack.back();
@@ -93,6 +112,13 @@ public:
         return temp;
     }
 
+    // temporaries created by the optimizer, once the scopes are gone
+    [[nodiscard]] Temporary new_temp(const std::string& func_name) {
+        auto temp = "%" + std::to_string(temp_ind++);
+        func_of_temp[temp] = func_name;
+        return temp;
+    }
+
     [[nodiscard]] Temporary new_label()  {
         return "%.L" + std::to_string(label_ind++);
     }
@@ -173,8 +199,10 @@ public:
             while (j < instructions.size() && instructions[j].get_opcode() != "proc")
                 j++;
             j--;
-            
-            while (j && instructions[j].get_opcode() != "ret")
+
+            // globals declared after the procedure aren't part of it, its last
+            // instruction doesn't have to be a ret when it never returns
+            while (j > ind && instructions[j].get_opcode() == "const" && instructions[j].get_result()[0] == '@')
                 j--;
 
             procs.push_back(std::make_pair(ind, j));
@@ -33,10 +33,10 @@ public:
         for (std::size_t i = 0; i + 1 < tac.args.size(); i++) {
             os << "\"" << tac.args[i] << "\", ";
         }
-        if (!tac.args.empty() && !(tac.args.back()[0] >= '0' && tac.args.back()[0] <= '9'))
+        if (!tac.args.empty() && !(tac.args.back()[0] >= '0' && tac.args.back()[0] <= '9') && !(tac.args.back()[0] == '-' && tac.args.back().size() > 1))
             os << "\"" << tac.args.back() << "\"";
         else if (!tac.args.empty())
-            os << std::stoi(tac.args.back());
+            os << std::stoll(tac.args.back());
         os << "], \"result\": ";
         if (!tac.has_result())
             os << "null";
@@ -0,0 +1,703 @@
+#include "analysis.h"
+#include <format>
+#include <algorithm>
+#include <bit>
+#include <limits>
+
+namespace opt {
+
+static const std::array<std::string, ANALYSIS_COUNT> analysis_names = {
+    "predecessors", "rpo", "liveness", "dominators", "loops", "post-dominators"
+};
+
+[[nodiscard]] AnalysisManager::Cache& AnalysisManager::get_cache(Procedure& proc, Analysis analysis) {
+    auto &proc_cache = cache[proc.name];
+    if (!(proc_cache.valid & analysis))
+        computed[std::countr_zero(static_cast<unsigned>(analysis))]++;
+    return proc_cache;
+}
+
+[[nodiscard]] const std::map<Label, std::vector<Label>>& AnalysisManager::predecessors(Procedure& proc) {
+    auto &proc_cache = get_cache(proc, PREDECESSORS);
+    if (proc_cache.valid & PREDECESSORS)
+        return proc_cache.predecessors;
+
+    auto scoped_timer = timer(PREDECESSORS);
+
+    auto &preds = proc_cache.predecessors;
+    preds.clear();
+    for (auto &block : proc.blocks)
+        preds[block.get_label()];
+
+    for (auto &block : proc.blocks) {
+        for (auto &[child_label, _] : cfg.get_successors(block.get_label()))
+            preds[child_label].push_back(block.get_label());
+    }
+
+    proc_cache.valid |= PREDECESSORS;
+    return preds;
+}
+
+[[nodiscard]] const std::vector<Label>& AnalysisManager::rpo(Procedure& proc) {
+    auto &proc_cache = get_cache(proc, RPO);
+    if (proc_cache.valid & RPO)
+        return proc_cache.rpo;
+
+    auto scoped_timer = timer(RPO);
+
+    std::set<Label> vis;
+    proc_cache.rpo = cfg.postorder(proc.get_root(), vis);
+    std::reverse(proc_cache.rpo.begin(), proc_cache.rpo.end());
+
+    proc_cache.valid |= RPO;
+    return proc_cache.rpo;
+}
+
+[[nodiscard]] const Liveness& AnalysisManager::liveness(Procedure& proc) {
+    auto &preds = predecessors(proc);
+    auto &proc_cache = get_cache(proc, LIVENESS);
+    if (proc_cache.valid & LIVENESS)
+        return proc_cache.liveness;
+
+    auto scoped_timer = timer(LIVENESS);
+
+    auto &[live_in_block, live_out_block, def_block, use_block] = proc_cache.liveness;
+    live_in_block.clear(), live_out_block.clear();
+    def_block.clear(), use_block.clear();
+
+    // build def and use sets
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        block.build_def_use(def_block[label], use_block[label]);
+        live_in_block[label] = use_block[label];
+        live_out_block[label] = Set();
+    }
+
+    // liveness of each block, only revisit the predecessors of blocks whose live-in grew
+    std::vector<Label> worklist;
+    std::set<Label> queued;
+    for (auto &block : proc.blocks) {
+        worklist.push_back(block.get_label());
+        queued.insert(block.get_label());
+    }
+
+    while (!worklist.empty()) {
+        auto label = worklist.back();
+        worklist.pop_back();
+        queued.erase(label);
+
+        Set live_out;
+        for (auto &[succ_label, _] : cfg.get_successors(label))
+            live_out = live_out.join(live_in_block[succ_label]);
+
+        auto live_in = use_block[label].join(live_out.minus(def_block[label]));
+        live_out_block[label] = std::move(live_out);
+        if (!(live_in != live_in_block[label]))
+            continue;
+
+        live_in_block[label] = std::move(live_in);
+        for (auto &pred_label : preds.at(label)) {
+            if (queued.insert(pred_label).second)
+                worklist.push_back(pred_label);
+        }
+    }
+
+    proc_cache.valid |= LIVENESS;
+    return proc_cache.liveness;
+}
+
+std::set<Label> AnalysisManager::update_liveness(Procedure& proc, const Label& label, const Set& temps) {
+    auto &proc_cache = cache[proc.name];
+    if (!(proc_cache.valid & LIVENESS))
+        return {};
+
+    auto &preds = predecessors(proc);
+    auto &[live_in_block, live_out_block, def_block, use_block] = proc_cache.liveness;
+    std::set<Label> changed_out;
+
+    def_block[label] = Set(), use_block[label] = Set();
+    cfg.get_block(label).build_def_use(def_block[label], use_block[label]);
+
+    for (auto &temp : temps.get_set()) {
+        // live-out only depends on the successors, so nothing moves unless the
+        // live-in of the block itself changes
+        bool live_in = use_block[label].count(temp) || (live_out_block[label].count(temp) && !def_block[label].count(temp));
+        if (live_in == (bool)live_in_block[label].count(temp))
+            continue;
+
+        // the connected part of the live range of temp which goes through label
+        std::set<Label> region = {label};
+        std::vector<Label> stack = {label};
+        while (!stack.empty()) {
+            auto curr = stack.back();
+            stack.pop_back();
+
+            if (live_out_block[curr].count(temp)) {
+                for (auto &[succ_label, _] : cfg.get_successors(curr)) {
+                    if (live_in_block[succ_label].count(temp) && region.insert(succ_label).second)
+                        stack.push_back(succ_label);
+                }
+            }
+            if (live_in_block[curr].count(temp)) {
+                for (auto &pred_label : preds.at(curr)) {
+                    if (live_out_block[pred_label].count(temp) && region.insert(pred_label).second)
+                        stack.push_back(pred_label);
+                }
+            }
+        }
+
+        // forget temp in the region and grow it back from its upwards exposed uses
+        std::set<Label> was_live_out;
+        for (auto &curr : region) {
+            if (live_out_block[curr].count(temp))
+                was_live_out.insert(curr);
+            live_in_block[curr].erase(temp);
+            live_out_block[curr].erase(temp);
+        }
+
+        for (auto &curr : region) {
+            if (use_block[curr].count(temp)) {
+                live_in_block[curr].insert(temp);
+                stack.push_back(curr);
+            }
+        }
+
+        std::set<Label> is_live_out;
+        while (!stack.empty()) {
+            auto curr = stack.back();
+            stack.pop_back();
+
+            for (auto &pred_label : preds.at(curr)) {
+                if (live_out_block[pred_label].count(temp))
+                    continue;
+                live_out_block[pred_label].insert(temp);
+                is_live_out.insert(pred_label);
+
+                if (!def_block[pred_label].count(temp) && !live_in_block[pred_label].count(temp)) {
+                    live_in_block[pred_label].insert(temp);
+                    stack.push_back(pred_label);
+                }
+            }
+        }
+
+        for (auto &curr : was_live_out) {
+            if (!is_live_out.count(curr))
+                changed_out.insert(curr);
+        }
+        for (auto &curr : is_live_out) {
+            if (!was_live_out.count(curr))
+                changed_out.insert(curr);
+        }
+    }
+
+    return changed_out;
+}
+
+void AnalysisManager::build_dominator_tree(const std::vector<Label>& order, const std::map<Label, std::vector<Label>>& preds, Dominators& dom) {
+    dom = Dominators();
+    dom.order = order;
+
+    auto n = order.size();
+    dom.index.reserve(n);
+    for (std::size_t i = 0; i < n; i++)
+        dom.index[order[i]] = i;
+
+    // nodes are numbered in reverse postorder, so a node's idom always has a smaller number
+    std::vector<std::vector<int>> node_preds(n);
+    for (std::size_t i = 0; i < n; i++) {
+        for (auto &pred_label : preds.at(order[i])) {
+            if (auto it = dom.index.find(pred_label); it != dom.index.end())
+                node_preds[i].push_back(it->second);
+        }
+    }
+
+    constexpr int UNDEFINED = -1;
+    auto &idom = dom.idom_of;
+    idom.assign(n, UNDEFINED);
+    idom[0] = 0;
+
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (a > b)
+                a = idom[a];
+            while (b > a)
+                b = idom[b];
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (std::size_t i = 1; i < n; i++) {
+            int new_idom = UNDEFINED;
+            for (auto pred : node_preds[i]) {
+                if (idom[pred] == UNDEFINED)
+                    continue;
+                new_idom = new_idom == UNDEFINED ? pred : intersect(pred, new_idom);
+            }
+
+            if (new_idom != idom[i]) {
+                idom[i] = new_idom;
+                changed = true;
+            }
+        }
+    }
+
+    auto &children = dom.children_of;
+    children.resize(n);
+    for (std::size_t i = 1; i < n; i++)
+        children[idom[i]].push_back(i);
+
+    // a join point is in the frontier of every block on the way up from its predecessors to its idom
+    auto &frontier = dom.frontier_of;
+    frontier.resize(n);
+    for (std::size_t i = 0; i < n; i++) {
+        if (node_preds[i].size() < 2)
+            continue;
+        for (auto runner : node_preds[i]) {
+            while (runner != idom[i]) {
+                if (frontier[runner].empty() || frontier[runner].back() != static_cast<int>(i))
+                    frontier[runner].push_back(i);
+                runner = idom[runner];
+            }
+        }
+    }
+
+    // number the dominator tree, a dominates b iff b's interval is inside a's
+    auto &interval = dom.interval;
+    interval.resize(n);
+    int timer = 0;
+    std::vector<std::pair<int, std::size_t>> stack = {{0, 0}};
+    interval[0].first = timer++;
+    while (!stack.empty()) {
+        auto &[node, child_ind] = stack.back();
+        if (child_ind == children[node].size()) {
+            interval[node].second = timer++;
+            stack.pop_back();
+            continue;
+        }
+
+        auto child = children[node][child_ind++];
+        interval[child].first = timer++;
+        stack.push_back({child, 0});
+    }
+}
+
+[[nodiscard]] const Dominators& AnalysisManager::dominators(Procedure& proc) {
+    auto &order = rpo(proc);
+    auto &preds = predecessors(proc);
+    auto &proc_cache = get_cache(proc, DOMINATORS);
+    if (proc_cache.valid & DOMINATORS)
+        return proc_cache.dominators;
+
+    auto scoped_timer = timer(DOMINATORS);
+    build_dominator_tree(order, preds, proc_cache.dominators);
+
+    proc_cache.valid |= DOMINATORS;
+    return proc_cache.dominators;
+}
+
+[[nodiscard]] const Dominators& AnalysisManager::post_dominators(Procedure& proc) {
+    auto &preds = predecessors(proc);
+    auto &proc_cache = get_cache(proc, POST_DOMINATORS);
+    if (proc_cache.valid & POST_DOMINATORS)
+        return proc_cache.post_dominators;
+
+    auto scoped_timer = timer(POST_DOMINATORS);
+    const Label exit;
+
+    // in the reversed CFG the predecessors of a block are its successors
+    std::map<Label, std::vector<Label>> reverse_preds;
+    reverse_preds[exit];
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        auto &succs = cfg.get_successors(label);
+        auto &block_preds = reverse_preds[label];
+        for (auto &[succ_label, _] : succs)
+            block_preds.push_back(succ_label);
+        if (succs.empty())
+            block_preds.push_back(exit);
+    }
+
+    // reverse postorder of the reversed CFG, walking the predecessors from the exit
+    std::vector<Label> order;
+    std::set<Label> vis = {exit};
+    std::vector<std::pair<Label, std::size_t>> stack = {{exit, 0}};
+    std::vector<Label> exits;
+    for (auto &block : proc.blocks) {
+        if (cfg.get_successors(block.get_label()).empty())
+            exits.push_back(block.get_label());
+    }
+
+    while (!stack.empty()) {
+        auto &[label, child_ind] = stack.back();
+        auto &next = label == exit ? exits : preds.at(label);
+        if (child_ind == next.size()) {
+            order.push_back(label);
+            stack.pop_back();
+            continue;
+        }
+
+        auto child_label = next[child_ind++];
+        if (vis.insert(child_label).second)
+            stack.push_back({child_label, 0});
+    }
+    std::reverse(order.begin(), order.end());
+
+    build_dominator_tree(order, reverse_preds, proc_cache.post_dominators);
+
+    proc_cache.valid |= POST_DOMINATORS;
+    return proc_cache.post_dominators;
+}
+
+[[nodiscard]] const LoopInfo& AnalysisManager::loops(Procedure& proc) {
+    auto &order = rpo(proc);
+    auto &preds = predecessors(proc);
+    auto &dom = dominators(proc);
+    auto &proc_cache = get_cache(proc, LOOPS);
+    if (proc_cache.valid & LOOPS)
+        return proc_cache.loops;
+
+    auto scoped_timer = timer(LOOPS);
+    auto &info = proc_cache.loops;
+    auto &loops = info.loops;
+    loops.clear();
+    info.innermost.clear();
+
+    // natural loops, one per header, from the back edges latch -> header
+    for (auto &header : order) {
+        Loop loop;
+        loop.header = header;
+        for (auto &pred_label : preds.at(header)) {
+            if (dom.dominates(header, pred_label))
+                loop.latches.push_back(pred_label);
+        }
+
+        if (loop.latches.empty())
+            continue;
+
+        loop.body.insert(header);
+        std::vector<Label> stack = loop.latches;
+        while (!stack.empty()) {
+            auto label = stack.back();
+            stack.pop_back();
+            if (!loop.body.insert(label).second)
+                continue;
+            for (auto &pred_label : preds.at(label))
+                stack.push_back(pred_label);
+        }
+
+        loops.push_back(std::move(loop));
+    }
+
+    // two natural loops with different headers are either nested or disjoint, so
+    // going from the largest to the smallest, the last loop seen containing a
+    // header is the one directly enclosing it
+    std::stable_sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) {
+        return a.body.size() > b.body.size();
+    });
+
+    // trip counts look through the temporaries which are only defined once
+    SingleDefs single_def;
+    if (!loops.empty()) {
+        for (auto &block : proc.blocks) {
+            for (auto tac : block.get_instr()) {
+                if (!tac->has_result())
+                    continue;
+                auto [it, inserted] = single_def.insert({tac->get_result(), tac});
+                if (!inserted)
+                    it->second = nullptr;
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < loops.size(); i++) {
+        auto &loop = loops[i];
+        if (auto it = info.innermost.find(loop.header); it != info.innermost.end()) {
+            loop.parent = it->second;
+            loop.depth = loops[loop.parent].depth + 1;
+            loops[loop.parent].children.push_back(i);
+        }
+        for (auto &label : loop.body)
+            info.innermost[label] = i;
+
+        std::vector<Label> outside;
+        for (auto &pred_label : preds.at(loop.header)) {
+            if (!loop.body.count(pred_label))
+                outside.push_back(pred_label);
+        }
+        if (outside.size() == 1 && cfg.get_successors(outside[0]).size() == 1)
+            loop.preheader = outside[0];
+
+        for (auto &label : loop.body) {
+            for (auto &[succ_label, _] : cfg.get_successors(label)) {
+                if (!loop.body.count(succ_label))
+                    loop.exits.push_back({label, succ_label});
+            }
+        }
+
+        loop.trip_count = trip_count(proc, loop, single_def);
+    }
+
+    proc_cache.valid |= LOOPS;
+    return info;
+}
+
+namespace {
+
+// a temporary or a constant, as seen from some point of a block
+struct Value {
+    MM::Temporary temp;
+    std::optional<long long> constant;
+};
+
+[[nodiscard]] std::optional<long long> parse_constant(const std::string& str) {
+    if (str.empty() || !(std::isdigit(str[0]) || (str[0] == '-' && str.size() > 1)))
+        return std::nullopt;
+    return std::stoll(str);
+}
+
+// index of the last definition of temp in instr before pos
+[[nodiscard]] std::optional<std::size_t> last_def(const std::vector<TAC*>& instr, std::size_t pos, const MM::Temporary& temp) {
+    while (pos-- > 0) {
+        if (instr[pos]->has_result() && instr[pos]->get_result() == temp)
+            return pos;
+    }
+    return std::nullopt;
+}
+
+// follows copies and constants backwards through a block, then through the
+// temporaries with a single definition in the whole procedure
+[[nodiscard]] Value resolve(const std::vector<TAC*>& instr, std::size_t pos, MM::Temporary temp, const SingleDefs& single_def) {
+    bool in_block = true;
+    while (true) {
+        TAC* tac = nullptr;
+        if (in_block) {
+            auto def = last_def(instr, pos, temp);
+            if (def.has_value()) {
+                tac = instr[def.value()];
+                pos = def.value();
+            }
+            else
+                in_block = false;
+        }
+        if (!in_block) {
+            auto it = single_def.find(temp);
+            if (it == single_def.end() || it->second == nullptr)
+                return {temp, std::nullopt};
+            tac = it->second;
+        }
+
+        if (tac->get_opcode() == "const")
+            return {temp, parse_constant(tac->get_arg())};
+        if (tac->get_opcode() != "copy" || tac->get_args().size() != 1)
+            return {temp, std::nullopt};
+
+        // outside of the block the source could have changed since the copy
+        if (!in_block) {
+            auto it = single_def.find(tac->get_arg());
+            if (it == single_def.end() || it->second == nullptr)
+                return {temp, std::nullopt};
+        }
+        temp = tac->get_arg();
+    }
+}
+
+// step of var if the instruction at pos computes var + c or var - c
+[[nodiscard]] std::optional<long long> step_of(const std::vector<TAC*>& instr, std::size_t pos, const MM::Temporary& var, const SingleDefs& single_def) {
+    auto tac = instr[pos];
+    auto op = tac->get_opcode();
+    if ((op != "add" && op != "sub") || tac->get_args().size() != 2)
+        return std::nullopt;
+
+    auto a = resolve(instr, pos, tac->get_args()[0], single_def), b = resolve(instr, pos, tac->get_args()[1], single_def);
+    if (a.temp == var && b.constant.has_value())
+        return op == "add" ? b.constant.value() : -b.constant.value();
+    if (op == "add" && b.temp == var && a.constant.has_value())
+        return a.constant.value();
+    return std::nullopt;
+}
+
+// step of var if temp, seen from the end of the block, is var + c or var - c
+[[nodiscard]] std::optional<long long> step_at_end(const std::vector<TAC*>& instr, MM::Temporary temp, const MM::Temporary& var, const SingleDefs& single_def) {
+    auto def = last_def(instr, instr.size(), temp);
+    while (def.has_value() && instr[def.value()]->get_opcode() == "copy" && instr[def.value()]->get_args().size() == 1)
+        def = last_def(instr, def.value(), instr[def.value()]->get_arg());
+    return def.has_value() ? step_of(instr, def.value(), var, single_def) : std::nullopt;
+}
+
+};
+
+[[nodiscard]] std::optional<TripCount> AnalysisManager::trip_count(Procedure& proc, const Loop& loop, const SingleDefs& single_def) {
+    using namespace sign;
+    auto &dom = dominators(proc);
+    auto &instr = cfg.get_block(loop.header).get_instr();
+    if (instr.size() < 2 || instr.back()->get_opcode() != "jmp")
+        return std::nullopt;
+
+    // the header ends in jc %t -> A; jmp B, with exactly one of A and B in the loop
+    auto cond = instr[instr.size() - 2];
+    auto taken = taken_when.find(cond->get_opcode());
+    if (taken == taken_when.end())
+        return std::nullopt;
+
+    bool cond_inside = loop.body.count(cond->get_result()), jmp_inside = loop.body.count(instr.back()->get_result());
+    if (cond_inside == jmp_inside)
+        return std::nullopt;
+
+    // results of the comparison for which we stay in the loop
+    int staying = cond_inside ? taken->second : ANY ^ taken->second;
+
+    // the jump compares var with bound, or tests their difference
+    auto compared = cond->get_args();
+    auto compared_pos = instr.size() - 2;
+    if (compared.size() == 1) {
+        auto sub_pos = last_def(instr, instr.size() - 2, cond->get_arg());
+        if (!sub_pos.has_value() || instr[sub_pos.value()]->get_opcode() != "sub")
+            return std::nullopt;
+        compared = instr[sub_pos.value()]->get_args();
+        compared_pos = sub_pos.value();
+    }
+    bool difference = cond->get_args().size() == 1;
+
+    auto lhs = resolve(instr, compared_pos, compared[0], single_def), rhs = resolve(instr, compared_pos, compared[1], single_def);
+    auto invariant = [&](const Value& value) {
+        return value.constant.has_value() || std::none_of(loop.body.begin(), loop.body.end(), [&](const Label& label) {
+            auto &block_instr = cfg.get_block(label).get_instr();
+            return last_def(block_instr, block_instr.size(), value.temp).has_value();
+        });
+    };
+    if (invariant(lhs) == invariant(rhs))
+        return std::nullopt;
+
+    // bound compared with var is the opposite of var compared with bound
+    if (invariant(lhs)) {
+        std::swap(lhs, rhs);
+        staying = (staying & ZERO) | (staying & NEG ? POS : 0) | (staying & POS ? NEG : 0);
+    }
+
+    TripCount trip;
+    trip.var = lhs.temp;
+    trip.bound = rhs.constant.value_or(0);
+    trip.staying = staying;
+    trip.difference = difference;
+    if (!rhs.constant.has_value())
+        trip.limit = rhs.temp;
+
+    // var is either a phi of the header (SSA) or defined exactly once in the loop,
+    // in a block which runs on every iteration
+    std::optional<long long> step;
+    std::vector<Label> entering;
+    for (auto &pred_label : predecessors(proc).at(loop.header)) {
+        if (!loop.body.count(pred_label))
+            entering.push_back(pred_label);
+    }
+
+    auto phi_pos = last_def(instr, instr.size(), trip.var);
+    if (phi_pos.has_value() && instr[phi_pos.value()]->get_opcode() == "phi") {
+        std::optional<long long> init;
+        bool known_init = true;
+        for (auto &[pred_label, temp] : instr[phi_pos.value()]->get_phi_args()) {
+            auto &pred_instr = cfg.get_block(pred_label).get_instr();
+            if (loop.body.count(pred_label)) {
+                auto curr_step = step_at_end(pred_instr, temp, trip.var, single_def);
+                if (!curr_step.has_value() || (step.has_value() && step != curr_step))
+                    return std::nullopt;
+                step = curr_step;
+                continue;
+            }
+
+            auto value = resolve(pred_instr, pred_instr.size(), temp, single_def);
+            known_init &= value.constant.has_value() && (!init.has_value() || init == value.constant);
+            init = value.constant;
+        }
+        if (known_init)
+            trip.init = init;
+    }
+    else {
+        for (auto &label : loop.body) {
+            auto &block_instr = cfg.get_block(label).get_instr();
+            for (std::size_t i = 0; i < block_instr.size(); i++) {
+                if (!block_instr[i]->has_result() || block_instr[i]->get_result() != trip.var)
+                    continue;
+
+                bool every_iteration = std::all_of(loop.latches.begin(), loop.latches.end(), [&](const Label& latch) {
+                    return dom.dominates(label, latch);
+                });
+                auto curr_step = std::optional<long long>();
+                if (block_instr[i]->get_opcode() == "copy" && block_instr[i]->get_args().size() == 1) {
+                    auto def = last_def(block_instr, i, block_instr[i]->get_arg());
+                    curr_step = def.has_value() ? step_of(block_instr, def.value(), trip.var, single_def) : std::nullopt;
+                }
+                else
+                    curr_step = step_of(block_instr, i, trip.var, single_def);
+
+                if (step.has_value() || !every_iteration || !curr_step.has_value())
+                    return std::nullopt;
+                step = curr_step;
+            }
+        }
+
+        std::optional<long long> init;
+        bool known_init = !entering.empty();
+        for (auto &pred_label : entering) {
+            auto &pred_instr = cfg.get_block(pred_label).get_instr();
+            auto value = resolve(pred_instr, pred_instr.size(), trip.var, single_def);
+            known_init &= value.constant.has_value() && (!init.has_value() || init == value.constant);
+            init = value.constant;
+        }
+        if (known_init)
+            trip.init = init;
+    }
+
+    if (!step.has_value() || step.value() == 0)
+        return std::nullopt;
+    trip.step = step.value();
+
+    if (!trip.init.has_value() || trip.limit.has_value())
+        return trip;
+
+    // number of iterations, only for the tests which stop the loop the first time they fail,
+    // counted in unsigned so the distance between init and bound always fits
+    using Distance = unsigned long long;
+    auto init = trip.init.value(), bound = trip.bound, step_value = trip.step;
+    Distance stride = step_value > 0 ? Distance(step_value) : -Distance(step_value);
+    Distance ahead = step_value > 0 ? Distance(bound) - Distance(init) : Distance(init) - Distance(bound);
+    bool behind = step_value > 0 ? init > bound : init < bound;
+    std::optional<Distance> count;
+    if ((staying == NEG && step_value > 0) || (staying == POS && step_value < 0))
+        count = behind || init == bound ? 0 : ahead / stride + (ahead % stride != 0);
+    else if ((staying == (NEG | ZERO) && step_value > 0) || (staying == (ZERO | POS) && step_value < 0))
+        count = behind ? 0 : ahead / stride + 1;
+    else if (staying == (NEG | POS) && !behind && ahead % stride == 0)
+        count = ahead / stride;
+
+    // var must get to the value failing the test without wrapping around, and so
+    // must var - bound when that's what is tested
+    long long moved, last;
+    if (!count.has_value() || count.value() > Distance(std::numeric_limits<long long>::max()))
+        return trip;
+    if (__builtin_mul_overflow(static_cast<long long>(count.value()), step_value, &moved) || __builtin_add_overflow(init, moved, &last))
+        return trip;
+    if (difference && (__builtin_sub_overflow(init, bound, &moved) || __builtin_sub_overflow(last, bound, &moved)))
+        return trip;
+    trip.count = count.value();
+
+    return trip;
+}
+
+void AnalysisManager::invalidate(Procedure& proc, unsigned preserved) {
+    // every other analysis is derived from the edges
+    if (!(preserved & PREDECESSORS))
+        preserved = NONE;
+    cache[proc.name].valid &= preserved;
+}
+
+void AnalysisManager::report(std::ostream& os) const {
+    os << "Analyses computed:";
+    for (std::size_t i = 0; i < ANALYSIS_COUNT; i++)
+        os << std::format(" {} {} ({:.3f} ms){}", analysis_names[i], computed[i], time[i].count(), i + 1 < ANALYSIS_COUNT ? "," : "\n");
+}
+
+};
\ No newline at end of file
@@ -0,0 +1,206 @@
+#pragma once
+#include "cfg.h"
+#include <array>
+#include <bit>
+#include <chrono>
+#include <optional>
+#include <unordered_map>
+
+namespace opt {
+
+// analyses which can be cached, every pass declares which of them it preserves
+enum Analysis : unsigned {
+    NONE = 0,
+    PREDECESSORS = 1 << 0,
+    RPO = 1 << 1,
+    LIVENESS = 1 << 2,
+    DOMINATORS = 1 << 3,
+    LOOPS = 1 << 4,
+    POST_DOMINATORS = 1 << 5,
+
+    // everything which only depends on the edges of the CFG
+    CFG_SHAPE = PREDECESSORS | RPO | DOMINATORS | LOOPS | POST_DOMINATORS,
+    ALL = CFG_SHAPE | LIVENESS
+};
+
+inline constexpr std::size_t ANALYSIS_COUNT = 6;
+
+// the only definition of every temporary defined once, nullptr for the others
+using SingleDefs = std::unordered_map<MM::Temporary, TAC*>;
+
+struct Liveness {
+    std::map<Label, Set> live_in, live_out;
+    std::map<Label, Set> def_block, use_block;
+};
+
+struct Dominators {
+    // nodes in reverse postorder from the root, everything else is indexed by
+    // the position of a node in it
+    std::vector<Label> order;
+    std::unordered_map<Label, int> index;
+
+    // the root is its own immediate dominator
+    std::vector<int> idom_of;
+    std::vector<std::vector<int>> children_of, frontier_of;
+
+    // preorder interval of every node in the dominator tree
+    std::vector<std::pair<int, int>> interval;
+
+    [[nodiscard]] bool contains(const Label& label) const {
+        return index.count(label);
+    }
+
+    [[nodiscard]] Label idom(const Label& label) const {
+        return order[idom_of[index.at(label)]];
+    }
+
+    [[nodiscard]] std::vector<Label> children(const Label& label) const {
+        return labels(children_of[index.at(label)]);
+    }
+
+    // dominance frontier
+    [[nodiscard]] std::vector<Label> frontier(const Label& label) const {
+        return labels(frontier_of[index.at(label)]);
+    }
+
+    [[nodiscard]] bool dominates(const Label& a, const Label& b) const {
+        auto ia = index.find(a), ib = index.find(b);
+        if (ia == index.end() || ib == index.end())
+            return false;
+        auto &[a_in, a_out] = interval[ia->second];
+        auto &[b_in, b_out] = interval[ib->second];
+        return a_in <= b_in && b_out <= a_out;
+    }
+
+private:
+    [[nodiscard]] std::vector<Label> labels(const std::vector<int>& nodes) const {
+        std::vector<Label> result;
+        result.reserve(nodes.size());
+        for (auto node : nodes)
+            result.push_back(order[node]);
+        return result;
+    }
+};
+
+// the loops While::munch emits compare var with a bound in the header (or test
+// their difference against 0), var changing by a constant step once per iteration
+struct TripCount {
+    MM::Temporary var;
+    long long bound, step;
+    std::optional<long long> init;
+
+    // results of comparing var with the bound for which the loop goes on
+    int staying;
+
+    // the test is on var - bound, which wraps around where comparing them doesn't
+    bool difference = false;
+
+    // a bound which isn't constant, but is never changed inside the loop
+    std::optional<MM::Temporary> limit;
+
+    // how many times the body runs, when the initial value is known
+    std::optional<long long> count;
+};
+
+struct Loop {
+    Label header;
+    std::vector<Label> latches;
+    std::set<Label> body;
+
+    // edges (inside, outside) leaving the loop
+    std::vector<std::pair<Label, Label>> exits;
+
+    // the only block entering the loop from outside, if it doesn't go anywhere else
+    std::optional<Label> preheader;
+
+    // enclosing loop and the loops directly nested in it, as indices in LoopInfo::loops
+    int parent = -1;
+    std::vector<int> children;
+    int depth = 1;
+
+    std::optional<TripCount> trip_count;
+};
+
+struct LoopInfo {
+    // enclosing loops come before the loops nested in them
+    std::vector<Loop> loops;
+
+    // innermost loop of every block which is inside a loop
+    std::map<Label, int> innermost;
+
+    [[nodiscard]] int depth(const Label& label) const {
+        auto it = innermost.find(label);
+        return it == innermost.end() ? 0 : loops[it->second].depth;
+    }
+};
+
+class AnalysisManager {
+private:
+    struct Cache {
+        unsigned valid = NONE;
+        std::map<Label, std::vector<Label>> predecessors;
+        std::vector<Label> rpo;
+        Liveness liveness;
+        Dominators dominators, post_dominators;
+        LoopInfo loops;
+    };
+
+    CFG& cfg;
+    std::map<std::string, Cache> cache;
+    std::array<int, ANALYSIS_COUNT> computed{};
+    std::array<std::chrono::duration<double, std::milli>, ANALYSIS_COUNT> time{};
+
+    [[nodiscard]] Cache& get_cache(Procedure& proc, Analysis analysis);
+
+    // time spent computing an analysis, from construction to destruction
+    class Timer {
+        std::chrono::duration<double, std::milli>& total;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        Timer(std::chrono::duration<double, std::milli>& total) : total(total), start(std::chrono::steady_clock::now()) {}
+        ~Timer() { total += std::chrono::steady_clock::now() - start; }
+    };
+
+    [[nodiscard]] Timer timer(Analysis analysis) {
+        return Timer(time[std::countr_zero(static_cast<unsigned>(analysis))]);
+    }
+
+    // Cooper, Harvey, Kennedy: "A Simple, Fast Dominance Algorithm", for any graph
+    // given by the reverse postorder from its root and the predecessors of each node
+    static void build_dominator_tree(const std::vector<Label>& order, const std::map<Label, std::vector<Label>>& preds, Dominators& dom);
+
+    [[nodiscard]] std::optional<TripCount> trip_count(Procedure& proc, const Loop& loop, const SingleDefs& single_def);
+
+public:
+    AnalysisManager(CFG& cfg) : cfg(cfg) {}
+
+    [[nodiscard]] const std::map<Label, std::vector<Label>>& predecessors(Procedure& proc);
+
+    // reverse postorder of the blocks reachable from the root
+    [[nodiscard]] const std::vector<Label>& rpo(Procedure& proc);
+
+    [[nodiscard]] const Liveness& liveness(Procedure& proc);
+
+    // keeps the cached liveness valid after the instructions of a block changed
+    // temps are the temporaries whose uses or definitions were touched, only the
+    // part of the procedure where they were live is recomputed
+    // returns the blocks whose live-out set changed
+    std::set<Label> update_liveness(Procedure& proc, const Label& label, const Set& temps);
+
+    [[nodiscard]] const Dominators& dominators(Procedure& proc);
+
+    // dominators of the reversed CFG, rooted at a virtual exit with an empty label
+    // which every block without successors jumps to
+    // blocks which can't reach an exit (infinite loops) aren't in the tree
+    [[nodiscard]] const Dominators& post_dominators(Procedure& proc);
+
+    [[nodiscard]] const LoopInfo& loops(Procedure& proc);
+
+    // drops every analysis of proc which isn't in preserved
+    void invalidate(Procedure& proc, unsigned preserved);
+
+    void report(std::ostream& os) const;
+};
+
+};
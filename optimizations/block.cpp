@@ -3,10 +3,26 @@
 
 namespace opt {
 
-Block::Block(std::vector<std::shared_ptr<TAC>>& instr, bool start) : instr(instr), start(start) {
+namespace {
+
+// parameters and labels aren't tracked by liveness
+[[nodiscard]] bool is_used(const std::string& arg) {
+    return arg[0] == '%' && arg[1] != 'p' && arg[1] != '.';
+}
+
+[[nodiscard]] bool is_defined(const std::string& result) {
+    return result[0] == '%' && result[1] != '.';
+}
+
+}
+
+Block::Block(std::vector<TAC*>& instr, bool start) : instr(instr), start(start) {
     assert(instr[start]->get_opcode() == "label");
     label = instr[start]->get_arg();
-    jumps.clear();
+}
+
+[[nodiscard]] std::vector<TAC*> Block::get_jumps() const {
+    std::vector<TAC*> jumps;
 
     // connections of current block
     for (auto &t : instr) {
@@ -14,9 +30,10 @@ Block::Block(std::vector<std::shared_ptr<TAC>>& instr, bool start) : instr(instr
         if (assembly::jumps.find(op) != assembly::jumps.end() || op == "jmp")
             jumps.push_back(t);
     }
+    return jumps;
 }
 
-void Block::build_liveness([[maybe_unused]] Set &live_in_block, Set &live_out_block) {
+void Block::build_liveness([[maybe_unused]] const Set &live_in_block, const Set &live_out_block) {
     auto instr_count = instr.size();
     live_in.clear(), live_out.clear();
     live_in.resize(instr_count);
@@ -24,10 +41,12 @@ void Block::build_liveness([[maybe_unused]] Set &live_in_block, Set &live_out_bl
 
     auto temp_live = live_out_block;
     for (int i = instr_count - 1; i >= 0; i--) {
-        auto tac = instr[i];
         live_out[i] = temp_live;
-        live_in[i] = use[i].join(live_out[i].minus(def[i]));
-        temp_live = live_in[i];
+        for (auto &temp : def[i].get_set())
+            temp_live.erase(temp);
+        for (auto &temp : use[i].get_set())
+            temp_live.insert(temp);
+        live_in[i] = temp_live;
     }
 }
 
@@ -46,20 +65,24 @@ void Block::build_def_use(Set &def_block, Set &use_block) {
         auto tac = instr[i];
         auto opcode = tac->get_opcode();
 
-        // label or jump instructions
-        if (opcode == "label" || (tac->has_result() && tac->get_result()[1] == '.'))
+        // label instructions, jumps still use the temporary they test
+        if (opcode == "label")
             continue;
 
         for (auto &arg : tac->get_args()) {
-            if (arg[0] == '%' && arg[1] != 'p')
+            if (is_used(arg)) {
                 use[i].insert(arg);
+
+                // only uses which aren't preceded by a definition in the block are upwards exposed
+                if (!def_block.count(arg))
+                    use_block.insert(arg);
+            }
         }
 
-        if (tac->has_result() && tac->get_result()[0] == '%')
+        if (tac->has_result() && is_defined(tac->get_result())) {
             def[i].insert(tac->get_result());
-
-        def_block = def_block.join(def[i]);
-        use_block = use_block.join(use[i]);
+            def_block.insert(tac->get_result());
+        }
     }
 
 #ifdef DEBUG
@@ -73,23 +96,41 @@ void Block::build_def_use(Set &def_block, Set &use_block) {
 #endif
 }
 
-void Block::eliminate_dead_copies() {
-    auto instr_count = instr.size();
-    std::vector<std::shared_ptr<TAC>> new_instr;
+bool Block::eliminate_dead_copies(const Set& live_out_block, const std::function<bool(const MM::Temporary&)>& keep, Set& released) {
+    // one sweep from the end with what is live after each instruction, so a copy
+    // which only fed copies removed further down goes as well
+    auto live = live_out_block;
+    std::vector<TAC*> new_instr;
 
-    for (std::size_t i = 0; i < instr_count; i++) {
+    for (auto i = instr.size(); i-- > 0; ) {
         auto tac = instr[i];
-        if (tac->get_opcode() != "copy" || tac->get_args().size() > 1) {
+        if (tac->get_opcode() == "label") {
             new_instr.push_back(tac);
             continue;
         }
 
-        if (live_out[i].count(tac->get_result()))
-            new_instr.push_back(tac);
+        if (tac->get_opcode() == "copy" && tac->get_args().size() <= 1) {
+            auto result = tac->get_result();
+            if (!live.count(result) && result[0] == '%' && !keep(result)) {
+                released.insert(tac->get_arg());
+                continue;
+            }
+        }
+
+        new_instr.push_back(tac);
+        if (tac->has_result() && is_defined(tac->get_result()))
+            live.erase(tac->get_result());
+        for (auto &arg : tac->get_args()) {
+            if (is_used(arg))
+                live.insert(arg);
+        }
     }
 
+    bool changed = new_instr.size() != instr.size();
+    std::reverse(new_instr.begin(), new_instr.end());
     instr = new_instr;
-    // don't forget to recompute everything since instructions changed!!
+    // the caller updates the liveness of the released temporaries
+    return changed;
 }
 
 };
\ No newline at end of file
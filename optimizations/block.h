@@ -1,6 +1,7 @@
 #pragma once
 #include <set>
 #include <memory>
+#include <functional>
 #include "../mm/tac.h"
 #include "../mm/mm.h"
 #include "../utils/utils.h"
@@ -10,24 +11,50 @@ namespace opt {
 using Set = utils::GeneralSet<std::string>;
 using Label = std::string;
 
+// storage for the instructions of a CFG, allocated in chunks and never moved,
+// so blocks can keep plain pointers to them
+class InstrPool {
+private:
+    static constexpr std::size_t CHUNK_SIZE = 1024;
+
+    std::vector<std::unique_ptr<TAC[]>> chunks;
+    std::size_t used = CHUNK_SIZE;
+
+public:
+    template <typename... Args>
+    [[nodiscard]] TAC* make(Args&&... args) {
+        if (used == CHUNK_SIZE) {
+            chunks.push_back(std::make_unique<TAC[]>(CHUNK_SIZE));
+            used = 0;
+        }
+        auto tac = &chunks.back()[used++];
+        *tac = TAC(std::forward<Args>(args)...);
+        return tac;
+    }
+
+    void clear() {
+        chunks.clear();
+        used = CHUNK_SIZE;
+    }
+};
+
 class Block {
 private:
-    std::vector<std::shared_ptr<TAC>> instr;
+    std::vector<TAC*> instr;
     Label label;
-    std::vector<std::shared_ptr<TAC>> jumps;
     std::vector<Set> live_in, live_out; // liveness for each temporary
     std::vector<Set> def, use;
     bool start;
 
 public:
     Block() = default;
-    Block(std::vector<std::shared_ptr<TAC>>& instr, bool start);
+    Block(std::vector<TAC*>& instr, bool start);
 
-    void set_instr(std::vector<std::shared_ptr<TAC>>& _instr) {
+    void set_instr(std::vector<TAC*>& _instr) {
         instr = _instr;
     } 
 
-    [[nodiscard]] std::vector<std::shared_ptr<TAC>>& get_instr() {
+    [[nodiscard]] std::vector<TAC*>& get_instr() {
         return instr;
     }
 
@@ -35,11 +62,10 @@ public:
         return label;
     }
 
-    [[nodiscard]] std::vector<std::shared_ptr<TAC>> get_jumps() {
-        return jumps;
-    }
+    // jumps are recomputed every time, since passes rewrite the instructions
+    [[nodiscard]] std::vector<TAC*> get_jumps() const;
 
-    [[nodiscard]] Set get_live_out(size_t ind) {
+    [[nodiscard]] const Set& get_live_out(size_t ind) const {
         return live_out[ind];
     }
 
@@ -47,11 +73,14 @@ public:
         return start;
     }
 
-    void build_liveness(Set &live_in_block, Set &live_out_block);
+    void build_liveness(const Set &live_in_block, const Set &live_out_block);
 
     void build_def_use(Set &def_block, Set &use_block);
 
-    void eliminate_dead_copies();
+    // removes the copies whose result isn't live, given what is live at the end of the block
+    // copies into temporaries for which keep returns true are never removed
+    // the temporaries read by the removed copies are added to released
+    bool eliminate_dead_copies(const Set& live_out_block, const std::function<bool(const MM::Temporary&)>& keep, Set& released);
 };
 
 };
\ No newline at end of file
@@ -1,20 +1,23 @@
 #include "cfg.h"
+#include "analysis.h"
 #include "../asm/asm.h"
 #include <algorithm>
 
 namespace opt {
 
-[[nodiscard]] std::vector<Block> CFG::make_blocks(std::vector<TAC>& instr) {
-    std::vector<Block> blocks;
+[[nodiscard]] std::vector<Procedure> CFG::make_procs(std::vector<TAC>& instr) {
+    std::vector<Procedure> procs;
+    auto &func_of_temp = muncher.get_func_of_temps();
 
     for (auto &[start, finish] : muncher.procs_indexes()) {
+        auto &blocks = procs.emplace_back(Procedure{instr[start].get_result(), {}}).blocks;
         std::size_t i = start + 1;
         while (i <= finish) {
             assert(instr[i].get_opcode() == "label");
-            std::vector<std::shared_ptr<TAC>> block_instr;
+            std::vector<TAC*> block_instr;
 
             if (i == start + 1)
-                block_instr.push_back(std::make_shared<TAC>(instr[start]));
+                block_instr.push_back(pool.make(instr[start]));
 
     #ifdef DEBUG
             std::cerr << instr[i] << ", " << i << " start for block\n";
@@ -29,13 +32,18 @@ namespace opt {
     #endif
 
             // probably a block between [i, j)
-            while (i < j)
-                block_instr.push_back(std::make_shared<TAC>(instr[i++]));
-            
+            // anything after the first jmp or ret can never execute
+            bool ended = false;
+            for (; i < j; i++) {
+                if (!ended)
+                    block_instr.push_back(pool.make(instr[i]));
+                ended |= instr[i].get_opcode() == "jmp" || instr[i].get_opcode() == "ret";
+            }
+
             // missing jmp at the end of the block
             auto last_instr = block_instr.back()->get_opcode();
             if (last_instr != "jmp" && last_instr != "ret") {
-                block_instr.push_back(std::make_shared<TAC>(
+                block_instr.push_back(pool.make(
                     "jmp",
                     std::vector<std::string>{},
                     instr[j].get_arg()
@@ -45,43 +53,52 @@ namespace opt {
             blocks.push_back(Block(block_instr, block_instr[0]->get_opcode() == "proc"));
         }
 
-        // build the inheritance tree of temporaries
+        // temporaries of other functions are reached through the static link
         for (i = start + 1; i <= finish; i++) {
-            auto t = instr[i];
-            auto op = t.get_opcode();
-
-            // normal operations between temporaries only
-            if (op != "label" && op != "jmp" && assembly::jumps.find(op) == assembly::jumps.end() && t.has_result()) {
-                if (op == "copy") {
-                    auto arg = t.get_arg();
-                    if (original_temp.find(arg) == original_temp.end())
-                        original_temp[arg] = arg;
-                    original_temp[t.get_result()] = original_temp[arg];
-                }
-                else if (original_temp.find(t.get_result()) == original_temp.end())
-                    original_temp[t.get_result()] = t.get_result();
+            auto temps = instr[i].get_args();
+            if (instr[i].has_result())
+                temps.push_back(instr[i].get_result());
+
+            for (auto &temp : temps) {
+                if (temp.size() > 1 && temp[0] == '%' && std::isdigit(temp[1]) && func_of_temp[temp] != instr[start].get_result())
+                    captured.insert(temp);
             }
         }
     }
 
-    return blocks;
+    return procs;
 }
 
 void CFG::make_cfg(std::vector<TAC>& instr) {
-    blocks = make_blocks(instr);
+    captured.clear();
+    pool.clear();
+    procs = make_procs(instr);
     graph.clear();
+    block_index.clear();
 
-    for (auto &block : blocks) {
-        auto connections = block.get_jumps();
-        auto label = block.get_label();
+    for (std::size_t p = 0; p < procs.size(); p++) {
+        reindex(p);
+        for (auto &block : procs[p].blocks)
+            relink(block);
+    }
+}
+
+void CFG::reindex(std::size_t proc_ind) {
+    auto &blocks = procs[proc_ind].blocks;
+    for (std::size_t i = 0; i < blocks.size(); i++)
+        block_index[blocks[i].get_label()] = {proc_ind, i};
+}
+
+void CFG::relink(Block& block) {
+    auto label = block.get_label();
+    graph[label].clear();
 
-        for (auto &t : connections) {
-            auto t_label = t->has_result() ? t->get_result() : t->get_arg();
+    for (auto &t : block.get_jumps()) {
+        auto t_label = t->has_result() ? t->get_result() : t->get_arg();
 #ifdef DEBUG
-            std::cout << label << "->" << t_label << "\n";
+        std::cout << label << "->" << t_label << "\n";
 #endif
-            graph[label].insert({t_label, t});
-        }
+        graph[label].insert({t_label, t});
     }
 }
 
@@ -121,15 +138,36 @@ void CFG::make_cfg(std::vector<TAC>& instr) {
         instr.push_back(global);
     }
 
-    for (auto &block : blocks) {
-        auto block_instr = block.get_instr();
-        for (auto &t : block_instr) {
-            // std::cout << "Before " << *t << " ";
-            relabel_instr(*t);
-            instr.push_back(*t);
+    for (auto &proc : procs) {
+        auto &blocks = proc.blocks;
+        for (std::size_t b = 0; b < blocks.size(); b++) {
+            std::vector<TAC> block_instr;
+            for (auto t : blocks[b].get_instr())
+                block_instr.push_back(*t);
+
+            // falling into the next block needs no jump, and a conditional jump to it
+            // becomes the opposite one to the other target
+            if (b + 1 < blocks.size() && block_instr.back().get_opcode() == "jmp") {
+                auto next = blocks[b + 1].get_label();
+                auto n = block_instr.size();
+                auto other = block_instr.back().get_result();
+                if (other == next)
+                    block_instr.pop_back();
+                else if (n >= 2 && sign::taken_when.count(block_instr[n - 2].get_opcode()) && block_instr[n - 2].get_result() == next) {
+                    auto &branch = block_instr[n - 2];
+                    branch = TAC(sign::negate(branch.get_opcode()), branch.get_args(), other);
+                    block_instr.pop_back();
+                }
+            }
+
+            for (auto &t : block_instr) {
+                // std::cout << "Before " << t << " ";
+                relabel_instr(t);
+                instr.push_back(t);
 #ifdef DEBUG
-            std::cout << *t << "\n";
+                std::cout << t << "\n";
 #endif
+            }
         }
     }
 
@@ -140,76 +178,136 @@ void CFG::make_cfg(std::vector<TAC>& instr) {
     return instr;
 }
 
-void CFG::dfs(Label label, std::set<Label>& vis) {
-    vis.insert(label);
+[[nodiscard]] std::vector<Label> CFG::postorder(Label root, std::set<Label>& vis) {
+    std::vector<Label> order;
 
-    for (auto &[child_label, edge] : graph[label]) {
-        if (vis.find(child_label) != vis.end()) continue;
+    // explicit stack, recursion overflows on long chains of blocks
+    std::vector<std::pair<Label, std::map<Label, TAC*>::iterator>> stack;
+    vis.insert(root);
+    stack.push_back({root, graph[root].begin()});
 
-        dfs(child_label, vis);
-    }
-}
+    while (!stack.empty()) {
+        auto &[label, it] = stack.back();
+        if (it == graph[label].end()) {
+            order.push_back(label);
+            stack.pop_back();
+            continue;
+        }
 
-void CFG::uce() {
-    std::set<Label> vis;
+        auto child_label = (it++)->first;
+        if (vis.find(child_label) != vis.end())
+            continue;
 
-    std::size_t ind = 0;
-    for (std::size_t i = 0; i < muncher.procs_indexes().size(); i++) {
-        // find block matching the starting label of the procedure
-        while (ind < blocks.size() && !blocks[ind].is_starting())
-            ind++;
+        vis.insert(child_label);
+        stack.push_back({child_label, graph[child_label].begin()});
+    }
 
-        auto root = blocks[ind].get_label();
+    return order;
+}
 
-    #ifdef DEBUG
-        std::cout << "Removing unreachable blocks from " << root << "\n";
-    #endif
+bool CFG::uce(Procedure& proc) {
+    std::set<Label> vis;
 
-        dfs(root, vis);
+#ifdef DEBUG
+    std::cout << "Removing unreachable blocks from " << proc.get_root() << "\n";
+#endif
 
-        ind++;
-    }
+    [[maybe_unused]] auto order = postorder(proc.get_root(), vis);
+    if (order.size() == proc.blocks.size())
+        return false;
 
     std::vector<Block> temp_blocks;
-    for (auto &block : blocks) {
+    for (auto &block : proc.blocks) {
         auto label = block.get_label();
         if (vis.find(label) != vis.end())
             temp_blocks.push_back(std::move(block));
-#ifdef DEBUG
         else {
+            graph.erase(label);
+            block_index.erase(label);
+#ifdef DEBUG
             std::cout << "Removed useless block " << label << "\n";
-        }
 #endif
+        }
     }
 
-    blocks = std::move(temp_blocks);
-}
+    proc.blocks = std::move(temp_blocks);
+    reindex(&proc - procs.data());
 
-void CFG::coalesce() {
-    bool found = true;
-    while (found) {
-        found = false;
+    // phis can't read from blocks which don't exist anymore
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (tac->get_opcode() != "phi")
+                continue;
+            std::erase_if(tac->get_phi_args(), [&](auto& phi_arg) { return !vis.count(phi_arg.first); });
+        }
+    }
+    return true;
+}
 
-        // compute in degrees
-        std::map<Label, int> in_deg;
-        for (auto &block : blocks) {
-            auto label = block.get_label();
+[[nodiscard]] bool CFG::may_trap(TAC* tac, const std::unordered_map<MM::Temporary, TAC*>& def) {
+    auto op = tac->get_opcode();
+    if (op != "div" && op != "mod")
+        return false;
+
+    // idivq traps on a zero divisor and on LLONG_MIN / -1
+    auto it = def.find(tac->get_args()[1]);
+    while (it != def.end() && it->second->get_opcode() == "copy" && it->second->get_args().size() == 1)
+        it = def.find(it->second->get_arg());
+    if (it == def.end() || it->second->get_opcode() != "const")
+        return true;
+    auto &value = it->second->get_arg();
+    return !((std::isdigit(value[0]) && value != "0") || (value[0] == '-' && value != "-1"));
+}
 
-            for (auto [child_node, tac] : graph[label]) {
-                in_deg[child_node]++;
-            }
+void CFG::prune_phi_args(Procedure& proc) {
+    std::map<Label, std::set<Label>> preds;
+    for (auto &block : proc.blocks) {
+        for (auto &[succ, _] : get_successors(block.get_label()))
+            preds[succ].insert(block.get_label());
+    }
+    for (auto &block : proc.blocks) {
+        auto &from = preds[block.get_label()];
+        for (auto tac : block.get_instr()) {
+            if (tac->get_opcode() == "phi")
+                std::erase_if(tac->get_phi_args(), [&](auto& phi_arg) { return !from.count(phi_arg.first); });
         }
+    }
+}
 
-        for (auto &block : blocks) {
-            auto label = block.get_label();
+bool CFG::coalesce(Procedure& proc, AnalysisManager& am) {
+    // compute in degrees
+    std::map<Label, int> in_deg;
+    for (auto &[label, preds] : am.predecessors(proc))
+        in_deg[label] = preds.size();
 
-            if (graph[label].size() != 1)
-                continue;
+    // the only way out of the block is its final jmp
+    auto only_jumps_to = [&](Block& block) -> std::optional<Label> {
+        auto label = block.get_label();
+        if (graph[label].size() != 1 || block.get_jumps().size() != 1)
+            return std::nullopt;
+        if (block.get_instr().back()->get_opcode() != "jmp")
+            return std::nullopt;
+        return graph[label].begin()->first;
+    };
 
-            auto [child_label, tac] = *graph[label].begin();
+    // in reverse postorder the head of every chain is visited before the rest of it,
+    // so each block is appended exactly once
+    std::set<Label> merged;
+    bool changed = false;
 
-            if (in_deg[child_label] != 1)
-                continue;
+    for (auto &label : am.rpo(proc)) {
+        if (merged.count(label))
+            continue;
+
+        auto &block = get_block(label);
+        while (true) {
+            auto child = only_jumps_to(block);
+            if (!child.has_value())
+                break;
+
+            auto child_label = child.value();
+            if (child_label == label || in_deg[child_label] != 1 || get_block(child_label).is_starting())
+                break;
 
             // we have
             // L0: ....
@@ -221,283 +319,279 @@ void CFG::coalesce() {
             // remove jmp at the end
             block.get_instr().pop_back();
 
-            auto child_instr = get_block(child_label).get_instr();
-
-            // remove label at thee beginning
-            child_instr.erase(child_instr.begin());
-            utils::concat(block.get_instr(), child_instr);
+            // remove label at the beginning
+            auto &child_instr = get_block(child_label).get_instr();
+            block.get_instr().insert(block.get_instr().end(), std::next(child_instr.begin()), child_instr.end());
+            child_instr.clear();
 
-            // assign all sons of child_label to current label
-            graph[label].erase(child_label);
-            for (auto &[child_label, tac] : graph[child_label])
-                graph[label][child_label] = tac;
+            // all sons of child_label now belong to the current label
+            graph[label] = std::move(graph[child_label]);
             graph[child_label].clear();
+            merged.insert(child_label);
+            changed = true;
 
 #ifdef DEBUG
             std::cout << "Coalesced " << label << "->" << child_label << "\n";
 #endif
-            
-            found = true;
-            break;
         }
-
-        // cleanup (maybe not needed every time?)
-        uce();
     }
+
+    // merged blocks are unreachable now, drop them all at once
+    bool removed = uce(proc);
+    return changed || removed;
 }
 
-void CFG::jt_seq_uncond() {
-    bool found_chain = true;
-    while (found_chain) {
-        found_chain = false;
+bool CFG::jt_seq_uncond(Procedure& proc, [[maybe_unused]] AnalysisManager& am) {
+    // a block which only jumps somewhere else
+    auto is_empty = [&](Block& block) {
+        auto &instr = block.get_instr();
+        return !block.is_starting() && instr.size() == 2 && instr.back()->get_opcode() == "jmp";
+    };
 
-        for (auto &block : blocks) {
-            auto label = block.get_label();
+    // final destination of each chain of empty blocks, computed once per block
+    std::map<Label, Label> target;
+    auto resolve = [&](Label label) {
+        std::vector<Label> path;
+        std::set<Label> on_path;
 
-            for (auto [child_node, tac] : graph[label]) {
-                if (graph[child_node].size() == 1) {
-                    auto child_block = get_block(child_node);
+        while (!target.count(label) && !on_path.count(label) && block_index.count(label) && is_empty(get_block(label))) {
+            path.push_back(label);
+            on_path.insert(label);
+            label = get_block(label).get_instr().back()->get_result();
+        }
 
-                    if (child_block.get_instr().size() == 2) {
-                        // make jmp point to the label this dummy block points to
-                        auto target_label = child_block.get_instr().back()->get_result(); 
-                        tac->set_result(target_label);
-                        graph[label].erase(child_node);
-                        graph[label][target_label] = tac;
+        // a cycle of empty blocks is an infinite loop, keep jumping into it
+        auto dest = target.count(label) ? target[label] : label;
+        for (auto &node : path)
+            target[node] = dest;
+        return dest;
+    };
 
-#ifdef DEBUG
-                        std::cout << label << "->" << child_node << "->" << target_label << "\n";
-#endif
-                        
-                        found_chain = true;
-                        break;
-                    }
-                }
-            }
-            if (found_chain) break;
-        }
+    bool any_changed = false;
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        bool changed = false;
 
-        // cleanup (maybe not needed every time?)
-        uce();
-    }
-}
+        for (auto &tac : block.get_jumps()) {
+            auto child_label = tac->get_result();
+            auto target_label = resolve(child_label);
+
+            // don't let an empty block jump to itself when it can leave the cycle
+            if (target_label == child_label || (target_label == label && is_empty(block)))
+                continue;
+
+            // make jmp point to the label this dummy block points to
+            tac->set_result(target_label);
+            changed = true;
 
-void CFG::jt_cond_to_uncond() {
-    bool found_cond = true;
-    while (found_cond) {
-        found_cond = false;
-
-        for (auto &block : blocks) {
-            auto label = block.get_label();
-            for (auto [child_node, tac] : graph[label]) {
-                // only conditional jumps
-                auto jump = tac->get_opcode();
-                if (assembly::jumps.find(jump) == assembly::jumps.end())
-                    continue;
-                
-                auto &child_block = get_block(child_node);
-                auto &child_instr = child_block.get_instr();
-
-                for (std::size_t i = 0; i < child_instr.size(); i++) {
-                    // we entered the child block with like
-                    // jc %1, %.La
-                    // then we have
-                    // jc %1, %.Lb
-                    // so simply replace it with jmp and delete code after
-                    auto &temp_tac = child_instr[i];
 #ifdef DEBUG
-                    if (temp_tac->get_opcode() == jump) {
-                        std::cout << *temp_tac << "\n";
-                        std::cout << *tac << "\n";
-                        std::cout << original_temp[temp_tac->get_arg()] << "\n";
-                        std::cout << original_temp[tac->get_arg()] << "\n";
-                    }
+            std::cout << label << "->" << child_label << "->" << target_label << "\n";
 #endif
-                    if (temp_tac->get_opcode() == jump && original_temp[temp_tac->get_arg()] == original_temp[tac->get_arg()]) {
-                        found_cond = true;
-
-                        child_instr[i] = std::make_shared<TAC>(
-                            "jmp",
-                            std::vector<std::string>{},
-                            temp_tac->get_result()
-                        );
-                        child_instr.resize(i + 1);
-                        break;
-                    }
-                }
-            }
-            if (found_cond) break;
         }
 
-        // cleanup (maybe not needed every time?)
-        uce();
+        if (changed)
+            relink(block);
+        any_changed |= changed;
     }
+
+    // cleanup
+    bool removed = uce(proc);
+    return any_changed || removed;
 }
 
-void CFG::build_liveness() {
-    std::map<Label, Set> live_in_block, live_out_block;
-    std::map<Label, Set> def_block, use_block;
+bool CFG::jt_cond_to_uncond(Procedure& proc, AnalysisManager& am) {
+    using namespace sign;
+
+    std::map<Label, std::set<Label>> preds;
+    for (auto &[label, block_preds] : am.predecessors(proc))
+        preds[label].insert(block_preds.begin(), block_preds.end());
 
-    // build def and use sets
-    for (auto &block : blocks) {
-        block.build_def_use(def_block[block.get_label()], use_block[block.get_label()]);
+    std::vector<Label> worklist;
+    std::set<Label> queued;
+    for (auto it = proc.blocks.rbegin(); it != proc.blocks.rend(); it++) {
+        worklist.push_back(it->get_label());
+        queued.insert(it->get_label());
     }
 
-    // liveness of each block
-    {
-        bool changed = true;
-        while (changed) {
-            changed = false;
-            for (auto it = blocks.rbegin(); it != blocks.rend(); it++) {
-                auto &block = *it;
-                auto label = block.get_label();
-                auto temp_in = live_in_block[label];
-                auto temp_out = live_out_block[label];
-
-                live_out_block[label] = Set();
-                for (auto &[succ_label, _] : graph[label]) {
-                    live_out_block[label] = live_out_block[label].join(live_in_block[succ_label]);
-                }
+    bool any_changed = false;
+    auto push = [&](Label label) {
+        if (queued.insert(label).second)
+            worklist.push_back(label);
+    };
 
-                live_in_block[label] = use_block[label].join(live_out_block[label].minus(def_block[label]));
-                if (live_in_block[label] != temp_in || live_out_block[label] != temp_out)
+    while (!worklist.empty()) {
+        auto label = worklist.back();
+        worklist.pop_back();
+        queued.erase(label);
+
+        auto &block = get_block(label);
+        if (block.is_starting() || preds[label].size() != 1)
+            continue;
+
+        // we can only enter this block through a single predecessor ending in
+        // jc %1, %.La
+        // jmp %.Lb
+        auto pred_label = *preds[label].begin();
+        auto &pred_instr = get_block(pred_label).get_instr();
+        if (pred_label == label || pred_instr.size() < 2)
+            continue;
+
+        auto cond = pred_instr[pred_instr.size() - 2];
+        auto taken = taken_when.find(cond->get_opcode());
+        if (taken == taken_when.end() || pred_instr.back()->get_opcode() != "jmp")
+            continue;
+
+        // what we know about the comparison on entry
+        int known;
+        if (cond->get_result() == label && pred_instr.back()->get_result() != label)
+            known = taken->second;
+        else if (cond->get_result() != label && pred_instr.back()->get_result() == label)
+            known = ANY ^ taken->second;
+        else
+            continue;
+
+        auto compared = cond->get_args();
+        auto &instr = block.get_instr();
+        bool changed = false;
+
+        for (std::size_t i = 1; i < instr.size(); i++) {
+            auto tac = instr[i];
+            auto op = tac->get_opcode();
+
+            if (op == "jmp" || op == "ret")
+                break;
+
+            if (auto it = taken_when.find(op); it != taken_when.end() && tac->get_args() == compared) {
+                if ((known & it->second) == known) {
+                    // always taken, simply replace it with jmp and delete code after
+                    *tac = TAC(
+                        "jmp",
+                        std::vector<std::string>{},
+                        tac->get_result()
+                    );
+                    instr.resize(i + 1);
+                    changed = true;
+                    break;
+                }
+                if ((known & it->second) == 0) {
+                    // never taken
+                    instr.erase(instr.begin() + i--);
                     changed = true;
+                }
+                continue;
             }
+
+            // a compared temporary was redefined, we don't know anything anymore
+            if (tac->has_result() && std::find(compared.begin(), compared.end(), tac->get_result()) != compared.end())
+                break;
         }
-    }
 
-    // liveness of each instruction
-    for (auto &block : blocks) {
-        block.build_liveness(live_in_block[block.get_label()], live_out_block[block.get_label()]);
-    }
-}
+        if (!changed)
+            continue;
+        any_changed = true;
 
-void CFG::ssa_crude() {
-    // build liveness
-    std::map<Label, Set> live_in_block, live_out_block;
-    std::map<Label, Set> def_block, use_block;
+#ifdef DEBUG
+        std::cout << "Threaded conditional jumps of " << label << " through " << pred_label << "\n";
+#endif
+
+        auto old_children = graph[label];
+        relink(block);
 
-    // build def and use sets
-    for (auto &block : blocks) {
-        block.build_def_use(def_block[block.get_label()], use_block[block.get_label()]);
+        for (auto &[child_label, _] : old_children) {
+            if (!graph[label].count(child_label))
+                preds[child_label].erase(label);
+            push(child_label);
+        }
     }
 
-    // liveness of each block
-    {
-        bool changed = true;
-        while (changed) {
-            changed = false;
-            for (auto it = blocks.rbegin(); it != blocks.rend(); it++) {
-                auto &block = *it;
-                auto label = block.get_label();
-                auto temp_in = live_in_block[label];
-                auto temp_out = live_out_block[label];
-
-                live_out_block[label] = Set();
-                for (auto &[succ_label, _] : graph[label]) {
-                    live_out_block[label] = live_out_block[label].join(live_in_block[succ_label]);
-                }
+    // cleanup
+    bool removed = uce(proc);
+    return any_changed || removed;
+}
 
-                live_in_block[label] = use_block[label].join(live_out_block[label].minus(def_block[label]));
-                if (live_in_block[label] != temp_in || live_out_block[label] != temp_out)
-                    changed = true;
-            }
+std::map<Label, Label> CFG::make_preheaders(Procedure& proc, AnalysisManager& am, const std::set<Label>& headers) {
+    auto &info = am.loops(proc);
+    auto preds = am.predecessors(proc);
+
+    std::map<Label, Label> made;
+    std::map<Label, Block> preheaders;
+    for (auto &loop : info.loops) {
+        auto &header = get_block(loop.header);
+        if (!headers.count(loop.header) || loop.preheader.has_value() || header.is_starting())
+            continue;
+
+        std::vector<Label> entering;
+        for (auto &pred_label : preds.at(loop.header)) {
+            if (!loop.body.count(pred_label))
+                entering.push_back(pred_label);
         }
-    }
+        if (entering.empty())
+            continue;
 
-    // liveness of each instruction
-    for (auto &block : blocks) {
-        block.build_liveness(live_in_block[block.get_label()], live_out_block[block.get_label()]);
-    }
-    
-    // add phi functions at block entries based on live-in sets
-    for (auto &block : blocks) {
-        auto label = block.get_label();
-        auto preds = get_predecessors(label);
-        auto live_in = live_in_block[label];
-        
-        std::vector<std::shared_ptr<TAC>> new_instr;
-        for (auto &temp : live_in.get_set()) {
-            std::map<Label, std::string> phi_args;
-            for (auto &pred_label : preds) {
-                phi_args[pred_label] = temp;
+        auto preheader_label = muncher.new_label();
+        std::vector<TAC*> preheader_instr = {pool.make("label", std::vector<std::string>{preheader_label})};
+
+        for (auto &pred_label : entering) {
+            for (auto tac : get_block(pred_label).get_jumps()) {
+                if (tac->get_result() == loop.header)
+                    tac->set_result(preheader_label);
             }
-            new_instr.push_back(std::make_shared<TAC>(
-                "phi",
-                phi_args,
-                ""
-            ));
         }
-        
-        // insert phi instructions at the beginning of the block
-        auto &instr = block.get_instr();
-        instr.insert(instr.begin(), new_instr.begin(), new_instr.end());
-    }
-    
-    // temporary versioning
-    std::map<std::string, int> version_counter;
-    std::map<Label, std::map<std::string, std::string>> version_maps;
-    
-    // version_maps["entry"] = {};
-    
-    for (auto &block : blocks) {
-        auto label = block.get_label();
-        auto &instr = block.get_instr();
-        std::map<std::string, std::string> &ver_map = version_maps[label];
-        
-        for (auto &tac_ptr : instr) {
-            auto &t = *tac_ptr;
-            
-            for (auto &arg : t.get_args()) {
-                if (arg[0] == '%' && ver_map.count(arg)) {
-                    arg = ver_map[arg];
-                }
-            }
-            
-            if (t.get_opcode() == "phi") {
-                auto &phi_args = t.get_phi_args();
-                for (auto &[pred_label, temp] : phi_args) {
-                    if (version_maps.count(pred_label) && version_maps[pred_label].count(temp)) {
-                        phi_args[pred_label] = version_maps[pred_label][temp];
-                    }
-                }
+
+        // in SSA form the values coming from outside are merged in the preheader first
+        auto &instr = header.get_instr();
+        for (auto i = first_non_phi(header); i-- > 1 && instr[i]->get_opcode() == "phi";) {
+            auto &phi_args = instr[i]->get_phi_args();
+            std::map<Label, std::string> outside_args;
+            for (auto &pred_label : entering) {
+                outside_args[pred_label] = phi_args[pred_label];
+                phi_args.erase(pred_label);
             }
-            
-            if (t.has_result() && t.get_result()[0] == '%' && std::isdigit(t.get_result()[1])) {
-                std::string root = t.get_result();
-                if (version_counter.count(root) == 0) {
-                    version_counter[root] = 0;
-                }
-                std::string new_temp = root + "." + std::to_string(version_counter[root]++);
-                t.set_result(new_temp);
-                ver_map[root] = new_temp;
+
+            if (entering.size() == 1)
+                phi_args[preheader_label] = outside_args.begin()->second;
+            else {
+                auto temp = muncher.new_temp(proc.name);
+                preheader_instr.push_back(pool.make("phi", outside_args, temp));
+                phi_args[preheader_label] = temp;
             }
         }
+
+        preheader_instr.push_back(pool.make("jmp", std::vector<std::string>{}, loop.header));
+        preheaders.emplace(loop.header, Block(preheader_instr, false));
+        made[loop.header] = preheader_label;
+
+#ifdef DEBUG
+        std::cout << "Inserted preheader " << preheader_label << " for loop " << loop.header << "\n";
+#endif
     }
-    
-    for (auto &block : blocks) {
-        auto &instr = block.get_instr();
-        for (auto &tac_ptr : instr) {
-            if (tac_ptr->get_opcode() == "phi") {
-                auto &phi_args = tac_ptr->get_phi_args();
-                for (auto &[pred_label, temp] : phi_args) {
-                    if (version_maps.count(pred_label)) {
-                        std::string root = temp;
-                        size_t dot_pos = root.find('.');
-                        if (dot_pos != std::string::npos) {
-                            root = root.substr(0, dot_pos);
-                        }
-                        if (version_maps[pred_label].count(root)) {
-                            phi_args[pred_label] = version_maps[pred_label][root];
-                        }
-                    }
-                }
-            }
-        }
+
+    if (preheaders.empty())
+        return made;
+
+    // each preheader goes right before its header
+    std::vector<Block> blocks;
+    for (auto &block : proc.blocks) {
+        if (auto it = preheaders.find(block.get_label()); it != preheaders.end())
+            blocks.push_back(std::move(it->second));
+        blocks.push_back(std::move(block));
     }
+    proc.blocks = std::move(blocks);
+    reindex(&proc - procs.data());
+
+    for (auto &block : proc.blocks)
+        relink(block);
+    return made;
+}
+
+bool CFG::insert_preheaders(Procedure& proc, AnalysisManager& am) {
+    std::set<Label> headers;
+    for (auto &loop : am.loops(proc).loops)
+        headers.insert(loop.header);
+    return !make_preheaders(proc, am, headers).empty();
 }
 
-void CFG::copy_propagation() {
+bool CFG::copy_propagation(Procedure& proc, AnalysisManager& am) {
     // bool changed = true;
     // while (changed) {
     //     changed = false;
@@ -546,7 +640,7 @@ void CFG::copy_propagation() {
     //     for (auto &block : blocks) {
     //         auto &instr = block.get_instr();
     //         instr.erase(std::remove_if(instr.begin(), instr.end(), 
-    //             [](const std::shared_ptr<TAC>& tac) {
+    //             [](const TAC* tac) {
     //                 return tac->get_opcode() == "copy" && 
     //                        tac->has_result() && 
     //                        tac->get_result() == tac->get_arg();
@@ -561,11 +655,12 @@ void CFG::copy_propagation() {
     //         std::cout << *instr << "\n";
     // }
 
-    bool changed = true;
+    bool changed = true, any_changed = false;
     while (changed) {
         changed = false;
-        for (auto &block : blocks) {
+        for (auto &block : proc.blocks) {
             auto &instr = block.get_instr();
+            Set rewritten;
             for (std::size_t i = 0; i < instr.size(); i++) {
                 auto tac = instr[i];
                 if (tac->get_opcode() != "copy" || tac->get_args().size() > 1)
@@ -576,7 +671,7 @@ void CFG::copy_propagation() {
 
                 // we are copying a function parameter
                 // don't modify
-                if (from[1] == 'p')
+                if (from[1] == 'p' || from == to)
                     continue;
 
                 for (std::size_t j = i + 1; j < instr.size(); j++) {
@@ -586,20 +681,30 @@ void CFG::copy_propagation() {
                     if (curr_tac->has_result() && (curr_tac->get_result() == from || curr_tac->get_result() == to))
                         break;
 
+                    // the callee might change captured temporaries or globals
+                    if (curr_tac->get_opcode() == "call" && (is_captured(from) || is_captured(to)))
+                        break;
+
                     for (auto &arg : curr_tac->get_args()) {
                         if (arg == to) {
                             arg = from;
-                            changed = true;
+                            changed = any_changed = true;
+                            rewritten.insert(from), rewritten.insert(to);
                             break;
                         }
                     }
                 }
             }
+
+            // only the uses inside this block moved
+            if (!rewritten.get_set().empty())
+                am.update_liveness(proc, block.get_label(), rewritten);
         }
     }
+    return any_changed;
 }
 
-void CFG::eliminate_dead_copies() {
+bool CFG::eliminate_dead_copies(Procedure& proc, AnalysisManager& am) {
     // bool changed = true;
     // while (changed) {
     //     build_liveness();
@@ -607,7 +712,7 @@ void CFG::eliminate_dead_copies() {
     //     for (auto &block : blocks) {
     //         auto &instr = block.get_instr();
     //         auto label = block.get_label();
-    //         std::vector<std::shared_ptr<TAC>> new_instr;
+    //         std::vector<TAC*> new_instr;
 
     //         for (std::size_t i = 0; i < instr.size(); i++) {
     //             auto tac = instr[i];
@@ -647,10 +752,37 @@ void CFG::eliminate_dead_copies() {
     //         block.set_instr(new_instr);
     //     }
     // }
-    build_liveness();
-    for (auto &block : blocks) {
-        block.eliminate_dead_copies();
+    auto &liveness = am.liveness(proc);
+    bool changed = false;
+
+    // removing a copy can make the copies feeding it dead, inside the block the sweep
+    // takes care of it, the other blocks are revisited when their live-out shrinks
+    std::vector<Label> worklist;
+    std::set<Label> queued;
+    for (auto it = proc.blocks.rbegin(); it != proc.blocks.rend(); it++) {
+        worklist.push_back(it->get_label());
+        queued.insert(it->get_label());
+    }
+
+    while (!worklist.empty()) {
+        auto label = worklist.back();
+        worklist.pop_back();
+        queued.erase(label);
+
+        auto &block = get_block(label);
+        Set released;
+
+        // nested functions may read captured temporaries at any call
+        if (!block.eliminate_dead_copies(liveness.live_out.at(label), [&](const MM::Temporary& temp) { return is_captured(temp); }, released))
+            continue;
+        changed = true;
+
+        for (auto &affected_label : am.update_liveness(proc, label, released)) {
+            if (queued.insert(affected_label).second)
+                worklist.push_back(affected_label);
+        }
     }
+    return changed;
 }
 
 };
\ No newline at end of file
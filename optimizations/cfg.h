@@ -1,33 +1,129 @@
 #pragma once
 #include "../mm/tac.h"
 #include "../mm/mm.h"
-#include "../asm/asm.h"
 #include "block.h"
 #include <set>
 #include <cassert>
-#include <memory>
+#include <unordered_map>
 
 namespace opt {
 
-enum class OptimizationType {
-    DEAD_COPY_REMOVAL,
-    JT_SEQ_UNCOND,
-    JT_COND_TO_UNCOND,
-    COALESCE
+class AnalysisManager;
+struct CallSummaries;
+struct Loop;
+
+// each conditional jump is taken for a subset of {< 0, == 0, > 0}, its first
+// operand compared with the second one, or with 0 when it has a single operand
+namespace sign {
+
+inline constexpr int NEG = 1, ZERO = 2, POS = 4, ANY = NEG | ZERO | POS;
+
+inline const std::map<std::string, int> taken_when = {
+    {"jz", ZERO}, {"jnz", NEG | POS}, {"jl", NEG}, {"jle", NEG | ZERO}, {"jg", POS}, {"jge", ZERO | POS}
+};
+
+// the comparisons giving 1 or 0 instead of jumping
+inline const std::map<std::string, int> set_when = {
+    {"setz", ZERO}, {"setnz", NEG | POS}, {"setl", NEG}, {"setle", NEG | ZERO}, {"setg", POS}, {"setge", ZERO | POS}
+};
+
+[[nodiscard]] inline int compare(long long a, long long b = 0) {
+    return a < b ? NEG : a == b ? ZERO : POS;
+}
+
+// the jump taken exactly when the given one isn't
+[[nodiscard]] inline std::string negate(const std::string& jump) {
+    auto when = ANY ^ taken_when.at(jump);
+    for (auto &[other, other_when] : taken_when) {
+        if (other_when == when)
+            return other;
+    }
+    assert(false);
+    return jump;
+}
+
+};
+
+// the value of a const instruction, nothing for the names of procedures
+[[nodiscard]] std::optional<long long> parse_number(const std::string& s);
+
+// op on constant operands, with the same results as the code the assembler emits,
+// nothing for the divisions which trap
+[[nodiscard]] std::optional<long long> fold(const std::string& op, const std::vector<long long>& v);
+
+// blocks of a single procedure, the first one is its entry
+struct Procedure {
+    std::string name;
+    std::vector<Block> blocks;
+
+    [[nodiscard]] Label get_root() {
+        assert(!blocks.empty() && blocks[0].is_starting());
+        return blocks[0].get_label();
+    }
 };
 
 class CFG {
 private:
-    std::vector<Block> blocks;
-    std::map<Label, std::map<Label, std::shared_ptr<TAC>>> graph;
-    std::map<std::string, std::string> original_temp;
+    std::vector<Procedure> procs;
+    std::map<Label, std::pair<std::size_t, std::size_t>> block_index;
+    std::map<Label, std::map<Label, TAC*>> graph;
+    InstrPool pool;
+
+    // temporaries used outside of the function that defines them, or globals
+    // calls can read and write them behind our back
+    std::set<MM::Temporary> captured;
+
     MM::MM& muncher;
 
-    [[nodiscard]] std::vector<Block> make_blocks(std::vector<TAC>& instr);
+    // headers of the loops the unroller is done with: the two loops a partially
+    // unrolled one becomes, and the constant loops too long to evaluate
+    std::set<Label> unrolled;
+
+    // sizes, callees and static link uses of every procedure, for the inliner
+    // and the tail calls
+    std::shared_ptr<CallSummaries> call_summaries;
+
+    // the procedure a call through code_pointer always goes to, if summarize_calls knows it
+    [[nodiscard]] std::optional<std::string> known_callee(const MM::Temporary& code_pointer) const;
+
+    [[nodiscard]] std::vector<Procedure> make_procs(std::vector<TAC>& instr);
+
+    // recomputes the position of every block of proc after its blocks changed
+    void reindex(std::size_t proc_ind);
+
+    // recomputes the outgoing edges of a block from its jumps
+    void relink(Block& block);
+
+    // local temporaries of proc which get renamed in SSA form
+    [[nodiscard]] bool is_ssa_var(const Procedure& proc, const MM::Temporary& temp) const;
 
-    void dfs(Label node, std::set<Label>& vis);
+    // position of the first instruction after the label and the phis of a block
+    [[nodiscard]] static std::size_t first_non_phi(Block& block);
 
-    void build_liveness();
+    // whether tac is a div or mod which idivq could trap on, the divisor being
+    // looked up through copies in the SSA definitions def
+    [[nodiscard]] static bool may_trap(TAC* tac, const std::unordered_map<MM::Temporary, TAC*>& def);
+
+    // phis can't read from blocks which don't jump to them anymore
+    void prune_phi_args(Procedure& proc);
+
+    // adds a preheader in front of the given loop headers which don't have one yet
+    // returns the label of each preheader it made, by header
+    std::map<Label, Label> make_preheaders(Procedure& proc, AnalysisManager& am, const std::set<Label>& headers);
+
+    // orders parallel copies (to, from) so that no source is overwritten before it's read
+    [[nodiscard]] std::vector<TAC*> sequentialize(const Procedure& proc, std::vector<std::pair<MM::Temporary, MM::Temporary>> copies);
+
+    // runs a loop computing only on constants at compile time, its preheader then
+    // sets what the loop leaves behind and jumps to where it exits
+    bool evaluate_loop(Procedure& proc, AnalysisManager& am, const Loop& loop);
+
+    // copies the body of an innermost loop with a trip count, entirely when it runs
+    // a few times, a few times in a row before the original loop otherwise
+    bool unroll_loop(Procedure& proc, const Loop& loop);
+
+    // merges the temporaries of the copies (to, from) whose live ranges don't interfere
+    void coalesce_copies(Procedure& proc, AnalysisManager& am, const std::vector<std::pair<MM::Temporary, MM::Temporary>>& copies);
 
 public:
     CFG(MM::MM& muncher) : muncher(muncher) {};
@@ -36,88 +132,106 @@ public:
 
     [[nodiscard]] std::vector<TAC> make_tac();
 
+    [[nodiscard]] std::vector<Procedure>& get_procs() {
+        return procs;
+    }
+
     [[nodiscard]] Block& get_block(Label label) {
-        for (auto &block : blocks) {
-            if (block.get_label() == label)
-                return block;
-        }
-        assert(false);
+        auto it = block_index.find(label);
+        assert(it != block_index.end());
+        return procs[it->second.first].blocks[it->second.second];
+    }
+
+    [[nodiscard]] std::map<Label, TAC*>& get_successors(const Label& label) {
+        return graph[label];
     }
 
-    [[nodiscard]] std::vector<Label> get_predecessors(std::string label) {
-        std::vector<Label> pred;
-        for (auto &block : blocks) {
-            auto pred_label = block.get_label();
-            for (auto &[son, _] : graph[pred_label]) {
-                if (son == label) {
-                    pred.push_back(pred_label);
-                    break;
-                }
-            }
-        }
-
-        return pred;
+    [[nodiscard]] bool is_captured(const MM::Temporary& temp) const {
+        return temp[0] == '@' || captured.count(temp);
     }
 
+    // iterative dfs, returns the blocks reachable from root in postorder
+    [[nodiscard]] std::vector<Label> postorder(Label root, std::set<Label>& vis);
+
     // unreachable code elimination
-    void uce();
+    bool uce(Procedure& proc);
 
     // Block coalescing (block jumps unconditionally only to another block)
-    void coalesce();
+    // chains are merged in a single sweep in reverse postorder
+    bool coalesce(Procedure& proc, AnalysisManager& am);
 
     // Jump Threading: Sequencing Unconditional Jumps
-    void jt_seq_uncond();
+    // every jump is redirected to the end of its chain of empty blocks
+    bool jt_seq_uncond(Procedure& proc, AnalysisManager& am);
 
     // Jump Threading: Turning Conditional into Unconditional Jumps
-    void jt_cond_to_uncond();
+    // worklist over blocks with a single predecessor
+    bool jt_cond_to_uncond(Procedure& proc, AnalysisManager& am);
+
+    // Gives every loop a single block entering it from outside, which only jumps to the header
+    bool insert_preheaders(Procedure& proc, AnalysisManager& am);
 
     // Propagates temporaries from copies
-    void copy_propagation();
+    bool copy_propagation(Procedure& proc, AnalysisManager& am);
 
     // Deletes dead copies (the result isn't used anywhere)
-    void eliminate_dead_copies();
+    bool eliminate_dead_copies(Procedure& proc, AnalysisManager& am);
 
-    // Generate crude SSA code
-    void ssa_crude();
-};
+    // Conservative coalescing (Briggs, George) on the interference graph of the whole
+    // procedure, the temporaries of a copy become one when that can't cost a register
+    bool coalesce_temporaries(Procedure& proc, AnalysisManager& am);
 
+    // Reads the register parameters themselves until something can write their registers,
+    // the copies from the entry block move right before the first such instruction
+    bool keep_params(Procedure& proc, AnalysisManager& am);
 
-template <OptimizationType opt>
-inline void optimize(MM::MM& muncher, std::vector<TAC> &instr, std::string file_prefix) {
-    CFG cfg(muncher);
-    cfg.make_cfg(instr);
+    // Pruned SSA: phis on the iterated dominance frontier of the definitions where
+    // the temporary is live, renaming over the dominator tree
+    bool to_ssa(Procedure& proc, AnalysisManager& am);
 
-    // apply optimization
-    std::string suffix = "";
-    if constexpr (opt == OptimizationType::DEAD_COPY_REMOVAL) {
-        cfg.copy_propagation();
-        cfg.eliminate_dead_copies();
-        suffix = "deadcopy";
-    }
-    else if constexpr (opt == OptimizationType::JT_SEQ_UNCOND) {
-        cfg.jt_seq_uncond();
-        suffix = "jtseq";
-    }
-    else if constexpr (opt == OptimizationType::JT_COND_TO_UNCOND) {
-        cfg.jt_cond_to_uncond();
-        suffix = "jtcond";
-    }
-    else if constexpr (opt == OptimizationType::COALESCE) {
-        cfg.coalesce();
-        suffix = "coalesce";
-    }
+    // Out of SSA: splits critical edges, turns phis into sequentialized parallel
+    // copies and coalesces the temporaries they relate
+    bool from_ssa(Procedure& proc, AnalysisManager& am);
 
-    // convert CFG to TAC instructions
-    instr = cfg.make_tac();
+    // gathers what inline_calls and tail_calls need to know about the whole program,
+    // before each of their runs
+    void summarize_calls();
 
-    muncher.process(instr);
-    // muncher.jsonify(file_prefix + "." + suffix + ".tac.json", instr);
-    muncher.jsonify(file_prefix + ".tac.json", instr);
+    // Inlining of calls whose callee is known, by a size/benefit cost model
+    // recursive procedures and lambdas with nested lambdas stay calls
+    bool inline_calls(Procedure& proc, AnalysisManager& am);
 
-    // std::ofstream asm_file(file_prefix + "_" + suffix + ".s");
-    std::ofstream asm_file(file_prefix + ".s");
-    assembly::Assembler assembler(muncher, instr, asm_file);
-    assembler.assemble();
-}
+    // Tail calls: a procedure calling itself right before returning jumps back to the top
+    // with its parameters reassigned, other calls returning their result reuse the frame
+    bool tail_calls(Procedure& proc, AnalysisManager& am);
+
+    // Sparse Conditional Constant Propagation (Wegman, Zadeck) on SSA form
+    // folds arithmetic on constants and jumps on known values, unreachable blocks are removed
+    bool sccp(Procedure& proc, AnalysisManager& am);
+
+    // Global Value Numbering over the dominator tree in SSA form
+    // arithmetic already computed in a dominating block becomes a copy of its result
+    bool gvn(Procedure& proc, AnalysisManager& am);
+
+    // Loop Invariant Code Motion in SSA form
+    // pure computations whose operands come from outside a loop move to its preheader
+    bool licm(Procedure& proc, AnalysisManager& am);
 
-};
\ No newline at end of file
+    // Strength reduction of multiplications of induction variables by loop invariants
+    // into additions, with linear function test replacement of the exit test
+    bool reduce_strength(Procedure& proc, AnalysisManager& am);
+
+    // Aggressive Dead Code Elimination in SSA form: only instructions with side effects
+    // and what they depend on, through uses and control dependence, are kept
+    bool adce(Procedure& proc, AnalysisManager& am);
+
+    // Loop unrolling, full or with a remainder loop under a size budget, and compile time
+    // evaluation of the loops which only compute on constants
+    bool unroll(Procedure& proc, AnalysisManager& am);
+
+    // Block placement by static branch prediction (Ball, Larus heuristics): the likely
+    // successor of every block comes right after it, loops are rotated to test at the bottom
+    bool layout(Procedure& proc, AnalysisManager& am);
+};
+
+};
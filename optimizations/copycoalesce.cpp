@@ -0,0 +1,161 @@
+#include "cfg.h"
+#include "analysis.h"
+#include "../asm/asm.h"
+#include <algorithm>
+
+namespace opt {
+
+namespace {
+
+// registers the allocator hands out, a temporary with fewer neighbours than that
+// always gets one whatever its neighbours get
+const std::size_t K = assembly::caller_saved_registers.size() + assembly::callee_saved_registers.size();
+
+[[nodiscard]] bool is_move(const TAC* tac) {
+    return tac->get_opcode() == "copy" && tac->get_args().size() == 1;
+}
+
+}
+
+bool CFG::coalesce_temporaries(Procedure& proc, AnalysisManager& am) {
+    // temporaries only ever set from a const become immediates in the assembler,
+    // and the static link copy doesn't really write its result
+    std::set<MM::Temporary> candidates, excluded;
+    std::map<MM::Temporary, bool> only_const;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (!tac->has_result() || !is_ssa_var(proc, tac->get_result()))
+                continue;
+            auto result = tac->get_result();
+            if (tac->get_opcode() == "copy" && !is_move(tac))
+                excluded.insert(result);
+            auto [it, _] = only_const.try_emplace(result, true);
+            it->second &= tac->get_opcode() == "const";
+        }
+    }
+    for (auto &[temp, is_const] : only_const) {
+        if (!is_const && !excluded.count(temp))
+            candidates.insert(temp);
+    }
+
+    // copies between candidates, the ones in deeper loops are merged first
+    auto &info = am.loops(proc);
+    std::vector<std::pair<int, TAC*>> moves;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (is_move(tac) && candidates.count(tac->get_result()) && candidates.count(tac->get_arg()) &&
+                tac->get_result() != tac->get_arg())
+                moves.emplace_back(info.depth(block.get_label()), tac);
+        }
+    }
+    if (moves.empty())
+        return false;
+    std::stable_sort(moves.begin(), moves.end(), [](auto& a, auto& b) { return a.first > b.first; });
+
+    // Chaitin's interference: a definition interferes with everything live after it,
+    // except with the source of a copy, which holds the same value
+    auto &liveness = am.liveness(proc);
+    std::map<MM::Temporary, std::set<MM::Temporary>> adjacent;
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        Set def_block, use_block;
+        block.build_def_use(def_block, use_block);
+        block.build_liveness(liveness.live_in.at(label), liveness.live_out.at(label));
+
+        auto &instr = block.get_instr();
+        for (std::size_t i = 0; i < instr.size(); i++) {
+            auto tac = instr[i];
+            if (!tac->has_result() || !candidates.count(tac->get_result()))
+                continue;
+
+            auto result = tac->get_result();
+            auto copied = is_move(tac) ? tac->get_arg() : "";
+            for (auto &temp : block.get_live_out(i).get_set()) {
+                if (temp != result && temp != copied && candidates.count(temp)) {
+                    adjacent[result].insert(temp);
+                    adjacent[temp].insert(result);
+                }
+            }
+        }
+    }
+
+    // merging never makes the graph harder to color for the allocator: Briggs when the
+    // merged node has fewer than K neighbours of significant degree, George when every
+    // neighbour of one side already interferes with the other or has an insignificant degree
+    auto briggs = [&](const MM::Temporary& a, const MM::Temporary& b) {
+        std::set<MM::Temporary> neighbours = adjacent[a];
+        neighbours.insert(adjacent[b].begin(), adjacent[b].end());
+        std::size_t significant = 0;
+        for (auto &t : neighbours) {
+            auto degree = adjacent[t].size() - (adjacent[a].count(t) && adjacent[b].count(t));
+            significant += degree >= K;
+        }
+        return significant < K;
+    };
+    auto george = [&](const MM::Temporary& a, const MM::Temporary& b) {
+        return std::all_of(adjacent[a].begin(), adjacent[a].end(), [&](auto& t) {
+            return adjacent[b].count(t) || adjacent[t].size() < K;
+        });
+    };
+
+    std::map<MM::Temporary, MM::Temporary> parent;
+    auto find = [&](MM::Temporary temp) {
+        while (parent.count(temp))
+            temp = parent[temp];
+        return temp;
+    };
+
+    // merging lowers the degree of the common neighbours, which can let more copies through
+    bool merged = true;
+    int merges = 0;
+    while (merged) {
+        merged = false;
+        for (auto &[_, tac] : moves) {
+            auto a = find(tac->get_arg()), b = find(tac->get_result());
+            if (a == b || adjacent[a].count(b))
+                continue;
+            if (!briggs(a, b) && !george(a, b)) {
+                if (!george(b, a))
+                    continue;
+                std::swap(a, b);
+            }
+
+            // a goes into b
+            for (auto &t : adjacent[a]) {
+                adjacent[t].erase(a);
+                adjacent[t].insert(b);
+                adjacent[b].insert(t);
+            }
+            adjacent.erase(a);
+            parent[a] = b;
+            merged = true;
+            merges++;
+        }
+    }
+    if (!merges)
+        return false;
+
+    // every temporary is renamed to its class, the copies inside a class go away
+    for (auto &block : proc.blocks) {
+        auto &instr = block.get_instr();
+        for (auto tac : instr) {
+            for (auto &arg : tac->get_args()) {
+                if (parent.count(arg))
+                    arg = find(arg);
+            }
+            if (tac->has_result() && parent.count(tac->get_result()))
+                tac->set_result(find(tac->get_result()));
+        }
+
+        std::erase_if(instr, [](TAC* tac) {
+            return is_move(tac) && tac->get_arg() == tac->get_result();
+        });
+    }
+
+#ifdef DEBUG
+    std::cout << "Coalesced " << merges << " copies in " << proc.name << "\n";
+#endif
+    return true;
+}
+
+};
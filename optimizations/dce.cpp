@@ -0,0 +1,197 @@
+#include "cfg.h"
+#include "analysis.h"
+#include <unordered_map>
+#include <unordered_set>
+
+namespace opt {
+
+bool CFG::adce(Procedure& proc, AnalysisManager& am) {
+    using namespace sign;
+
+    // the root is needed by every dead branch looking for where to go
+    if (uce(proc))
+        am.invalidate(proc, NONE);
+
+    auto &pdom = am.post_dominators(proc);
+    auto &info = am.loops(proc);
+
+    std::unordered_map<MM::Temporary, TAC*> def;
+    std::unordered_map<TAC*, Label> block_of;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            block_of[tac] = block.get_label();
+            if (tac->has_result() && is_ssa_var(proc, tac->get_result()))
+                def[tac->get_result()] = tac;
+        }
+    }
+
+    std::unordered_set<TAC*> live;
+    std::set<Label> live_blocks;
+    std::vector<TAC*> worklist;
+
+    auto mark = [&](TAC* tac) {
+        if (live.insert(tac).second)
+            worklist.push_back(tac);
+    };
+
+    // the conditional jumps of a block are all needed or not at all
+    auto mark_jumps = [&](const Label& label) {
+        for (auto tac : get_block(label).get_instr()) {
+            if (taken_when.count(tac->get_opcode()))
+                mark(tac);
+        }
+    };
+
+    // a block runs only if the branches it's control dependent on go its way,
+    // those are the blocks on its post-dominance frontier
+    auto mark_block = [&](const Label& label) {
+        if (!live_blocks.insert(label).second)
+            return;
+        if (!pdom.contains(label)) {
+            // never reaches a ret
+            mark_jumps(label);
+            return;
+        }
+        for (auto &frontier_label : pdom.frontier(label)) {
+            if (!frontier_label.empty())
+                mark_jumps(frontier_label);
+        }
+    };
+
+    // side effects: calls and their arguments, returns, stores to captured temporaries
+    // and globals, the static link, and divisions which could trap
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            auto op = tac->get_opcode();
+            if (op == "label" || op == "jmp" || taken_when.count(op) || op == "phi")
+                continue;
+            bool effect = op == "call" || op == "param" || op == "ret" || (op == "copy" && tac->get_args().size() > 1) || may_trap(tac, def);
+            if (effect || (tac->has_result() && !is_ssa_var(proc, tac->get_result())))
+                mark(tac);
+        }
+    }
+    mark_block(proc.get_root());
+
+    // loops which might not end stay, with everything deciding when they end
+    for (auto &loop : info.loops) {
+        for (auto &[inside, _] : loop.exits) {
+            mark_block(inside);
+            mark_jumps(inside);
+        }
+    }
+
+    // the dead branches jump straight to their immediate post-dominator, every phi
+    // there which is still needed has to get the same value from all the ways in
+    std::map<Label, std::pair<Label, std::vector<Label>>> redirect;
+    auto plan_redirect = [&](const Label& label) {
+        if (!pdom.contains(label) || pdom.idom(label).empty())
+            return false;
+
+        auto target = pdom.idom(label);
+        std::vector<Label> entries;
+        std::set<Label> vis = {label};
+        std::vector<Label> stack = {label};
+        while (!stack.empty()) {
+            auto curr = stack.back();
+            stack.pop_back();
+            for (auto &[succ_label, _] : get_successors(curr)) {
+                if (succ_label == target)
+                    entries.push_back(curr);
+                else if (vis.insert(succ_label).second)
+                    stack.push_back(succ_label);
+            }
+        }
+
+        for (auto tac : get_block(target).get_instr()) {
+            if (tac->get_opcode() != "phi" || !live.count(tac))
+                continue;
+            auto &phi_args = tac->get_phi_args();
+            for (auto &entry : entries) {
+                if (phi_args.at(entry) != phi_args.at(entries[0]))
+                    return false;
+            }
+        }
+        redirect[label] = {target, entries};
+        return true;
+    };
+
+    while (true) {
+        while (!worklist.empty()) {
+            auto tac = worklist.back();
+            worklist.pop_back();
+            mark_block(block_of[tac]);
+
+            for (auto &arg : tac->get_args()) {
+                if (auto it = def.find(arg); it != def.end())
+                    mark(it->second);
+            }
+
+            // which way we came from decides the value of a phi
+            for (auto &[pred_label, arg] : tac->get_phi_args()) {
+                if (auto it = def.find(arg); it != def.end())
+                    mark(it->second);
+                mark_block(pred_label);
+                mark_jumps(pred_label);
+            }
+        }
+
+        // a dead branch which can't be skipped is needed after all
+        redirect.clear();
+        bool marked = false;
+        for (auto &block : proc.blocks) {
+            auto label = block.get_label();
+            bool dead_branch = false;
+            for (auto tac : block.get_instr())
+                dead_branch |= taken_when.count(tac->get_opcode()) && !live.count(tac);
+            if (dead_branch && !plan_redirect(label)) {
+                mark_jumps(label);
+                marked = true;
+            }
+        }
+        if (!marked)
+            break;
+    }
+
+    bool changed = !redirect.empty();
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        auto &instr = block.get_instr();
+        auto size = instr.size();
+        std::erase_if(instr, [&](TAC* tac) {
+            auto op = tac->get_opcode();
+            if (op == "label" || op == "jmp")
+                return false;
+            return !live.count(tac);
+        });
+        changed |= instr.size() != size;
+
+        auto it = redirect.find(label);
+        if (it == redirect.end())
+            continue;
+
+        auto &[target, entries] = it->second;
+        while (!instr.empty() && instr.back()->get_opcode() == "jmp")
+            instr.pop_back();
+        instr.push_back(pool.make("jmp", std::vector<std::string>{}, target));
+
+        for (auto tac : get_block(target).get_instr()) {
+            if (tac->get_opcode() == "phi" && live.count(tac))
+                tac->get_phi_args()[label] = tac->get_phi_args().at(entries[0]);
+        }
+
+#ifdef DEBUG
+        std::cout << "Branch of " << label << " isn't needed, jumping to " << target << "\n";
+#endif
+    }
+
+    if (!changed)
+        return false;
+
+    for (auto &block : proc.blocks)
+        relink(block);
+    uce(proc);
+    prune_phi_args(proc);
+    return true;
+}
+
+};
@@ -0,0 +1,131 @@
+#include "cfg.h"
+#include "analysis.h"
+#include <algorithm>
+#include <unordered_map>
+
+namespace opt {
+
+namespace {
+
+const std::set<std::string> numbered_ops = {
+    "const", "add", "sub", "mul", "div", "mod", "and", "or", "xor", "shl", "shr", "neg", "not",
+    "setz", "setnz", "setl", "setle", "setg", "setge"
+};
+
+const std::set<std::string> commutative_ops = {
+    "add", "mul", "and", "or", "xor", "setz", "setnz"
+};
+
+}
+
+bool CFG::gvn(Procedure& proc, AnalysisManager& am) {
+    auto &dom = am.dominators(proc);
+
+    // every SSA temporary gets the temporary which first computed its value,
+    // the definition of the leader dominates everything the temporary dominates
+    std::unordered_map<MM::Temporary, MM::Temporary> leader;
+    auto number = [&](const std::string& arg) -> std::optional<std::string> {
+        if (auto it = leader.find(arg); it != leader.end())
+            return it->second;
+        // parameters are only read, captured temporaries can change behind our back
+        if (arg.size() > 2 && arg[0] == '%' && arg[1] == 'p')
+            return arg;
+        return std::nullopt;
+    };
+
+    // expressions available in the blocks dominating the current one
+    std::unordered_map<std::string, MM::Temporary> available;
+    bool changed = false;
+
+    auto number_block = [&](const Label& label, std::vector<std::string>& pushed) {
+        for (auto tac : get_block(label).get_instr()) {
+            if (!tac->has_result() || !is_ssa_var(proc, tac->get_result()))
+                continue;
+
+            auto result = tac->get_result();
+            auto op = tac->get_opcode();
+            auto &args = tac->get_args();
+            leader[result] = result;
+
+            if (op == "copy" && args.size() == 1) {
+                if (auto arg = number(args[0]); arg && is_ssa_var(proc, *arg))
+                    leader[result] = *arg;
+                continue;
+            }
+            if (!numbered_ops.count(op))
+                continue;
+
+            std::vector<std::string> operands;
+            if (op == "const")
+                operands.push_back(args[0]);
+            else {
+                for (auto &arg : args) {
+                    auto arg_number = number(arg);
+                    if (!arg_number)
+                        break;
+                    operands.push_back(*arg_number);
+                }
+                if (operands.size() != args.size())
+                    continue;
+                if (commutative_ops.count(op))
+                    std::sort(operands.begin(), operands.end());
+            }
+
+            auto key = op;
+            for (auto &operand : operands)
+                key += " " + operand;
+
+            auto [it, inserted] = available.insert({key, result});
+            if (inserted) {
+                pushed.push_back(key);
+                continue;
+            }
+
+            // a constant costs no more than the copy, and the assembler only
+            // strength reduces by temporaries set from a const
+            if (op == "const") {
+                leader[result] = it->second;
+                continue;
+            }
+
+            // computed on every path to here already, a div or mod that didn't trap
+            // there won't trap here either
+#ifdef DEBUG
+            std::cout << "Value of " << result << " is already in " << it->second << "\n";
+#endif
+            *tac = TAC("copy", std::vector<std::string>{it->second}, result);
+            leader[result] = it->second;
+            changed = true;
+        }
+    };
+
+    // explicit stack, the dominator tree is as deep as the longest chain of blocks
+    struct Frame {
+        std::vector<Label> children;
+        std::size_t child_ind;
+        std::vector<std::string> pushed;
+    };
+
+    auto root = proc.get_root();
+    std::vector<Frame> stack;
+    stack.push_back({dom.children(root), 0, {}});
+    number_block(root, stack.back().pushed);
+
+    while (!stack.empty()) {
+        auto &frame = stack.back();
+        if (frame.child_ind == frame.children.size()) {
+            for (auto &key : frame.pushed)
+                available.erase(key);
+            stack.pop_back();
+            continue;
+        }
+
+        auto child_label = frame.children[frame.child_ind++];
+        stack.push_back({dom.children(child_label), 0, {}});
+        number_block(child_label, stack.back().pushed);
+    }
+
+    return changed;
+}
+
+};
@@ -0,0 +1,325 @@
+#include "cfg.h"
+#include "analysis.h"
+#include <algorithm>
+#include <unordered_map>
+
+namespace opt {
+
+namespace {
+
+// instructions a call costs on top of its parameters: the call itself, the prologue,
+// the epilogue and moving the result around
+constexpr std::size_t CALL_COST = 8;
+
+// a callee this much bigger than the call it replaces is still inlined
+constexpr std::size_t INLINE_SIZE = 30;
+
+// a constant argument usually lets the inlined body fold
+constexpr std::size_t CONST_ARG_BONUS = 6;
+
+// the body of a procedure called from a single place moves there up to this size
+constexpr std::size_t SINGLE_SITE_SIZE = 400;
+
+// no procedure grows past this size by inlining
+constexpr std::size_t MAX_PROC_SIZE = 4000;
+
+[[nodiscard]] bool is_temp(const std::string& arg) {
+    return arg.size() > 1 && arg[0] == '%' && std::isdigit(arg[1]);
+}
+
+// temporaries of func are reached from inside without walking the static link past it
+[[nodiscard]] bool encloses(const std::string& func, const std::string& inner) {
+    return inner == func || inner.starts_with(func + "::");
+}
+
+}
+
+// where the calls of the program go, and what the inliner needs to know about every
+// procedure before copying its body
+struct CallSummaries {
+    struct Summary {
+        // instructions, without labels and jumps
+        std::size_t size = 0;
+        std::size_t params = 0;
+        // nested lambdas get its frame as their static link, which is gone once it's inlined
+        // once they are all inlined themselves, nothing reads it anymore
+        std::set<MM::Temporary> frames;
+        bool has_frame_users = false;
+        // functions whose temporaries it reaches through the static link
+        std::set<std::string> owners;
+        std::set<std::string> callees;
+    };
+
+    // definitions over the whole program, code pointers are only followed through
+    // temporaries with a single definition
+    std::unordered_map<MM::Temporary, std::pair<int, TAC*>> defs;
+    std::map<std::string, Summary> summary;
+    std::map<std::string, std::size_t> proc_ind;
+    std::map<std::string, int> references, call_sites;
+    std::map<std::string, bool> recursive;
+
+    void add_def(TAC* tac) {
+        if (!tac->has_result())
+            return;
+        auto &[count, def] = defs[tac->get_result()];
+        count++;
+        def = tac;
+    }
+
+    // the procedure a call always goes to, if we know it
+    [[nodiscard]] std::optional<std::string> resolve(MM::Temporary temp) const {
+        for (int steps = 0; steps < 16; steps++) {
+            auto it = defs.find(temp);
+            if (it == defs.end() || it->second.first != 1)
+                return std::nullopt;
+            auto tac = it->second.second;
+            if (tac->get_opcode() == "const")
+                return summary.count(tac->get_arg()) ? std::optional(tac->get_arg()) : std::nullopt;
+            if (tac->get_opcode() != "copy" || tac->get_args().size() != 1)
+                return std::nullopt;
+            temp = tac->get_arg();
+        }
+        return std::nullopt;
+    }
+
+    [[nodiscard]] bool is_const(const MM::Temporary& temp) const {
+        auto it = defs.find(temp);
+        if (it == defs.end() || it->second.first != 1 || it->second.second->get_opcode() != "const")
+            return false;
+        auto &value = it->second.second->get_arg();
+        return std::isdigit(value[0]) || value[0] == '-';
+    }
+
+    // recursion guard: nothing which can end up calling itself is inlined
+    [[nodiscard]] bool is_recursive(const std::string& name) {
+        if (auto it = recursive.find(name); it != recursive.end())
+            return it->second;
+        std::set<std::string> vis;
+        std::vector<std::string> stack(summary[name].callees.begin(), summary[name].callees.end());
+        bool found = false;
+        while (!stack.empty() && !found) {
+            auto curr = stack.back();
+            stack.pop_back();
+            found = curr == name;
+            if (!vis.insert(curr).second)
+                continue;
+            for (auto &callee : summary[curr].callees)
+                stack.push_back(callee);
+        }
+        return recursive[name] = found;
+    }
+};
+
+[[nodiscard]] std::optional<std::string> CFG::known_callee(const MM::Temporary& code_pointer) const {
+    if (!call_summaries)
+        return std::nullopt;
+    return call_summaries->resolve(code_pointer);
+}
+
+void CFG::summarize_calls() {
+    auto &func_of_temp = muncher.get_func_of_temps();
+    call_summaries = std::make_shared<CallSummaries>();
+    auto &info = *call_summaries;
+
+    std::unordered_map<MM::Temporary, std::string> frame_of;
+    for (std::size_t i = 0; i < procs.size(); i++) {
+        auto &p = procs[i];
+        auto &s = info.summary[p.name];
+        info.proc_ind[p.name] = i;
+        for (auto &block : p.blocks) {
+            for (auto tac : block.get_instr()) {
+                auto op = tac->get_opcode();
+                if (op != "label" && op != "jmp")
+                    s.size++;
+                if (op == "get_fp") {
+                    s.frames.insert(tac->get_result());
+                    frame_of[tac->get_result()] = p.name;
+                }
+                if (op == "const")
+                    info.references[tac->get_arg()]++;
+                info.add_def(tac);
+
+                for (auto &arg : tac->get_args()) {
+                    // every parameter, the static link included, is read once at the entry
+                    if (arg.size() > 2 && arg[0] == '%' && arg[1] == 'p')
+                        s.params = std::max(s.params, std::stoul(arg.substr(2)) + 1);
+                    if (is_temp(arg) && func_of_temp[arg] != p.name)
+                        s.owners.insert(func_of_temp[arg]);
+                }
+            }
+        }
+    }
+
+    for (auto &p : procs) {
+        for (auto &block : p.blocks) {
+            for (auto tac : block.get_instr()) {
+                for (auto &arg : tac->get_args()) {
+                    if (auto it = frame_of.find(arg); it != frame_of.end())
+                        info.summary[it->second].has_frame_users = true;
+                }
+                if (tac->get_opcode() != "call")
+                    continue;
+                if (auto callee = info.resolve(tac->get_args()[0])) {
+                    info.summary[p.name].callees.insert(*callee);
+                    info.call_sites[*callee]++;
+                }
+            }
+        }
+    }
+}
+
+bool CFG::inline_calls(Procedure& proc, AnalysisManager&) {
+    auto &func_of_temp = muncher.get_func_of_temps();
+    if (!call_summaries)
+        summarize_calls();
+    auto &info = *call_summaries;
+
+    // the call sites, the last ones are inlined first so splitting a block
+    // doesn't move the ones left
+    struct Site {
+        std::size_t block_ind, call_pos, first_param;
+        std::string callee;
+    };
+    std::vector<Site> sites;
+    auto &caller = info.summary[proc.name];
+
+    for (std::size_t b = 0; b < proc.blocks.size(); b++) {
+        auto &instr = proc.blocks[b].get_instr();
+        for (std::size_t pos = 0; pos < instr.size(); pos++) {
+            auto tac = instr[pos];
+            if (tac->get_opcode() != "call")
+                continue;
+            auto callee = info.resolve(tac->get_args()[0]);
+            if (!callee || *callee == proc.name || *callee == "main")
+                continue;
+
+            auto &s = info.summary[*callee];
+            if (s.has_frame_users || info.is_recursive(*callee))
+                continue;
+
+            // captured temporaries are found by walking the static link of the caller instead
+            bool reachable = true;
+            for (auto &owner : s.owners)
+                reachable = reachable && encloses(owner, proc.name);
+            if (!reachable)
+                continue;
+
+            // the parameters are set right before the call, the static link last
+            auto first = pos;
+            while (first > 0 && instr[first - 1]->get_opcode() == "param")
+                first--;
+            if (pos - first != s.params)
+                continue;
+
+            std::size_t benefit = CALL_COST + 2 * s.params;
+            for (auto i = first; i < pos; i++)
+                benefit += info.is_const(instr[i]->get_arg()) ? CONST_ARG_BONUS : 0;
+
+            bool single_site = info.call_sites[*callee] == 1 && info.references[*callee] == 1;
+            bool worth = s.size <= INLINE_SIZE + benefit || (single_site && s.size <= SINGLE_SITE_SIZE);
+            if (!worth || caller.size + s.size > MAX_PROC_SIZE)
+                continue;
+
+            caller.size += s.size;
+            sites.push_back({b, pos, first, *callee});
+        }
+    }
+
+    if (sites.empty())
+        return false;
+
+    for (auto it = sites.rbegin(); it != sites.rend(); it++) {
+        auto &callee = procs[info.proc_ind.at(it->callee)];
+        auto &s = info.summary[callee.name];
+        auto instr = proc.blocks[it->block_ind].get_instr();
+        auto call = instr[it->call_pos];
+
+        // labels and temporaries of the callee get fresh names in the caller, the
+        // parameters become temporaries holding the arguments
+        std::unordered_map<std::string, std::string> rename;
+        auto renamed = [&](const std::string& arg) -> std::string {
+            if (arg.size() < 2 || arg[0] != '%')
+                return arg;
+            if (auto r = rename.find(arg); r != rename.end())
+                return r->second;
+            if (arg[1] == '.')
+                return rename[arg] = muncher.new_label();
+            if (auto owner = func_of_temp.find(arg); std::isdigit(arg[1]) && owner != func_of_temp.end() && owner->second == callee.name)
+                return rename[arg] = muncher.new_temp(proc.name);
+            return arg;
+        };
+
+        std::vector<TAC*> pre(instr.begin(), instr.begin() + it->first_param);
+        for (auto i = it->first_param; i < it->call_pos; i++) {
+            auto temp = muncher.new_temp(proc.name);
+            rename["%p" + std::to_string(std::stoi(instr[i]->get_result()) - 1)] = temp;
+            pre.push_back(pool.make("copy", std::vector<std::string>{instr[i]->get_arg()}, temp));
+            info.add_def(pre.back());
+        }
+
+        // every ret of the callee jumps to the rest of the caller's block
+        auto cont = muncher.new_label();
+        std::vector<Block> inlined;
+        for (auto &block : callee.blocks) {
+            std::vector<TAC*> body;
+            for (auto tac : block.get_instr()) {
+                auto op = tac->get_opcode();
+                // the caller keeps its own static link
+                if (op == "proc" || (op == "copy" && tac->get_args().size() > 1))
+                    continue;
+                if (op == "ret") {
+                    if (call->has_result() && !tac->get_args().empty()) {
+                        body.push_back(pool.make("copy", std::vector<std::string>{renamed(tac->get_arg())}, call->get_result()));
+                        info.add_def(body.back());
+                    }
+                    body.push_back(pool.make("jmp", std::vector<std::string>{}, cont));
+                    break;
+                }
+
+                auto copy = pool.make(*tac);
+                for (auto &arg : copy->get_args())
+                    arg = renamed(arg);
+                if (copy->has_result())
+                    copy->set_result(renamed(copy->get_result()));
+                body.push_back(copy);
+
+                info.add_def(copy);
+                if (op == "const")
+                    info.references[copy->get_arg()]++;
+            }
+            inlined.push_back(Block(body, false));
+        }
+        pre.push_back(pool.make("jmp", std::vector<std::string>{}, inlined[0].get_label()));
+
+        std::vector<TAC*> post = {pool.make("label", std::vector<std::string>{cont})};
+        post.insert(post.end(), instr.begin() + it->call_pos + 1, instr.end());
+        inlined.push_back(Block(post, false));
+
+        proc.blocks[it->block_ind].set_instr(pre);
+        proc.blocks.insert(proc.blocks.begin() + it->block_ind + 1, std::make_move_iterator(inlined.begin()), std::make_move_iterator(inlined.end()));
+
+        // the call is gone, what the callee reaches and calls is reached from here now
+        if (call->has_result())
+            info.defs[call->get_result()].first--;
+        info.call_sites[callee.name]--;
+        for (auto &owner : s.owners) {
+            if (owner != proc.name)
+                caller.owners.insert(owner);
+        }
+        for (auto &next : s.callees) {
+            caller.callees.insert(next);
+            info.call_sites[next]++;
+        }
+
+#ifdef DEBUG
+        std::cout << "Inlined " << callee.name << " into " << proc.name << "\n";
+#endif
+    }
+
+    reindex(&proc - procs.data());
+    for (auto &block : proc.blocks)
+        relink(block);
+    return true;
+}
+
+};
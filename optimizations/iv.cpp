@@ -0,0 +1,283 @@
+#include "cfg.h"
+#include "analysis.h"
+#include "../asm/asm.h"
+#include <unordered_map>
+#include <unordered_set>
+
+namespace opt {
+
+namespace {
+
+// i = phi(preheader: init, latch: i + step) in the header of a loop
+struct BasicIV {
+    TAC* phi;
+    MM::Temporary var, step;
+    bool increasing;
+};
+
+// i * factor for a basic induction variable i, kept in a new phi which
+// grows by step * factor every iteration
+struct Reduction {
+    std::size_t loop;
+    BasicIV iv;
+    MM::Temporary factor;
+    std::vector<TAC*> muls;
+};
+
+// no product of anything the induction variable reaches with the factor
+// gets close enough to overflow for the difference of two of them to wrap
+constexpr long long SAFE_PRODUCT = 1LL << 62;
+
+[[nodiscard]] bool safe_product(long long a, long long b) {
+    long long product;
+    return !__builtin_mul_overflow(a, b, &product) && product < SAFE_PRODUCT && product > -SAFE_PRODUCT;
+}
+
+}
+
+bool CFG::reduce_strength(Procedure& proc, AnalysisManager& am) {
+    auto &info = am.loops(proc);
+    if (info.loops.empty())
+        return false;
+
+    std::unordered_map<MM::Temporary, TAC*> def;
+    std::unordered_map<MM::Temporary, Label> def_block;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (tac->has_result() && is_ssa_var(proc, tac->get_result())) {
+                def[tac->get_result()] = tac;
+                def_block[tac->get_result()] = block.get_label();
+            }
+        }
+    }
+
+    // the temporary a chain of copies starts from, which ends at the copy of a
+    // parameter: the factors and steps found through it are read in new places, and
+    // params only keeps the register of a parameter until it has to copy it
+    auto root = [&](MM::Temporary temp) {
+        for (auto it = def.find(temp); it != def.end() && it->second->get_opcode() == "copy" && it->second->get_args().size() == 1; it = def.find(temp)) {
+            auto &source = it->second->get_arg();
+            if (source.size() > 2 && source[0] == '%' && source[1] == 'p')
+                break;
+            temp = source;
+        }
+        return temp;
+    };
+
+    auto constant = [&](const MM::Temporary& temp) -> std::optional<long long> {
+        auto it = def.find(root(temp));
+        if (it == def.end() || it->second->get_opcode() != "const")
+            return std::nullopt;
+        auto &value = it->second->get_arg();
+        if (!std::isdigit(value[0]) && value[0] != '-')
+            return std::nullopt;
+        return std::stoll(value);
+    };
+
+    std::vector<Reduction> reductions;
+    std::unordered_set<TAC*> claimed;
+    std::set<Label> headers;
+
+    for (std::size_t i = 0; i < info.loops.size(); i++) {
+        auto &loop = info.loops[i];
+        if (get_block(loop.header).is_starting() || loop.latches.size() != 1)
+            continue;
+        auto &latch = loop.latches[0];
+
+        // parameters are only read
+        auto invariant = [&](const MM::Temporary& temp) {
+            if (temp.size() > 2 && temp[0] == '%' && temp[1] == 'p')
+                return true;
+            auto it = def_block.find(temp);
+            return it != def_block.end() && !loop.body.count(it->second);
+        };
+
+        // basic induction variables
+        std::map<MM::Temporary, BasicIV> ivs;
+        auto &header = get_block(loop.header);
+        auto &header_instr = header.get_instr();
+        for (std::size_t pos = 1; pos < first_non_phi(header); pos++) {
+            auto phi = header_instr[pos];
+            if (phi->get_opcode() != "phi" || !phi->get_phi_args().count(latch) || !is_ssa_var(proc, phi->get_result()))
+                continue;
+
+            auto var = phi->get_result();
+            auto it = def.find(root(phi->get_phi_args().at(latch)));
+            if (it == def.end())
+                continue;
+
+            auto update = it->second;
+            auto op = update->get_opcode();
+            if ((op != "add" && op != "sub") || update->get_args().size() != 2)
+                continue;
+
+            auto a = root(update->get_args()[0]), b = root(update->get_args()[1]);
+            if (a == var && invariant(b))
+                ivs[var] = {phi, var, b, op == "add"};
+            else if (op == "add" && b == var && invariant(a))
+                ivs[var] = {phi, var, a, true};
+        }
+        if (ivs.empty())
+            continue;
+
+        // derived induction variables i * factor
+        std::map<std::pair<MM::Temporary, MM::Temporary>, std::size_t> reduction_of;
+        for (auto &label : loop.body) {
+            for (auto tac : get_block(label).get_instr()) {
+                if (tac->get_opcode() != "mul" || claimed.count(tac) || !is_ssa_var(proc, tac->get_result()))
+                    continue;
+
+                auto a = root(tac->get_args()[0]), b = root(tac->get_args()[1]);
+                if (!ivs.count(a) || !invariant(b))
+                    std::swap(a, b);
+                if (!ivs.count(a) || !invariant(b))
+                    continue;
+
+                auto [it, inserted] = reduction_of.insert({{a, b}, reductions.size()});
+                if (inserted)
+                    reductions.push_back({i, ivs[a], b, {}});
+                reductions[it->second].muls.push_back(tac);
+                claimed.insert(tac);
+                headers.insert(loop.header);
+            }
+        }
+    }
+
+    if (reductions.empty())
+        return false;
+
+    // the loops are gone once the preheaders are in
+    struct Target {
+        Label header, latch;
+        std::optional<Label> preheader;
+        std::optional<TripCount> trip_count;
+    };
+    std::vector<Target> targets;
+    for (auto &loop : info.loops)
+        targets.push_back({loop.header, loop.latches[0], loop.preheader, loop.trip_count});
+
+    auto made = make_preheaders(proc, am, headers);
+
+    // right before the jumps at the end of a block
+    auto insert_at_end = [&](const Label& label, const std::vector<TAC*>& new_instr) {
+        auto &instr = get_block(label).get_instr();
+        auto pos = instr.size();
+        while (pos > 0 && (instr[pos - 1]->get_opcode() == "jmp" || assembly::jumps.count(instr[pos - 1]->get_opcode())))
+            pos--;
+        instr.insert(instr.begin() + pos, new_instr.begin(), new_instr.end());
+    };
+
+    std::vector<BasicIV> replaced;
+    for (auto &reduction : reductions) {
+        auto &target = targets[reduction.loop];
+        auto preheader = target.preheader.has_value() ? *target.preheader : made.at(target.header);
+        auto &iv = reduction.iv;
+
+        // t = init * factor before the loop, t = t + step * factor at the end of every iteration
+        auto init = iv.phi->get_phi_args().at(preheader);
+        auto start = muncher.new_temp(proc.name), increment = muncher.new_temp(proc.name);
+        auto current = muncher.new_temp(proc.name), next = muncher.new_temp(proc.name);
+        insert_at_end(preheader, {
+            pool.make("mul", std::vector<std::string>{init, reduction.factor}, start),
+            pool.make("mul", std::vector<std::string>{iv.step, reduction.factor}, increment)
+        });
+
+        std::map<Label, std::string> phi_args = {{preheader, start}, {target.latch, next}};
+        auto &header = get_block(target.header);
+        header.get_instr().insert(header.get_instr().begin() + first_non_phi(header), pool.make("phi", phi_args, current));
+
+        insert_at_end(target.latch, {
+            pool.make(iv.increasing ? "add" : "sub", std::vector<std::string>{current, increment}, next)
+        });
+
+        for (auto tac : reduction.muls)
+            *tac = TAC("copy", std::vector<std::string>{current}, tac->get_result());
+
+#ifdef DEBUG
+        std::cout << "Reduced " << reduction.muls.size() << " multiplications of " << iv.var << " by " << reduction.factor << "\n";
+#endif
+
+        // linear function test replacement: the exit test of the header compares
+        // t against bound * factor instead, when the factor is a positive constant
+        // and none of the products can overflow
+        auto factor = constant(reduction.factor);
+        auto &trip = target.trip_count;
+        if (!factor.has_value() || factor.value() <= 0 || !trip.has_value() || trip->var != iv.var || !trip->count.has_value())
+            continue;
+
+        long long last;
+        if (__builtin_mul_overflow(trip->count.value(), trip->step, &last) || __builtin_add_overflow(last, trip->init.value(), &last))
+            continue;
+        if (!safe_product(trip->init.value(), *factor) || !safe_product(last, *factor) || !safe_product(trip->bound, *factor))
+            continue;
+
+        auto &instr = header.get_instr();
+        if (instr.size() < 3 || !sign::taken_when.count(instr[instr.size() - 2]->get_opcode()))
+            continue;
+
+        // the jump compares the variable with the bound, or tests their difference
+        auto cond = instr[instr.size() - 2];
+        auto compare = cond;
+        if (cond->get_args().size() == 1) {
+            auto it = def.find(cond->get_arg());
+            if (it == def.end() || it->second->get_opcode() != "sub" || def_block[it->first] != target.header)
+                continue;
+            compare = it->second;
+        }
+
+        auto &args = compare->get_args();
+        auto var_ind = root(args[0]) == iv.var ? 0 : root(args[1]) == iv.var ? 1 : -1;
+        if (var_ind == -1 || constant(args[1 - var_ind]) != trip->bound)
+            continue;
+
+        auto bound = muncher.new_temp(proc.name);
+        insert_at_end(preheader, {
+            pool.make("const", std::vector<std::string>{std::to_string(trip->bound * factor.value())}, bound)
+        });
+        args[var_ind] = current;
+        args[1 - var_ind] = bound;
+        replaced.push_back(iv);
+    }
+
+    // the induction variables whose test was replaced are often only used to update themselves
+    std::unordered_map<MM::Temporary, std::vector<TAC*>> users;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            for (auto &arg : tac->get_args())
+                users[arg].push_back(tac);
+            for (auto &[_, arg] : tac->get_phi_args())
+                users[arg].push_back(tac);
+        }
+    }
+
+    std::unordered_set<TAC*> removed;
+    for (auto &iv : replaced) {
+        // everything computed from the variable by copies, additions and subtractions
+        std::unordered_set<TAC*> family = {iv.phi};
+        std::vector<MM::Temporary> stack = {iv.var};
+        bool dead = true;
+        while (!stack.empty() && dead) {
+            auto temp = stack.back();
+            stack.pop_back();
+            for (auto user : users[temp]) {
+                auto op = user->get_opcode();
+                bool pure = op == "phi" || (op == "copy" && user->get_args().size() == 1) || op == "add" || op == "sub";
+                if (!pure || !user->has_result() || !is_ssa_var(proc, user->get_result())) {
+                    dead = false;
+                    break;
+                }
+                if (family.insert(user).second)
+                    stack.push_back(user->get_result());
+            }
+        }
+        if (dead)
+            removed.insert(family.begin(), family.end());
+    }
+
+    for (auto &block : proc.blocks)
+        std::erase_if(block.get_instr(), [&](TAC* tac) { return removed.count(tac); });
+
+    return true;
+}
+
+};
@@ -0,0 +1,220 @@
+#include "cfg.h"
+#include "analysis.h"
+#include "../asm/asm.h"
+#include <algorithm>
+#include <unordered_map>
+
+namespace opt {
+
+namespace {
+
+[[nodiscard]] Label target(const TAC* jump) {
+    return jump->has_result() ? jump->get_result() : jump->get_arg();
+}
+
+[[nodiscard]] bool returns(Block& block) {
+    return block.get_instr().back()->get_opcode() == "ret";
+}
+
+// the conditional jump right before the final jmp of a block, if there is one
+[[nodiscard]] TAC* branch_of(Block& block) {
+    auto &instr = block.get_instr();
+    if (instr.size() < 2 || instr.back()->get_opcode() != "jmp" || !sign::taken_when.count(instr[instr.size() - 2]->get_opcode()))
+        return nullptr;
+    return instr[instr.size() - 2];
+}
+
+// Ball, Larus: "Branch Prediction for Free", the first heuristic telling the two
+// successors apart decides which one should come right after the block
+[[nodiscard]] std::optional<Label> predict(CFG& cfg, const LoopInfo& info, Block& block) {
+    auto last = block.get_instr().back();
+    if (last->get_opcode() != "jmp")
+        return std::nullopt;
+
+    auto branch = branch_of(block);
+    auto not_taken = target(last);
+    if (!branch || target(branch) == not_taken)
+        return not_taken;
+    auto taken = target(branch);
+
+    auto decide = [&](auto&& likely) -> std::optional<Label> {
+        bool t = likely(taken), f = likely(not_taken);
+        if (t == f)
+            return std::nullopt;
+        return t ? taken : not_taken;
+    };
+
+    auto label = block.get_label();
+    auto inner = info.innermost.find(label);
+    const Loop* loop = inner == info.innermost.end() ? nullptr : &info.loops[inner->second];
+
+    std::vector<std::function<bool(const Label&)>> heuristics = {
+        // loop branch: back edges are taken
+        [&](const Label& succ) {
+            for (auto l = loop; l; l = l->parent < 0 ? nullptr : &info.loops[l->parent])
+                if (l->header == succ)
+                    return true;
+            return false;
+        },
+        // loop exit: staying in the loop is likely
+        [&](const Label& succ) { return loop && loop->body.count(succ) > 0; },
+        // loop header: entering a loop is likely
+        [&](const Label& succ) { return info.depth(succ) > info.depth(label); },
+        // return: a block leaving the procedure is unlikely
+        [&](const Label& succ) { return !returns(cfg.get_block(succ)); },
+        // opcode: values are rarely equal, and rarely negative
+        [&](const Label& succ) {
+            auto op = branch->get_opcode();
+            bool single = branch->get_args().size() == 1;
+            if (succ == taken)
+                return op == "jnz" || (single && (op == "jg" || op == "jge"));
+            return op == "jz" || (single && (op == "jl" || op == "jle"));
+        },
+    };
+
+    for (auto &likely : heuristics) {
+        if (auto succ = decide(likely))
+            return succ;
+    }
+    return taken;
+}
+
+}
+
+bool CFG::layout(Procedure& proc, AnalysisManager& am) {
+    auto &blocks = proc.blocks;
+    if (blocks.size() < 3)
+        return false;
+    auto &info = am.loops(proc);
+
+    // chains of blocks falling into each other, each one grows from its seed through
+    // the likely successors, then through any successor which isn't placed yet
+    std::set<Label> placed;
+    std::vector<std::vector<Label>> chains;
+    auto grow = [&](Label seed) {
+        auto &chain = chains.emplace_back();
+        std::optional<Label> next = seed;
+        while (next && !placed.count(*next)) {
+            chain.push_back(*next);
+            placed.insert(*next);
+
+            auto &block = get_block(*next);
+            next = predict(*this, info, block);
+            if (!next || placed.count(*next)) {
+                next = std::nullopt;
+                for (auto &[succ, _] : get_successors(block.get_label())) {
+                    if (!placed.count(succ)) {
+                        next = succ;
+                        break;
+                    }
+                }
+            }
+        }
+    };
+
+    // the entry comes first, then the blocks left in the innermost loop of the end of
+    // the last chain, so every loop stays in one piece, unreachable blocks go last
+    auto &rpo = am.rpo(proc);
+
+    // the blocks of every loop in reverse postorder, placed blocks stay placed so
+    // the search for the next seed of a loop goes on where it stopped
+    std::vector<std::vector<Label>> loop_rpo(info.loops.size());
+    for (auto &label : rpo) {
+        auto inner = info.innermost.find(label);
+        for (int l = inner == info.innermost.end() ? -1 : inner->second; l >= 0; l = info.loops[l].parent)
+            loop_rpo[l].push_back(label);
+    }
+    std::vector<std::size_t> loop_cursor(info.loops.size());
+    std::size_t rpo_cursor = 0;
+    auto first_unplaced = [&](const std::vector<Label>& labels, std::size_t& cursor) -> std::optional<Label> {
+        while (cursor < labels.size() && placed.count(labels[cursor]))
+            cursor++;
+        return cursor < labels.size() ? std::optional<Label>(labels[cursor]) : std::nullopt;
+    };
+
+    grow(rpo[0]);
+    for (;;) {
+        std::optional<Label> seed;
+        auto inner = info.innermost.find(chains.back().back());
+        for (int l = inner == info.innermost.end() ? -1 : inner->second; l >= 0 && !seed; l = info.loops[l].parent)
+            seed = first_unplaced(loop_rpo[l], loop_cursor[l]);
+        if (!seed)
+            seed = first_unplaced(rpo, rpo_cursor);
+        if (!seed)
+            break;
+        grow(*seed);
+    }
+    for (auto &block : blocks) {
+        if (!placed.count(block.get_label()))
+            grow(block.get_label());
+    }
+
+    // the muncher finds the end of a procedure by its last ret
+    auto last_return = std::find_if(chains.rbegin(), chains.rend() - 1, [&](auto& chain) {
+        return returns(get_block(chain.back()));
+    });
+    if (last_return != chains.rend() - 1)
+        std::rotate(last_return.base() - 1, last_return.base(), chains.end());
+
+    std::vector<Label> order;
+    for (auto &chain : chains)
+        order.insert(order.end(), chain.begin(), chain.end());
+    std::unordered_map<Label, std::size_t> position;
+    for (std::size_t i = 0; i < order.size(); i++)
+        position[order[i]] = i;
+
+    // a loop laid out with its header first has the header moved after a latch
+    // jumping back to it: the latch falls into the exit test, which jumps back to
+    // the body, one taken jump per iteration instead of two
+    for (auto loop = info.loops.rbegin(); loop != info.loops.rend(); loop++) {
+        auto p = position.at(loop->header);
+        std::size_t q = p + loop->body.size() - 1;
+        if (p == 0 || q >= order.size())
+            continue;
+        if (!std::all_of(order.begin() + p, order.begin() + q + 1, [&](auto& label) { return loop->body.count(label) > 0; }))
+            continue;
+
+        auto &header = get_block(loop->header);
+        auto branch = branch_of(header);
+        if (!branch)
+            continue;
+        auto taken = target(branch), not_taken = target(header.get_instr().back());
+        if (!(taken == order[p + 1] && !loop->body.count(not_taken)) && !(not_taken == order[p + 1] && !loop->body.count(taken)))
+            continue;
+
+        // the last latch which doesn't fall into anything, the header can't end the procedure
+        for (auto r = q; r > p && r + 1 < order.size(); r--) {
+            auto &latch = get_block(order[r]);
+            auto last = latch.get_instr().back();
+            if (!branch_of(latch) && last->get_opcode() == "jmp" && target(last) == loop->header) {
+                std::rotate(order.begin() + p, order.begin() + p + 1, order.begin() + r + 1);
+                for (auto i = p; i <= r; i++)
+                    position[order[i]] = i;
+                break;
+            }
+        }
+    }
+
+    bool changed = false;
+    for (std::size_t i = 0; i < blocks.size(); i++)
+        changed |= blocks[i].get_label() != order[i];
+    if (!changed)
+        return false;
+
+    std::vector<Block> laid_out;
+    laid_out.reserve(blocks.size());
+    for (auto &label : order)
+        laid_out.push_back(std::move(get_block(label)));
+    blocks = std::move(laid_out);
+    reindex(&proc - procs.data());
+
+#ifdef DEBUG
+    std::cout << "Laid out " << proc.name << ":";
+    for (auto &label : order)
+        std::cout << " " << label;
+    std::cout << "\n";
+#endif
+    return true;
+}
+
+};
@@ -0,0 +1,135 @@
+#include "cfg.h"
+#include "analysis.h"
+#include "../asm/asm.h"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace opt {
+
+namespace {
+
+// computations which can't fail or have side effects, so running them
+// once before the loop even if the loop doesn't run is fine
+const std::set<std::string> pure_ops = {
+    "const", "add", "sub", "mul", "and", "or", "xor", "shl", "shr", "neg", "not",
+    "setz", "setnz", "setl", "setle", "setg", "setge"
+};
+
+}
+
+bool CFG::licm(Procedure& proc, AnalysisManager& am) {
+    auto &info = am.loops(proc);
+    if (info.loops.empty())
+        return false;
+
+    // block and instruction defining every SSA temporary
+    std::unordered_map<MM::Temporary, Label> def_block;
+    std::unordered_map<MM::Temporary, TAC*> def;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (tac->has_result() && is_ssa_var(proc, tac->get_result())) {
+                def_block[tac->get_result()] = block.get_label();
+                def[tac->get_result()] = tac;
+            }
+        }
+    }
+
+    auto hoistable = [&](TAC* tac) {
+        if (!tac->has_result() || !is_ssa_var(proc, tac->get_result()))
+            return false;
+        auto op = tac->get_opcode();
+        if (op == "copy")
+            return tac->get_args().size() == 1;
+        // a division which can trap can't run before we know the loop runs
+        if (op == "div" || op == "mod")
+            return !may_trap(tac, def);
+        return pure_ops.count(op) > 0;
+    };
+
+    // every instruction moves out of the outermost loop it doesn't depend on,
+    // the enclosing loops come first
+    std::unordered_map<Label, std::size_t> rpo_index;
+    for (auto &label : am.rpo(proc))
+        rpo_index[label] = rpo_index.size();
+
+    std::unordered_set<TAC*> claimed;
+    std::vector<std::vector<TAC*>> hoisted(info.loops.size());
+    std::set<Label> headers;
+
+    for (std::size_t i = 0; i < info.loops.size(); i++) {
+        auto &loop = info.loops[i];
+        if (get_block(loop.header).is_starting())
+            continue;
+
+        std::unordered_set<MM::Temporary> invariant;
+        auto is_invariant = [&](const std::string& arg) {
+            // parameters are only read
+            if (arg.size() > 2 && arg[0] == '%' && arg[1] == 'p')
+                return true;
+            auto it = def_block.find(arg);
+            return it != def_block.end() && (!loop.body.count(it->second) || invariant.count(arg));
+        };
+
+        // definitions come before their uses in reverse postorder
+        std::vector<Label> body(loop.body.begin(), loop.body.end());
+        std::sort(body.begin(), body.end(), [&](const Label& a, const Label& b) { return rpo_index[a] < rpo_index[b]; });
+
+        for (auto &label : body) {
+            for (auto tac : get_block(label).get_instr()) {
+                if (claimed.count(tac)) {
+                    invariant.insert(tac->get_result());
+                    continue;
+                }
+                if (!hoistable(tac))
+                    continue;
+
+                bool ok = true;
+                for (auto &arg : tac->get_args())
+                    ok = ok && (tac->get_opcode() == "const" || is_invariant(arg));
+                if (!ok)
+                    continue;
+
+                claimed.insert(tac);
+                invariant.insert(tac->get_result());
+                hoisted[i].push_back(tac);
+                headers.insert(loop.header);
+            }
+        }
+    }
+
+    if (claimed.empty())
+        return false;
+
+    // the loops are gone once the preheaders are in
+    std::vector<std::pair<Label, std::optional<Label>>> targets;
+    for (auto &loop : info.loops)
+        targets.push_back({loop.header, loop.preheader});
+
+    auto made = make_preheaders(proc, am, headers);
+
+    for (auto &block : proc.blocks)
+        std::erase_if(block.get_instr(), [&](TAC* tac) { return claimed.count(tac); });
+
+    for (std::size_t i = 0; i < targets.size(); i++) {
+        if (hoisted[i].empty())
+            continue;
+
+        auto &[header, preheader] = targets[i];
+        auto &instr = get_block(preheader.has_value() ? *preheader : made.at(header)).get_instr();
+
+        // right before the jump to the header
+        auto pos = instr.size();
+        while (pos > 0 && (instr[pos - 1]->get_opcode() == "jmp" || assembly::jumps.count(instr[pos - 1]->get_opcode())))
+            pos--;
+        instr.insert(instr.begin() + pos, hoisted[i].begin(), hoisted[i].end());
+
+#ifdef DEBUG
+        std::cout << "Hoisted " << hoisted[i].size() << " instructions out of the loop at " << header << "\n";
+#endif
+    }
+
+    return true;
+}
+
+};
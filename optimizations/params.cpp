@@ -0,0 +1,156 @@
+#include "cfg.h"
+#include "analysis.h"
+#include <algorithm>
+
+namespace opt {
+
+namespace {
+
+// parameters the assembler reads from the registers they came in
+constexpr std::size_t REGISTER_ARGS = 6;
+
+// whether the register parameter k came in can be written by tac: calls and their
+// arguments write all of them, idivq and imulq write %rdx and shifts %rcx, even
+// the ones the assembler ends up doing without
+[[nodiscard]] bool clobbers(const TAC* tac, std::size_t k) {
+    auto op = tac->get_opcode();
+    if (op == "call" || op == "param")
+        return true;
+    if (k == 2)
+        return op == "mul" || op == "div" || op == "mod";
+    if (k == 3)
+        return op == "shl" || op == "shr";
+    return false;
+}
+
+}
+
+bool CFG::keep_params(Procedure& proc, AnalysisManager& am) {
+    auto &entry = proc.blocks[0].get_instr();
+
+    // temporaries only ever set from a register parameter, by a copy at the top of the entry block
+    std::map<MM::Temporary, int> defs;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (tac->has_result())
+                defs[tac->get_result()]++;
+        }
+    }
+    std::vector<std::pair<MM::Temporary, std::size_t>> copies;
+    for (std::size_t i = 1; i < entry.size(); i++) {
+        auto tac = entry[i];
+        if (tac->get_opcode() == "label")
+            continue;
+        if (tac->get_opcode() != "copy")
+            break;
+        auto &args = tac->get_args();
+        if (args.size() == 1 && args[0].size() > 2 && args[0][0] == '%' && args[0][1] == 'p' && is_ssa_var(proc, tac->get_result()) &&
+            defs[tac->get_result()] == 1) {
+            auto k = std::stoul(args[0].substr(2));
+            if (k < REGISTER_ARGS)
+                copies.emplace_back(tac->get_result(), k);
+        }
+    }
+    if (copies.empty())
+        return false;
+
+    bool changed = false;
+    for (auto &[temp, k] : copies) {
+        auto &liveness = am.liveness(proc);
+        auto &preds = am.predecessors(proc);
+        for (auto &block : proc.blocks) {
+            Set def_block, use_block;
+            block.build_def_use(def_block, use_block);
+            block.build_liveness(liveness.live_in.at(block.get_label()), liveness.live_out.at(block.get_label()));
+        }
+
+        // whether the register may, or must, have been written when each block starts
+        std::map<Label, bool> may, must;
+        auto clobbered = [&](Block& block) {
+            auto &instr = block.get_instr();
+            return std::any_of(instr.begin(), instr.end(), [&](auto tac) { return clobbers(tac, k); });
+        };
+        for (auto &block : proc.blocks)
+            may[block.get_label()] = false, must[block.get_label()] = &block != &proc.blocks[0];
+        for (bool grew = true; grew;) {
+            grew = false;
+            for (auto &block : proc.blocks) {
+                auto label = block.get_label();
+                bool in_may = false, in_must = &block != &proc.blocks[0];
+                for (auto &pred : preds.at(label)) {
+                    bool written = clobbered(get_block(pred));
+                    in_may |= may[pred] || written;
+                    in_must &= must[pred] || written;
+                }
+                grew |= in_may != may[label] || in_must != must[label];
+                may[label] = in_may, must[label] = in_must;
+            }
+        }
+
+        // uses before anything writes the register read the parameter, the copy goes right
+        // before the instructions writing it first, a use or a write which only some paths
+        // get to after another write leaves the parameter alone
+        std::vector<std::pair<Label, std::size_t>> renamed, copy_before;
+        bool mixed = false;
+        for (auto &block : proc.blocks) {
+            auto &instr = block.get_instr();
+            bool block_may = may[block.get_label()], block_must = must[block.get_label()];
+            for (std::size_t i = 0; i < instr.size() && !mixed; i++) {
+                auto tac = instr[i];
+                bool write = clobbers(tac, k);
+                auto &args = tac->get_args();
+                bool used = std::find(args.begin(), args.end(), temp) != args.end();
+                bool live = used || (block.get_live_out(i).count(temp) && !(tac->has_result() && tac->get_result() == temp));
+
+                if (write && live) {
+                    if (!block_may)
+                        copy_before.emplace_back(block.get_label(), i);
+                    else if (!block_must)
+                        mixed = true;
+                }
+                block_may |= write, block_must |= write;
+                if (used) {
+                    if (!block_may)
+                        renamed.emplace_back(block.get_label(), i);
+                    else if (!block_must)
+                        mixed = true;
+                }
+            }
+        }
+        if (mixed)
+            continue;
+
+        // nothing reads the parameter and the only write is in the entry block anyway
+        auto at = std::find_if(entry.begin(), entry.end(), [&](auto tac) { return tac->has_result() && tac->get_result() == temp; });
+        auto pos = static_cast<std::size_t>(at - entry.begin());
+        if (renamed.empty() && copy_before.size() == 1 && copy_before[0].first == proc.blocks[0].get_label())
+            continue;
+
+        auto param = "%p" + std::to_string(k);
+        for (auto &[label, i] : renamed) {
+            for (auto &arg : get_block(label).get_instr()[i]->get_args()) {
+                if (arg == temp)
+                    arg = param;
+            }
+        }
+        // positions of the entry block move back by one once the copy is gone
+        auto copy = *at;
+        entry.erase(at);
+        for (auto it = copy_before.rbegin(); it != copy_before.rend(); it++) {
+            auto &instr = get_block(it->first).get_instr();
+            auto i = it->second - (it->first == proc.blocks[0].get_label() && it->second > pos);
+            instr.insert(instr.begin() + i, it == copy_before.rbegin() ? copy : pool.make("copy", std::vector<std::string>{param}, temp));
+        }
+        changed = true;
+
+        // the instructions moved under the liveness of the next parameter
+        am.invalidate(proc, CFG_SHAPE);
+
+#ifdef DEBUG
+        std::cout << "Parameter " << param << " of " << proc.name << " read " << renamed.size() << " times before its copy " << temp << "\n";
+#endif
+    }
+    return changed;
+}
+
+};
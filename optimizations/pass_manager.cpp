@@ -0,0 +1,152 @@
+#include "pass_manager.h"
+#include <format>
+
+namespace opt {
+
+static const std::map<std::string, Pass> registered_passes = {
+    {"copyprop", {"copyprop", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.copy_propagation(proc, am); }, ALL, Form::ANY}},
+    {"deadcopy", {"deadcopy", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.eliminate_dead_copies(proc, am); }, ALL}},
+    {"copycoalesce", {"copycoalesce", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.coalesce_temporaries(proc, am); }, CFG_SHAPE}},
+    {"params", {"params", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.keep_params(proc, am); }, CFG_SHAPE}},
+    {"jtseq", {"jtseq", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.jt_seq_uncond(proc, am); }, NONE}},
+    {"jtcond", {"jtcond", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.jt_cond_to_uncond(proc, am); }, NONE}},
+    {"coalesce", {"coalesce", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.coalesce(proc, am); }, NONE}},
+    {"preheaders", {"preheaders", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.insert_preheaders(proc, am); }, NONE, Form::ANY}},
+    {"inline", {"inline", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.inline_calls(proc, am); }, NONE, Form::TAC, std::nullopt, [](CFG& cfg) { cfg.summarize_calls(); }}},
+    {"tailcall", {"tailcall", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.tail_calls(proc, am); }, NONE, Form::TAC, std::nullopt, [](CFG& cfg) { cfg.summarize_calls(); }}},
+    {"unroll", {"unroll", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.unroll(proc, am); }, NONE}},
+    {"ssa", {"ssa", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.to_ssa(proc, am); }, CFG_SHAPE, Form::TAC, Form::SSA}},
+    {"sccp", {"sccp", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.sccp(proc, am); }, NONE, Form::SSA}},
+    {"gvn", {"gvn", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.gvn(proc, am); }, CFG_SHAPE, Form::SSA}},
+    {"licm", {"licm", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.licm(proc, am); }, NONE, Form::SSA}},
+    {"iv", {"iv", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.reduce_strength(proc, am); }, NONE, Form::SSA}},
+    {"adce", {"adce", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.adce(proc, am); }, NONE, Form::SSA}},
+    {"layout", {"layout", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.layout(proc, am); }, ALL, Form::ANY}},
+    {"out-of-ssa", {"out-of-ssa", [](CFG& cfg, Procedure& proc, AnalysisManager& am) { return cfg.from_ssa(proc, am); }, NONE, Form::SSA, Form::TAC}},
+};
+
+PassManager::PassManager(const std::vector<std::string>& pass_names, int max_rounds) : max_rounds(max_rounds), rounds(0), converged(false) {
+    auto form = Form::TAC;
+    for (auto &name : pass_names) {
+        auto it = registered_passes.find(name);
+        if (it == registered_passes.end())
+            throw std::runtime_error("Unknown optimization pass '" + name + "'!");
+
+        auto &pass = it->second;
+        if (pass.form != Form::ANY && pass.form != form)
+            throw std::runtime_error("Optimization pass '" + name + "' can't run " + (form == Form::SSA ? "on SSA form!" : "outside of SSA form!"));
+        form = pass.switches_to.value_or(form);
+        pipeline.push_back(pass);
+    }
+
+    // the assembler doesn't know about phis
+    if (form == Form::SSA)
+        pipeline.push_back(registered_passes.at("out-of-ssa"));
+    stats.resize(pipeline.size());
+    settled.resize(pipeline.size());
+}
+
+[[nodiscard]] std::vector<std::string> PassManager::pipeline_for_level(int level) {
+    if (level <= 0)
+        return {};
+    if (level == 1)
+        return {"jtseq", "jtcond", "coalesce", "layout"};
+    return {
+        "inline", "tailcall", "copyprop", "deadcopy", "jtseq", "jtcond", "coalesce", "unroll",
+        "ssa", "sccp", "gvn", "licm", "iv", "adce", "out-of-ssa",
+        "copyprop", "deadcopy", "copycoalesce", "params", "jtseq", "jtcond", "coalesce", "layout"
+    };
+}
+
+[[nodiscard]] std::vector<std::string> PassManager::parse_pipeline(const std::string& passes) {
+    std::vector<std::string> names;
+    std::size_t start = 0;
+    while (start <= passes.size()) {
+        auto end = passes.find(',', start);
+        if (end == std::string::npos)
+            end = passes.size();
+        if (end > start)
+            names.push_back(passes.substr(start, end - start));
+        start = end + 1;
+    }
+    return names;
+}
+
+bool PassManager::run_pass(CFG& cfg, std::size_t i) {
+    bool changed = false;
+    auto start = std::chrono::steady_clock::now();
+
+    if (pipeline[i].prepare)
+        pipeline[i].prepare(cfg);
+    for (auto &proc : cfg.get_procs()) {
+        // a pass would leave a procedure nothing changed since alone again, unless
+        // it looks at the other procedures as well
+        auto it = settled[i].find(proc.name);
+        if (!pipeline[i].prepare && it != settled[i].end() && it->second == changes[proc.name])
+            continue;
+
+        // only the analyses of the procedures which changed are dropped
+        if (pipeline[i].run(cfg, proc, *am)) {
+            am->invalidate(proc, pipeline[i].preserved);
+            changes[proc.name]++;
+            changed = true;
+        }
+        else
+            settled[i][proc.name] = changes[proc.name];
+    }
+    stats[i].time += std::chrono::steady_clock::now() - start;
+
+    stats[i].runs++;
+    stats[i].changes += changed;
+
+#ifdef DEBUG
+    std::cout << "Pass " << pipeline[i].name << (changed ? " changed" : " didn't change") << " the CFG\n";
+#endif
+    return changed;
+}
+
+void PassManager::run(CFG& cfg) {
+    am = std::make_unique<AnalysisManager>(cfg);
+    changes.clear();
+    for (auto &proc_settled : settled)
+        proc_settled.clear();
+    rounds = 0;
+    converged = true;
+
+    std::size_t group_start = 0;
+    while (group_start < pipeline.size()) {
+        if (pipeline[group_start].switches_to.has_value()) {
+            run_pass(cfg, group_start++);
+            continue;
+        }
+
+        auto group_end = group_start;
+        while (group_end < pipeline.size() && !pipeline[group_end].switches_to.has_value())
+            group_end++;
+
+        bool changed = true;
+        for (int group_rounds = 0; changed && group_rounds < max_rounds; group_rounds++, rounds++) {
+            changed = false;
+            for (auto i = group_start; i < group_end; i++)
+                changed |= run_pass(cfg, i);
+        }
+        converged &= !changed;
+        group_start = group_end;
+    }
+}
+
+void PassManager::report(std::ostream& os) const {
+    if (converged)
+        os << std::format("Optimizations reached a fixed point after {} round(s).\n", rounds);
+    else
+        os << std::format("Optimizations stopped after {} round(s) without reaching a fixed point.\n", rounds);
+    for (std::size_t i = 0; i < pipeline.size(); i++) {
+        os << std::format("  {:<12} runs: {:<3} changes: {:<3} time: {:.3f} ms\n",
+            pipeline[i].name, stats[i].runs, stats[i].changes, stats[i].time.count());
+    }
+
+    if (am)
+        am->report(os);
+}
+
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include "cfg.h"
+#include "analysis.h"
+#include <chrono>
+#include <functional>
+#include <optional>
+
+namespace opt {
+
+// form of the code a pass works on
+enum class Form { TAC, SSA, ANY };
+
+// passes run on a single procedure at a time
+struct Pass {
+    std::string name;
+    std::function<bool(CFG&, Procedure&, AnalysisManager&)> run;
+
+    // analyses which are still valid after the pass changed the procedure
+    unsigned preserved;
+
+    Form form = Form::TAC;
+
+    // going into or out of SSA happens once, it splits the pipeline in groups
+    // which are each run to a fixed point
+    std::optional<Form> switches_to = std::nullopt;
+
+    // called once before the pass goes through the procedures
+    std::function<void(CFG&)> prepare = nullptr;
+};
+
+// statistics gathered for every pass in the pipeline
+struct PassStats {
+    int runs = 0, changes = 0;
+    std::chrono::duration<double, std::milli> time{0};
+};
+
+class PassManager {
+private:
+    std::vector<Pass> pipeline;
+    std::vector<PassStats> stats;
+    std::unique_ptr<AnalysisManager> am;
+
+    // how many times a pass changed each procedure, and for every pass in the pipeline
+    // that count when it last left the procedure alone
+    std::map<std::string, int> changes;
+    std::vector<std::map<std::string, int>> settled;
+    int max_rounds, rounds;
+    bool converged;
+
+    // runs pipeline[i] on every procedure, returns whether it changed anything
+    bool run_pass(CFG& cfg, std::size_t i);
+
+public:
+    PassManager(const std::vector<std::string>& pass_names, int max_rounds = 10);
+
+    // -O0, -O1, -O2
+    [[nodiscard]] static std::vector<std::string> pipeline_for_level(int level);
+
+    // -passes=copyprop,deadcopy,...
+    [[nodiscard]] static std::vector<std::string> parse_pipeline(const std::string& passes);
+
+    [[nodiscard]] bool empty() const {
+        return pipeline.empty();
+    }
+
+    // runs every group of the pipeline until no pass changes the CFG anymore
+    void run(CFG& cfg);
+
+    void report(std::ostream& os) const;
+};
+
+};
@@ -0,0 +1,368 @@
+#include "cfg.h"
+#include "analysis.h"
+#include "../asm/asm.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace opt {
+
+namespace {
+
+// value of an SSA temporary: not seen yet, a single constant or anything
+struct Lattice {
+    enum Kind { TOP, CONST, BOTTOM } kind = TOP;
+    long long value = 0;
+
+    [[nodiscard]] bool operator == (const Lattice& other) const {
+        return kind == other.kind && (kind != CONST || value == other.value);
+    }
+};
+
+const Lattice bottom = {Lattice::BOTTOM};
+
+[[nodiscard]] Lattice meet(const Lattice& a, const Lattice& b) {
+    if (a.kind == Lattice::TOP)
+        return b;
+    if (b.kind == Lattice::TOP)
+        return a;
+    return a == b ? a : bottom;
+}
+
+}
+
+[[nodiscard]] std::optional<long long> parse_number(const std::string& s) {
+    if (s.empty() || !(std::isdigit(s[0]) || (s[0] == '-' && s.size() > 1)))
+        return std::nullopt;
+    try {
+        return std::stoll(s);
+    } catch (const std::out_of_range&) {
+        return std::nullopt;
+    }
+}
+
+// same results as the instructions the assembler emits: 64 bit two's complement,
+// shift counts masked to 6 bits by sarq/salq
+// division by zero and LLONG_MIN / -1 trap in idivq, so they are left alone
+[[nodiscard]] std::optional<long long> fold(const std::string& op, const std::vector<long long>& v) {
+    using u64 = std::uint64_t;
+
+    if (v.size() == 1) {
+        if (op == "neg")
+            return static_cast<long long>(-static_cast<u64>(v[0]));
+        if (op == "not")
+            return ~v[0];
+        return std::nullopt;
+    }
+
+    auto a = v[0], b = v[1];
+    if (op == "add")
+        return static_cast<long long>(static_cast<u64>(a) + static_cast<u64>(b));
+    if (op == "sub")
+        return static_cast<long long>(static_cast<u64>(a) - static_cast<u64>(b));
+    if (op == "mul")
+        return static_cast<long long>(static_cast<u64>(a) * static_cast<u64>(b));
+    if (op == "and")
+        return a & b;
+    if (op == "or")
+        return a | b;
+    if (op == "xor")
+        return a ^ b;
+    if (op == "shl")
+        return static_cast<long long>(static_cast<u64>(a) << (b & 63));
+    if (op == "shr")
+        return a >> (b & 63);
+    if (op == "div" || op == "mod") {
+        if (b == 0 || (a == std::numeric_limits<long long>::min() && b == -1))
+            return std::nullopt;
+        return op == "div" ? a / b : a % b;
+    }
+    if (auto it = sign::set_when.find(op); it != sign::set_when.end())
+        return (sign::compare(a, b) & it->second) ? 1 : 0;
+    return std::nullopt;
+}
+
+bool CFG::sccp(Procedure& proc, AnalysisManager& am) {
+    using namespace sign;
+
+    // the edges are only followed from the root
+    if (uce(proc))
+        am.invalidate(proc, NONE);
+
+    // every SSA temporary has a single definition
+    std::unordered_map<MM::Temporary, TAC*> def;
+    std::unordered_map<MM::Temporary, std::vector<std::pair<Label, TAC*>>> uses;
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        for (auto tac : block.get_instr()) {
+            if (tac->has_result() && is_ssa_var(proc, tac->get_result()))
+                def[tac->get_result()] = tac;
+            for (auto &arg : tac->get_args()) {
+                if (is_ssa_var(proc, arg))
+                    uses[arg].push_back({label, tac});
+            }
+            for (auto &[_, arg] : tac->get_phi_args()) {
+                if (is_ssa_var(proc, arg))
+                    uses[arg].push_back({label, tac});
+            }
+        }
+    }
+
+    std::unordered_map<MM::Temporary, Lattice> values;
+    auto value = [&](const std::string& temp) -> Lattice {
+        // parameters, captured temporaries and reads of undefined temporaries
+        if (!def.count(temp))
+            return bottom;
+        return values[temp];
+    };
+
+    std::set<Label> executable;
+    std::set<std::pair<Label, Label>> executable_edges;
+    std::vector<std::pair<Label, Label>> flow_worklist;
+    std::vector<MM::Temporary> ssa_worklist;
+
+    auto set_value = [&](const MM::Temporary& temp, const Lattice& v) {
+        auto &old = values[temp];
+        if (old == v)
+            return;
+        old = v;
+        ssa_worklist.push_back(temp);
+    };
+
+    auto visit_phi = [&](const Label& label, TAC* tac) {
+        Lattice v;
+        for (auto &[pred, arg] : tac->get_phi_args()) {
+            if (executable_edges.count({pred, label}))
+                v = meet(v, value(arg));
+        }
+        set_value(tac->get_result(), v);
+    };
+
+    auto visit_instr = [&](TAC* tac) {
+        auto result = tac->get_result();
+        auto op = tac->get_opcode();
+        auto &args = tac->get_args();
+
+        Lattice v = bottom;
+        if (op == "const") {
+            if (auto number = parse_number(args[0]))
+                v = {Lattice::CONST, *number};
+        }
+        else if (op == "copy" && args.size() == 1)
+            v = value(args[0]);
+        else if (assembly::uniops.count(op) || assembly::normal_binops.count(op) || assembly::special_binops.count(op)) {
+            std::vector<long long> operands;
+            v = Lattice();
+            for (auto &arg : args) {
+                auto arg_value = value(arg);
+                if (arg_value.kind == Lattice::BOTTOM) {
+                    v = bottom;
+                    break;
+                }
+                operands.push_back(arg_value.value);
+            }
+            // every operand is known
+            if (operands.size() == args.size()) {
+                auto folded = fold(op, operands);
+                v = folded ? Lattice{Lattice::CONST, *folded} : bottom;
+            }
+        }
+        set_value(result, v);
+    };
+
+    // follows the jumps of a block as far as the known values allow
+    auto visit_jumps = [&](const Label& label) {
+        for (auto tac : get_block(label).get_instr()) {
+            auto op = tac->get_opcode();
+            if (op == "ret")
+                return;
+            if (op == "jmp") {
+                flow_worklist.push_back({label, tac->get_result()});
+                return;
+            }
+
+            auto taken = taken_when.find(op);
+            if (taken == taken_when.end())
+                continue;
+
+            auto &args = tac->get_args();
+            auto v = value(args[0]), w = args.size() == 2 ? value(args[1]) : Lattice{Lattice::CONST, 0};
+            if (v.kind == Lattice::TOP || w.kind == Lattice::TOP)
+                return;
+            if (v.kind == Lattice::BOTTOM || w.kind == Lattice::BOTTOM) {
+                flow_worklist.push_back({label, tac->get_result()});
+                continue;
+            }
+            int known = compare(v.value, w.value);
+            if (known & taken->second) {
+                flow_worklist.push_back({label, tac->get_result()});
+                return;
+            }
+        }
+    };
+
+    auto visit = [&](const Label& label, TAC* tac) {
+        if (tac->get_opcode() == "phi")
+            visit_phi(label, tac);
+        else if (taken_when.count(tac->get_opcode()))
+            visit_jumps(label);
+        else if (tac->has_result() && def.count(tac->get_result()) && def[tac->get_result()] == tac)
+            visit_instr(tac);
+    };
+
+    auto root = proc.get_root();
+    executable.insert(root);
+    for (auto tac : get_block(root).get_instr())
+        visit(root, tac);
+    visit_jumps(root);
+
+    while (!flow_worklist.empty() || !ssa_worklist.empty()) {
+        if (!flow_worklist.empty()) {
+            auto edge = flow_worklist.back();
+            flow_worklist.pop_back();
+            if (!executable_edges.insert(edge).second)
+                continue;
+
+            auto &[_, label] = edge;
+            auto &instr = get_block(label).get_instr();
+            if (!executable.insert(label).second) {
+                // only the phis see the new edge
+                for (std::size_t i = 0; i < first_non_phi(get_block(label)); i++) {
+                    if (instr[i]->get_opcode() == "phi")
+                        visit_phi(label, instr[i]);
+                }
+                continue;
+            }
+            for (auto tac : instr)
+                visit(label, tac);
+            visit_jumps(label);
+            continue;
+        }
+
+        auto temp = ssa_worklist.back();
+        ssa_worklist.pop_back();
+        for (auto &[label, tac] : uses[temp]) {
+            if (executable.count(label))
+                visit(label, tac);
+        }
+    }
+
+    auto known = [&](const MM::Temporary& temp) {
+        auto it = values.find(temp);
+        return it != values.end() && it->second.kind == Lattice::CONST && def.count(temp);
+    };
+
+    bool changed = false;
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        if (!executable.count(label))
+            continue;
+
+        auto &instr = block.get_instr();
+        std::vector<TAC*> new_instr, consts;
+        bool jumped = false;
+        for (std::size_t i = 0; i < instr.size() && !jumped; i++) {
+            auto tac = instr[i];
+            auto op = tac->get_opcode();
+
+            if (i == first_non_phi(block)) {
+                new_instr.insert(new_instr.end(), consts.begin(), consts.end());
+                consts.clear();
+            }
+
+            if (tac->has_result() && known(tac->get_result()) && op != "const" && op != "copy") {
+                auto result = tac->get_result();
+                auto c = pool.make("const", std::vector<std::string>{std::to_string(values[result].value)}, result);
+#ifdef DEBUG
+                std::cout << "Folded " << result << " to " << values[result].value << "\n";
+#endif
+                // phis stay together at the top of the block
+                if (op == "phi")
+                    consts.push_back(c);
+                else
+                    new_instr.push_back(c);
+                changed = true;
+                continue;
+            }
+
+            auto &args = tac->get_args();
+            auto taken = taken_when.find(op);
+            if (taken != taken_when.end() && std::all_of(args.begin(), args.end(), known)) {
+                int sign = compare(values[args[0]].value, args.size() == 2 ? values[args[1]].value : 0);
+                changed = true;
+                if (!(sign & taken->second))
+                    continue;
+                *tac = TAC("jmp", std::vector<std::string>{}, tac->get_result());
+                jumped = true;
+            }
+
+            new_instr.push_back(tac);
+        }
+        new_instr.insert(new_instr.end(), consts.begin(), consts.end());
+
+        block.set_instr(new_instr);
+        relink(block);
+    }
+
+    if (!changed)
+        return false;
+
+    uce(proc);
+    prune_phi_args(proc);
+
+    // the definitions which fed only folded instructions are dead now
+    std::unordered_map<MM::Temporary, int> use_count;
+    std::unordered_map<MM::Temporary, std::pair<Label, TAC*>> def_of;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (tac->has_result() && def.count(tac->get_result()))
+                def_of[tac->get_result()] = {block.get_label(), tac};
+            for (auto &arg : tac->get_args())
+                use_count[arg]++;
+            for (auto &[_, arg] : tac->get_phi_args())
+                use_count[arg]++;
+        }
+    }
+
+    auto is_pure = [&](TAC* tac) {
+        auto op = tac->get_opcode();
+        return op == "const" || op == "phi" || (op == "copy" && tac->get_args().size() == 1) ||
+               assembly::uniops.count(op) || assembly::normal_binops.count(op) || op == "mul" || op == "shl" || op == "shr" ||
+               set_when.count(op);
+    };
+
+    std::vector<MM::Temporary> dead;
+    for (auto &[temp, _] : def_of) {
+        if (!use_count[temp])
+            dead.push_back(temp);
+    }
+
+    std::set<TAC*> removed;
+    while (!dead.empty()) {
+        auto temp = dead.back();
+        dead.pop_back();
+
+        auto &[label, tac] = def_of[temp];
+        if (removed.count(tac) || !is_pure(tac))
+            continue;
+        removed.insert(tac);
+
+        auto release = [&](const std::string& arg) {
+            if (!--use_count[arg] && def_of.count(arg))
+                dead.push_back(arg);
+        };
+        for (auto &arg : tac->get_args())
+            release(arg);
+        for (auto &[_, arg] : tac->get_phi_args())
+            release(arg);
+    }
+
+    for (auto &block : proc.blocks)
+        std::erase_if(block.get_instr(), [&](TAC* tac) { return removed.count(tac); });
+
+    return true;
+}
+
+};
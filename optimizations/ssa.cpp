@@ -0,0 +1,374 @@
+#include "cfg.h"
+#include "analysis.h"
+#include "../asm/asm.h"
+#include <algorithm>
+
+namespace opt {
+
+[[nodiscard]] bool CFG::is_ssa_var(const Procedure& proc, const MM::Temporary& temp) const {
+    if (temp.size() < 2 || temp[0] != '%' || !std::isdigit(temp[1]) || is_captured(temp))
+        return false;
+
+    auto &func_of_temp = muncher.get_func_of_temps();
+    auto it = func_of_temp.find(temp);
+    return it != func_of_temp.end() && it->second == proc.name;
+}
+
+[[nodiscard]] std::size_t CFG::first_non_phi(Block& block) {
+    auto &instr = block.get_instr();
+    std::size_t pos = block.is_starting() ? 2 : 1;
+    while (pos < instr.size() && instr[pos]->get_opcode() == "phi")
+        pos++;
+    return pos;
+}
+
+bool CFG::to_ssa(Procedure& proc, AnalysisManager& am) {
+    // renaming only walks the blocks reachable from the root
+    if (uce(proc))
+        am.invalidate(proc, NONE);
+
+    auto &dom = am.dominators(proc);
+    auto &liveness = am.liveness(proc);
+
+    // blocks defining every variable
+    std::map<MM::Temporary, std::set<Label>> def_sites;
+    for (auto &block : proc.blocks) {
+        for (auto tac : block.get_instr()) {
+            if (tac->has_result() && is_ssa_var(proc, tac->get_result()))
+                def_sites[tac->get_result()].insert(block.get_label());
+        }
+    }
+
+    // phis go on the iterated dominance frontier of the definitions,
+    // but only where the variable is still live (pruned SSA)
+    std::map<Label, std::vector<TAC*>> phis;
+    std::map<TAC*, MM::Temporary> phi_var;
+    for (auto &[temp, sites] : def_sites) {
+        std::vector<Label> worklist(sites.begin(), sites.end());
+        std::set<Label> has_phi;
+
+        while (!worklist.empty()) {
+            auto label = worklist.back();
+            worklist.pop_back();
+
+            for (auto &frontier_label : dom.frontier(label)) {
+                if (has_phi.count(frontier_label) || !liveness.live_in.at(frontier_label).count(temp))
+                    continue;
+                has_phi.insert(frontier_label);
+
+                std::map<Label, std::string> phi_args;
+                auto phi = pool.make("phi", phi_args, temp);
+                phis[frontier_label].push_back(phi);
+                phi_var[phi] = temp;
+
+                if (!sites.count(frontier_label))
+                    worklist.push_back(frontier_label);
+            }
+        }
+    }
+
+    for (auto &[label, block_phis] : phis) {
+        auto &instr = get_block(label).get_instr();
+        instr.insert(instr.begin() + first_non_phi(get_block(label)), block_phis.begin(), block_phis.end());
+    }
+
+    // rename over the dominator tree, every definition gets a fresh temporary
+    // reads with no reaching definition keep the original name
+    std::map<MM::Temporary, std::vector<MM::Temporary>> versions;
+    auto current = [&](const MM::Temporary& temp) {
+        auto it = versions.find(temp);
+        return it == versions.end() || it->second.empty() ? temp : it->second.back();
+    };
+
+    bool changed = !phis.empty();
+    auto rename_block = [&](const Label& label, std::vector<MM::Temporary>& pushed) {
+        for (auto tac : get_block(label).get_instr()) {
+            if (tac->get_opcode() != "phi") {
+                for (auto &arg : tac->get_args()) {
+                    if (is_ssa_var(proc, arg))
+                        arg = current(arg);
+                }
+            }
+
+            if (!tac->has_result())
+                continue;
+
+            auto temp = tac->get_opcode() == "phi" ? phi_var[tac] : tac->get_result();
+            if (!is_ssa_var(proc, temp))
+                continue;
+
+            auto new_temp = muncher.new_temp(proc.name);
+            versions[temp].push_back(new_temp);
+            pushed.push_back(temp);
+            tac->set_result(new_temp);
+            changed = true;
+        }
+
+        for (auto &[succ_label, _] : graph[label]) {
+            for (auto phi : phis[succ_label])
+                phi->get_phi_args()[label] = current(phi_var[phi]);
+        }
+    };
+
+    // explicit stack, the dominator tree is as deep as the longest chain of blocks
+    struct Frame {
+        std::vector<Label> children;
+        std::size_t child_ind;
+        std::vector<MM::Temporary> pushed;
+    };
+
+    auto root = proc.get_root();
+    std::vector<Frame> stack;
+    stack.push_back({dom.children(root), 0, {}});
+    rename_block(root, stack.back().pushed);
+
+    while (!stack.empty()) {
+        auto &frame = stack.back();
+        if (frame.child_ind == frame.children.size()) {
+            for (auto &temp : frame.pushed)
+                versions[temp].pop_back();
+            stack.pop_back();
+            continue;
+        }
+
+        auto child_label = frame.children[frame.child_ind++];
+        stack.push_back({dom.children(child_label), 0, {}});
+        rename_block(child_label, stack.back().pushed);
+    }
+
+#ifdef DEBUG
+    std::cout << "Built SSA for " << proc.name << " with " << phi_var.size() << " phis\n";
+#endif
+
+    return changed;
+}
+
+bool CFG::from_ssa(Procedure& proc, AnalysisManager& am) {
+    auto preds = am.predecessors(proc);
+
+    bool has_phis = false;
+    for (auto &block : proc.blocks)
+        has_phis |= first_non_phi(block) != (block.is_starting() ? 2u : 1u);
+    if (!has_phis)
+        return false;
+
+    // split the critical edges going into blocks with phis, so the copies
+    // we add on an edge only run when that edge is taken
+    std::map<Label, std::vector<Block>> split_blocks;
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        auto phi_end = first_non_phi(block);
+        auto phi_begin = block.is_starting() ? 2u : 1u;
+        if (phi_begin == phi_end)
+            continue;
+
+        for (auto &pred_label : preds.at(label)) {
+            if (graph[pred_label].size() < 2)
+                continue;
+
+            auto split_label = muncher.new_label();
+            std::vector<TAC*> split_instr = {
+                pool.make("label", std::vector<std::string>{split_label}),
+                pool.make("jmp", std::vector<std::string>{}, label)
+            };
+
+            for (auto tac : get_block(pred_label).get_jumps()) {
+                if (tac->get_result() == label)
+                    tac->set_result(split_label);
+            }
+
+            auto &instr = block.get_instr();
+            for (auto i = phi_begin; i < phi_end; i++) {
+                auto &phi_args = instr[i]->get_phi_args();
+                phi_args[split_label] = phi_args[pred_label];
+                phi_args.erase(pred_label);
+            }
+
+            split_blocks[pred_label].push_back(Block(split_instr, false));
+
+#ifdef DEBUG
+            std::cout << "Split critical edge " << pred_label << "->" << label << " with " << split_label << "\n";
+#endif
+        }
+    }
+
+    if (!split_blocks.empty()) {
+        // each new block goes right after its predecessor, never after the final ret
+        std::vector<Block> blocks;
+        for (auto &block : proc.blocks) {
+            auto label = block.get_label();
+            blocks.push_back(std::move(block));
+            if (auto it = split_blocks.find(label); it != split_blocks.end())
+                blocks.insert(blocks.end(), it->second.begin(), it->second.end());
+        }
+        proc.blocks = std::move(blocks);
+        reindex(&proc - procs.data());
+
+        for (auto &[pred_label, new_blocks] : split_blocks) {
+            relink(get_block(pred_label));
+            for (auto &new_block : new_blocks)
+                relink(get_block(new_block.get_label()));
+        }
+    }
+
+    // the phis of a block become parallel copies at the end of its predecessors
+    std::vector<std::pair<MM::Temporary, MM::Temporary>> inserted;
+    for (auto &block : proc.blocks) {
+        auto &instr = block.get_instr();
+        auto phi_begin = block.is_starting() ? 2u : 1u;
+        auto phi_end = first_non_phi(block);
+        if (phi_begin == phi_end)
+            continue;
+
+        std::map<Label, std::vector<std::pair<MM::Temporary, MM::Temporary>>> edge_copies;
+        for (auto i = phi_begin; i < phi_end; i++) {
+            for (auto &[pred_label, temp] : instr[i]->get_phi_args())
+                edge_copies[pred_label].push_back({instr[i]->get_result(), temp});
+        }
+        instr.erase(instr.begin() + phi_begin, instr.begin() + phi_end);
+
+        for (auto &[pred_label, copies] : edge_copies) {
+            auto sequence = sequentialize(proc, copies);
+            for (auto tac : sequence)
+                inserted.push_back({tac->get_result(), tac->get_arg()});
+
+            // before the jumps, the predecessor only goes to this block now
+            auto &pred_instr = get_block(pred_label).get_instr();
+            auto pos = pred_instr.size();
+            while (pos > 0 && (pred_instr[pos - 1]->get_opcode() == "jmp" || assembly::jumps.count(pred_instr[pos - 1]->get_opcode())))
+                pos--;
+            pred_instr.insert(pred_instr.begin() + pos, sequence.begin(), sequence.end());
+        }
+    }
+
+    coalesce_copies(proc, am, inserted);
+    return true;
+}
+
+[[nodiscard]] std::vector<TAC*> CFG::sequentialize(const Procedure& proc, std::vector<std::pair<MM::Temporary, MM::Temporary>> copies) {
+    std::vector<TAC*> sequence;
+
+    while (!copies.empty()) {
+        std::erase_if(copies, [](auto& copy) { return copy.first == copy.second; });
+
+        // a copy whose destination isn't read by any other pending copy is safe to emit
+        auto ready = std::find_if(copies.begin(), copies.end(), [&](auto& copy) {
+            return std::none_of(copies.begin(), copies.end(), [&](auto& other) { return other.second == copy.first; });
+        });
+
+        if (ready != copies.end()) {
+            sequence.push_back(pool.make("copy", std::vector<std::string>{ready->second}, ready->first));
+            copies.erase(ready);
+            continue;
+        }
+
+        if (copies.empty())
+            break;
+
+        // only cycles are left, save one destination before it gets overwritten
+        auto saved = copies[0].first;
+        auto temp = muncher.new_temp(proc.name);
+        sequence.push_back(pool.make("copy", std::vector<std::string>{saved}, temp));
+        for (auto &copy : copies) {
+            if (copy.second == saved)
+                copy.second = temp;
+        }
+    }
+
+    return sequence;
+}
+
+void CFG::coalesce_copies(Procedure& proc, AnalysisManager& am, const std::vector<std::pair<MM::Temporary, MM::Temporary>>& copies) {
+    std::set<MM::Temporary> candidates;
+    for (auto &[to, from] : copies) {
+        if (is_ssa_var(proc, to) && is_ssa_var(proc, from))
+            candidates.insert(to), candidates.insert(from);
+    }
+    if (candidates.empty())
+        return;
+
+    // the blocks changed since the last liveness, recompute it
+    am.invalidate(proc, NONE);
+    auto &liveness = am.liveness(proc);
+
+    // two candidates interfere if one is live where the other is defined,
+    // except when the definition is a copy of the other one
+    std::map<MM::Temporary, std::set<MM::Temporary>> interference;
+    for (auto &block : proc.blocks) {
+        auto label = block.get_label();
+        Set def_block, use_block;
+        block.build_def_use(def_block, use_block);
+        block.build_liveness(liveness.live_in.at(label), liveness.live_out.at(label));
+
+        auto &instr = block.get_instr();
+        for (std::size_t i = 0; i < instr.size(); i++) {
+            auto tac = instr[i];
+            if (!tac->has_result() || !candidates.count(tac->get_result()))
+                continue;
+
+            auto result = tac->get_result();
+            auto copied = tac->get_opcode() == "copy" && tac->get_args().size() == 1 ? tac->get_arg() : "";
+            for (auto &temp : block.get_live_out(i).get_set()) {
+                if (temp != result && temp != copied && candidates.count(temp)) {
+                    interference[result].insert(temp);
+                    interference[temp].insert(result);
+                }
+            }
+        }
+    }
+
+    std::map<MM::Temporary, MM::Temporary> parent;
+    auto find = [&](MM::Temporary temp) {
+        std::vector<MM::Temporary> path;
+        while (parent.count(temp) && parent[temp] != temp) {
+            path.push_back(temp);
+            temp = parent[temp];
+        }
+        for (auto &node : path)
+            parent[node] = temp;
+        return temp;
+    };
+
+    for (auto &[to, from] : copies) {
+        if (!candidates.count(to) || !candidates.count(from))
+            continue;
+
+        auto a = find(to), b = find(from);
+        if (a == b)
+            continue;
+
+        // interference is symmetric, so looking at the smaller side is enough,
+        // and merging it into the larger one keeps the whole thing O(n log n)
+        if (interference[a].size() > interference[b].size())
+            std::swap(a, b);
+
+        bool interferes = std::any_of(interference[a].begin(), interference[a].end(), [&](auto& temp) {
+            return find(temp) == b;
+        });
+        if (interferes)
+            continue;
+
+        parent[a] = b;
+        interference[b].insert(interference[a].begin(), interference[a].end());
+        interference.erase(a);
+    }
+
+    // rename every class to its representative and drop the copies which became trivial
+    for (auto &block : proc.blocks) {
+        auto &instr = block.get_instr();
+        for (auto tac : instr) {
+            for (auto &arg : tac->get_args()) {
+                if (parent.count(arg))
+                    arg = find(arg);
+            }
+            if (tac->has_result() && parent.count(tac->get_result()))
+                tac->set_result(find(tac->get_result()));
+        }
+
+        std::erase_if(instr, [](TAC* tac) {
+            return tac->get_opcode() == "copy" && tac->get_args().size() == 1 && tac->get_arg() == tac->get_result();
+        });
+    }
+}
+
+};
@@ -0,0 +1,171 @@
+#include "cfg.h"
+#include "analysis.h"
+
+namespace opt {
+
+namespace {
+
+// arguments passed in registers, the assembler pushes the others on the stack of the caller
+constexpr std::size_t REGISTER_ARGS = 6;
+
+}
+
+bool CFG::tail_calls(Procedure& proc, AnalysisManager&) {
+    // a call whose result is returned right away, maybe through copies
+    struct Tail {
+        std::size_t first_param, call_pos;
+        TAC* call;
+    };
+
+    auto find_tail = [&](Block& block) -> std::optional<Tail> {
+        auto &instr = block.get_instr();
+        auto last = instr.back();
+
+        // void calls often jump to a block which only returns
+        if (last->get_opcode() == "jmp") {
+            auto &target = get_block(last->get_result()).get_instr();
+            if (target.size() != 2 || target[1]->get_opcode() != "ret" || !target[1]->get_args().empty())
+                return std::nullopt;
+        }
+        else if (last->get_opcode() != "ret")
+            return std::nullopt;
+
+        std::optional<MM::Temporary> value;
+        if (last->get_opcode() == "ret" && !last->get_args().empty())
+            value = last->get_arg();
+
+        auto pos = instr.size() - 1;
+        while (pos > 0 && value.has_value() && instr[pos - 1]->get_opcode() == "copy" && instr[pos - 1]->get_args().size() == 1 &&
+               instr[pos - 1]->get_result() == *value && is_ssa_var(proc, *value))
+            value = instr[--pos]->get_arg();
+        if (pos == 0 || instr[pos - 1]->get_opcode() != "call")
+            return std::nullopt;
+
+        auto call = instr[pos - 1];
+        if (call->has_result() != value.has_value() || (value.has_value() && call->get_result() != *value))
+            return std::nullopt;
+
+        auto first = pos - 1;
+        while (first > 0 && instr[first - 1]->get_opcode() == "param")
+            first--;
+        return Tail{first, pos - 1, call};
+    };
+
+    auto is_self = [&](const Tail& tail) {
+        return known_callee(tail.call->get_args()[0]) == proc.name;
+    };
+
+    // our frame, and the copies of it passed as the static link of nested lambdas,
+    // it's gone once we jump away
+    std::set<MM::Temporary> frames;
+    for (bool grew = true; grew;) {
+        grew = false;
+        for (auto &block : proc.blocks) {
+            for (auto tac : block.get_instr()) {
+                auto op = tac->get_opcode();
+                bool frame = op == "get_fp" || (op == "copy" && tac->get_args().size() == 1 && frames.count(tac->get_arg()));
+                if (frame && tac->has_result())
+                    grew |= frames.insert(tac->get_result()).second;
+            }
+        }
+    }
+
+    // the parameters are copied into temporaries at the top of the entry block and never
+    // read again, a self call only has to set those temporaries again
+    std::map<std::size_t, MM::Temporary> param_temps;
+    auto &entry_instr = proc.blocks[0].get_instr();
+    std::size_t params_end = 2;
+    for (; params_end < entry_instr.size(); params_end++) {
+        auto tac = entry_instr[params_end];
+        auto &args = tac->get_args();
+        if (tac->get_opcode() != "copy" || args[0].size() < 3 || args[0][0] != '%' || args[0][1] != 'p')
+            break;
+        // the static link stays the same, a function calling itself sees the same enclosing frame
+        if (args.size() == 1)
+            param_temps[std::stoul(args[0].substr(2))] = tac->get_result();
+    }
+
+    bool loops = true;
+    bool has_self = false;
+    for (std::size_t b = 0; b < proc.blocks.size(); b++) {
+        auto &instr = proc.blocks[b].get_instr();
+        for (std::size_t pos = b == 0 ? params_end : 1; pos < instr.size(); pos++) {
+            for (auto &arg : instr[pos]->get_args())
+                loops &= arg.size() < 3 || arg[0] != '%' || arg[1] != 'p';
+        }
+        auto tail = find_tail(proc.blocks[b]);
+        has_self |= tail.has_value() && is_self(*tail);
+    }
+
+    // the loop starts right after the parameters are read
+    Label header;
+    if (has_self && loops) {
+        header = muncher.new_label();
+        std::vector<TAC*> header_instr = {pool.make("label", std::vector<std::string>{header})};
+        header_instr.insert(header_instr.end(), entry_instr.begin() + params_end, entry_instr.end());
+        entry_instr.resize(params_end);
+        entry_instr.push_back(pool.make("jmp", std::vector<std::string>{}, header));
+        proc.blocks.insert(proc.blocks.begin() + 1, Block(header_instr, false));
+        reindex(&proc - procs.data());
+        relink(proc.blocks[0]);
+        relink(proc.blocks[1]);
+    }
+
+    bool changed = !header.empty();
+    for (auto &block : proc.blocks) {
+        auto tail = find_tail(block);
+        if (!tail.has_value())
+            continue;
+
+        auto &instr = block.get_instr();
+        std::vector<TAC*> new_instr(instr.begin(), instr.begin() + tail->first_param);
+
+        if (!header.empty() && is_self(*tail)) {
+            // parameters reassigned all at once, then back to the top
+            std::vector<std::pair<MM::Temporary, MM::Temporary>> copies;
+            for (auto i = tail->first_param; i < tail->call_pos; i++) {
+                auto it = param_temps.find(std::stoul(instr[i]->get_result()) - 1);
+                if (it != param_temps.end())
+                    copies.push_back({it->second, instr[i]->get_arg()});
+            }
+            auto sequence = sequentialize(proc, copies);
+            new_instr.insert(new_instr.end(), sequence.begin(), sequence.end());
+            new_instr.push_back(pool.make("jmp", std::vector<std::string>{}, header));
+
+#ifdef DEBUG
+            std::cout << "Self tail call of " << proc.name << " turned into a loop\n";
+#endif
+        }
+        else {
+            // the assembler jumps to the callee with our frame gone, when all the
+            // arguments fit in registers
+            auto &args = tail->call->get_args();
+            bool clean = instr.size() == tail->call_pos + 2 && instr.back()->get_opcode() == "ret";
+            // main returns 0 to the runtime, whatever the callee leaves in %rax
+            bool mark = args.size() == 2 && tail->call_pos - tail->first_param <= REGISTER_ARGS && proc.name != "main";
+            for (auto i = tail->first_param; i < tail->call_pos; i++)
+                mark = mark && !frames.count(instr[i]->get_arg());
+            if (mark)
+                args.push_back("tail_call_flag");
+            if (clean || args.size() == 2) {
+                changed |= mark;
+                continue;
+            }
+
+            // nothing can be left between the call and the ret
+            new_instr.insert(new_instr.end(), instr.begin() + tail->first_param, instr.begin() + tail->call_pos + 1);
+            if (tail->call->has_result())
+                new_instr.push_back(pool.make("ret", std::vector<std::string>{tail->call->get_result()}));
+            else
+                new_instr.push_back(pool.make("ret", std::vector<std::string>{}));
+        }
+
+        block.set_instr(new_instr);
+        relink(block);
+        changed = true;
+    }
+
+    return changed;
+}
+
+};
@@ -0,0 +1,446 @@
+#include "cfg.h"
+#include "analysis.h"
+#include "../asm/asm.h"
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+namespace opt {
+
+namespace {
+
+// a loop running at most this many times is copied out entirely, as long as the
+// copies together stay under FULL_UNROLL_SIZE instructions
+constexpr long long FULL_UNROLL_COUNT = 16;
+constexpr std::size_t FULL_UNROLL_SIZE = 160;
+
+// other loops get their body repeated up to MAX_UNROLL_FACTOR times, under UNROLL_SIZE
+constexpr std::size_t MAX_UNROLL_FACTOR = 4;
+constexpr std::size_t UNROLL_SIZE = 64;
+
+// instructions run at compile time before a constant loop is left alone
+constexpr std::size_t EVAL_STEPS = 1 << 18;
+
+// what a constant loop can compute, besides const and copy
+const std::set<std::string> evaluated_ops = {
+    "add", "sub", "mul", "div", "mod", "and", "or", "xor", "shl", "shr", "neg", "not",
+    "setz", "setnz", "setl", "setle", "setg", "setge"
+};
+
+// an instruction of a loop evaluated at compile time, its temporaries as slots
+struct Step {
+    enum Kind { CONST, COPY, FOLD, JUMP } kind;
+    std::string op;
+    std::vector<int> args;
+    int result = -1;
+    long long constant = 0;
+
+    // jumps: the results they are taken for, and the block they go to, -1 out of the loop
+    int taken = 0;
+    int next = -1;
+    Label exit;
+};
+
+[[nodiscard]] Label target(const TAC* jump) {
+    return jump->has_result() ? jump->get_result() : jump->get_arg();
+}
+
+[[nodiscard]] bool is_jump(const TAC* tac) {
+    return tac->get_opcode() == "jmp" || sign::taken_when.count(tac->get_opcode());
+}
+
+// instructions of the loop, without labels and jumps
+[[nodiscard]] std::size_t size_of(CFG& cfg, const Loop& loop) {
+    std::size_t size = 0;
+    for (auto &label : loop.body) {
+        for (auto tac : cfg.get_block(label).get_instr())
+            size += tac->get_opcode() != "label" && !is_jump(tac);
+    }
+    return size;
+}
+
+}
+
+bool CFG::unroll(Procedure& proc, AnalysisManager& am) {
+    bool changed = false;
+
+    // every change reshapes the loops, so they are found again, innermost first
+    for (bool again = true; again;) {
+        again = false;
+        auto &info = am.loops(proc);
+        for (auto loop = info.loops.rbegin(); loop != info.loops.rend() && !again; loop++) {
+            if (unrolled.count(loop->header) || !loop->preheader.has_value())
+                continue;
+            again = evaluate_loop(proc, am, *loop) || unroll_loop(proc, *loop);
+        }
+
+        if (again) {
+            am.invalidate(proc, NONE);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool CFG::evaluate_loop(Procedure& proc, AnalysisManager& am, const Loop& loop) {
+    using namespace sign;
+
+    // the loop is decoded once, its temporaries numbered, since it can run for a while
+    std::unordered_map<MM::Temporary, int> slot;
+    auto slot_of = [&](const MM::Temporary& temp) {
+        return slot.emplace(temp, slot.size()).first->second;
+    };
+
+    std::vector<Label> labels(loop.body.begin(), loop.body.end());
+    std::unordered_map<Label, int> index;
+    for (auto &label : labels)
+        index[label] = index.size();
+
+    std::vector<std::vector<Step>> program(labels.size());
+    std::set<int> defined, used;
+    for (std::size_t b = 0; b < labels.size(); b++) {
+        for (auto tac : get_block(labels[b]).get_instr()) {
+            auto op = tac->get_opcode();
+            if (op == "label")
+                continue;
+
+            Step step;
+            step.kind = Step::FOLD;
+            step.op = op;
+            if (is_jump(tac)) {
+                step.kind = Step::JUMP;
+                auto it = index.find(target(tac));
+                step.next = it == index.end() ? -1 : it->second;
+                step.exit = target(tac);
+                step.taken = op == "jmp" ? ANY : taken_when.at(op);
+            }
+            else if (op == "const") {
+                step.kind = Step::CONST;
+                auto constant = parse_number(tac->get_arg());
+                if (!constant.has_value())
+                    return false;
+                step.constant = constant.value();
+            }
+            else if (op == "copy" && tac->get_args().size() == 1)
+                step.kind = Step::COPY;
+            else if (!evaluated_ops.count(op))
+                return false;
+
+            // the locals of the procedure, nothing a call could see
+            if (op != "const" && op != "jmp") {
+                for (auto &arg : tac->get_args()) {
+                    if (!is_ssa_var(proc, arg))
+                        return false;
+                    step.args.push_back(slot_of(arg));
+                    used.insert(step.args.back());
+                }
+            }
+            if (tac->has_result() && !is_jump(tac)) {
+                if (!is_ssa_var(proc, tac->get_result()))
+                    return false;
+                step.result = slot_of(tac->get_result());
+                defined.insert(step.result);
+            }
+            program[b].push_back(step);
+        }
+    }
+
+    // what the loop reads or changes from before it has to be constant, following copies
+    // backwards from the end of the preheader through blocks with a single predecessor
+    auto &preds = am.predecessors(proc);
+    auto constant_at_end = [&](Label label, MM::Temporary temp) -> std::optional<long long> {
+        auto *instr = &get_block(label).get_instr();
+        auto pos = instr->size();
+        for (std::size_t hops = 0; hops <= proc.blocks.size();) {
+            while (pos > 0 && !((*instr)[pos - 1]->has_result() && (*instr)[pos - 1]->get_result() == temp))
+                pos--;
+            if (pos == 0) {
+                auto &from = preds.at(label);
+                if (from.size() != 1)
+                    return std::nullopt;
+                label = from[0];
+                instr = &get_block(label).get_instr();
+                pos = instr->size();
+                hops++;
+                continue;
+            }
+
+            auto tac = (*instr)[--pos];
+            if (tac->get_opcode() == "const")
+                return parse_number(tac->get_arg());
+            if (tac->get_opcode() != "copy" || tac->get_args().size() != 1)
+                return std::nullopt;
+            temp = tac->get_arg();
+        }
+        return std::nullopt;
+    };
+
+    auto &live = am.liveness(proc);
+    std::vector<long long> value(slot.size());
+    std::vector<bool> known(slot.size());
+    for (auto &temp : live.live_in.at(loop.header).get_set()) {
+        auto it = slot.find(temp);
+        if (it == slot.end())
+            continue;
+        auto constant = constant_at_end(loop.preheader.value(), temp);
+        if (!constant.has_value())
+            return false;
+        value[it->second] = constant.value();
+        known[it->second] = true;
+    }
+
+    std::vector<long long> operands;
+    Label exit;
+    std::size_t steps = 0;
+    for (int b = index.at(loop.header); b != -1;) {
+        int next = -1;
+        for (auto &step : program[b]) {
+            if (++steps > EVAL_STEPS) {
+                unrolled.insert(loop.header);
+                return false;
+            }
+
+            operands.clear();
+            for (auto arg : step.args) {
+                if (!known[arg])
+                    return false;
+                operands.push_back(value[arg]);
+            }
+
+            if (step.kind == Step::JUMP) {
+                if (step.taken & compare(operands.empty() ? 0 : operands[0], operands.size() > 1 ? operands[1] : 0)) {
+                    next = step.next;
+                    exit = step.exit;
+                    break;
+                }
+                continue;
+            }
+
+            auto result = step.kind == Step::CONST ? step.constant : step.kind == Step::COPY ? std::optional<long long>(operands[0]) : fold(step.op, operands);
+            if (!result.has_value())
+                return false;
+            value[step.result] = result.value();
+            known[step.result] = true;
+        }
+        b = next;
+    }
+
+    // the preheader sets whatever the loop changed that is still needed after it
+    std::vector<TAC*> instr = get_block(loop.preheader.value()).get_instr();
+    instr.pop_back();
+    for (auto &temp : live.live_in.at(exit).get_set()) {
+        auto it = slot.find(temp);
+        if (it == slot.end() || !defined.count(it->second))
+            continue;
+        if (!known[it->second])
+            return false;
+        instr.push_back(pool.make("const", std::vector<std::string>{std::to_string(value[it->second])}, temp));
+    }
+    instr.push_back(pool.make("jmp", std::vector<std::string>{}, exit));
+
+#ifdef DEBUG
+    std::cout << "Evaluated the loop at " << loop.header << " in " << steps << " steps\n";
+#endif
+
+    auto &preheader = get_block(loop.preheader.value());
+    preheader.set_instr(instr);
+    relink(preheader);
+    uce(proc);
+    return true;
+}
+
+bool CFG::unroll_loop(Procedure& proc, const Loop& loop) {
+    using namespace sign;
+
+    if (!loop.children.empty() || !loop.trip_count.has_value())
+        return false;
+    for (auto &[inside, _] : loop.exits) {
+        if (inside != loop.header)
+            return false;
+    }
+
+    auto &trip = loop.trip_count.value();
+    auto header_instr = get_block(loop.header).get_instr();
+    auto branch = header_instr[header_instr.size() - 2];
+    auto inside = loop.body.count(target(branch)) ? target(branch) : target(header_instr.back());
+    auto exit = inside == target(branch) ? target(header_instr.back()) : target(branch);
+    auto size = size_of(*this, loop);
+
+    std::vector<Block> copies;
+
+    // the blocks of one iteration but the header, with fresh labels, jumps back
+    // to the header go to back_to instead
+    auto copy_body = [&](const Label& back_to) {
+        std::map<Label, Label> renamed;
+        for (auto &block : proc.blocks) {
+            if (loop.body.count(block.get_label()) && block.get_label() != loop.header)
+                renamed[block.get_label()] = muncher.new_label();
+        }
+
+        for (auto &block : proc.blocks) {
+            auto it = renamed.find(block.get_label());
+            if (it == renamed.end())
+                continue;
+
+            std::vector<TAC*> body = {pool.make("label", std::vector<std::string>{it->second})};
+            auto &instr = block.get_instr();
+            for (std::size_t i = 1; i < instr.size(); i++) {
+                auto copy = pool.make(*instr[i]);
+                if (is_jump(copy)) {
+                    auto to = target(copy);
+                    copy->set_result(to == loop.header ? back_to : renamed.count(to) ? renamed.at(to) : to);
+                }
+                body.push_back(copy);
+            }
+            copies.push_back(Block(body, false));
+        }
+        return renamed;
+    };
+
+    // the header without its test, going on to next
+    auto copy_header = [&](const Label& label, const Label& next) {
+        std::vector<TAC*> body = {pool.make("label", std::vector<std::string>{label})};
+        for (std::size_t i = 1; i + 2 < header_instr.size(); i++)
+            body.push_back(pool.make(*header_instr[i]));
+        body.push_back(pool.make("jmp", std::vector<std::string>{}, next));
+        copies.push_back(Block(body, false));
+    };
+
+    auto first_of = [&](const std::map<Label, Label>& renamed, const Label& next_header) {
+        return inside == loop.header ? next_header : renamed.at(inside);
+    };
+
+    std::vector<TAC*> pre_instr = get_block(loop.preheader.value()).get_instr();
+    pre_instr.pop_back();
+    std::vector<Label> headers;
+
+    // the copies stand for a loop running at least once, var getting to the value
+    // failing the test without wrapping around
+    long long moved, last;
+    bool counted = trip.count.has_value() && trip.count.value() >= 1 && trip.init.has_value() &&
+        !__builtin_mul_overflow(trip.count.value(), trip.step, &moved) && !__builtin_add_overflow(trip.init.value(), moved, &last);
+
+    if (counted && trip.count.value() <= FULL_UNROLL_COUNT && trip.count.value() * size <= FULL_UNROLL_SIZE) {
+        // every iteration in a row, the test of the last header is known to fail
+        auto count = trip.count.value();
+        for (long long k = 0; k <= count; k++)
+            headers.push_back(muncher.new_label());
+        for (long long k = 0; k < count; k++)
+            copy_header(headers[k], first_of(copy_body(headers[k + 1]), headers[k + 1]));
+        copy_header(headers[count], exit);
+        pre_instr.push_back(pool.make("jmp", std::vector<std::string>{}, headers[0]));
+
+#ifdef DEBUG
+        std::cout << "Fully unrolled the loop at " << loop.header << " " << count << " times\n";
+#endif
+    }
+    else {
+        // the main loop runs factor iterations at once while the last of them still
+        // passes the test, the original loop does the rest; a loop going through
+        // memory or calls saves too little next to the guard and the copies
+        auto in_memory = [&](const std::string& value) {
+            return value.size() > 1 && value[0] == '%' && std::isdigit(value[1]) && !is_ssa_var(proc, value);
+        };
+        for (auto &label : loop.body) {
+            for (auto tac : get_block(label).get_instr()) {
+                if (tac->get_opcode() == "call" || (tac->has_result() && in_memory(tac->get_result())))
+                    return false;
+                if (std::any_of(tac->get_args().begin(), tac->get_args().end(), in_memory))
+                    return false;
+            }
+        }
+        auto factor = MAX_UNROLL_FACTOR;
+        while (factor > 1 && factor * size > UNROLL_SIZE)
+            factor /= 2;
+
+        bool monotonic = ((trip.staying == NEG || trip.staying == (NEG | ZERO)) && trip.step > 0) ||
+            ((trip.staying == POS || trip.staying == (ZERO | POS)) && trip.step < 0);
+        if (factor < 2 || !monotonic || (trip.count.has_value() && trip.count.value() < static_cast<long long>(factor)))
+            return false;
+
+        // the main loop compares var with the bound, which only agrees with the sign
+        // of their difference as long as it doesn't wrap around
+        if (trip.difference)
+            return false;
+
+        // leaving the main loop runs the header again before the original test, which
+        // only does nothing when the header is the test and constants; this also keeps
+        // var from changing between the test and the body
+        if (std::any_of(header_instr.begin() + 1, header_instr.end() - 2, [](TAC* tac) { return tac->get_opcode() != "const"; }))
+            return false;
+
+        // var only passes the test factor - 1 steps later if it passes against bound - reach
+        long long reach, shifted;
+        if (__builtin_mul_overflow(static_cast<long long>(factor - 1), trip.step, &reach))
+            return false;
+
+        auto main_header = muncher.new_label();
+        auto limit = muncher.new_temp(proc.name);
+        if (!trip.limit.has_value()) {
+            if (__builtin_sub_overflow(trip.bound, reach, &shifted))
+                return false;
+            pre_instr.push_back(pool.make("const", std::vector<std::string>{std::to_string(shifted)}, limit));
+            pre_instr.push_back(pool.make("jmp", std::vector<std::string>{}, main_header));
+        }
+        else {
+            // a bound so close to the end of the range that subtracting reach wraps
+            // around only runs the original loop
+            auto edge = muncher.new_temp(proc.name), offset = muncher.new_temp(proc.name);
+            auto rest = muncher.new_label();
+            shifted = trip.step > 0 ? std::numeric_limits<long long>::min() + reach : std::numeric_limits<long long>::max() + reach;
+            pre_instr.push_back(pool.make("const", std::vector<std::string>{std::to_string(shifted)}, edge));
+            pre_instr.push_back(pool.make(trip.step > 0 ? "jl" : "jg", std::vector<std::string>{trip.limit.value(), edge}, loop.header));
+            pre_instr.push_back(pool.make("jmp", std::vector<std::string>{}, rest));
+
+            std::vector<TAC*> body = {
+                pool.make("label", std::vector<std::string>{rest}),
+                pool.make("const", std::vector<std::string>{std::to_string(reach)}, offset),
+                pool.make("sub", std::vector<std::string>{trip.limit.value(), offset}, limit),
+                pool.make("jmp", std::vector<std::string>{}, main_header)
+            };
+            copies.push_back(Block(body, false));
+        }
+
+        headers.push_back(main_header);
+        for (std::size_t k = 1; k < factor; k++)
+            headers.push_back(muncher.new_label());
+        headers.push_back(main_header);
+
+        auto jump = std::find_if(taken_when.begin(), taken_when.end(), [&](auto& when) { return when.second == trip.staying; })->first;
+        for (std::size_t k = 0; k < factor; k++) {
+            auto first = first_of(copy_body(headers[k + 1]), headers[k + 1]);
+            if (k > 0) {
+                copy_header(headers[k], first);
+                continue;
+            }
+
+            std::vector<TAC*> body = {pool.make("label", std::vector<std::string>{main_header})};
+            for (std::size_t i = 1; i + 2 < header_instr.size(); i++)
+                body.push_back(pool.make(*header_instr[i]));
+            body.push_back(pool.make(jump, std::vector<std::string>{trip.var, limit}, first));
+            body.push_back(pool.make("jmp", std::vector<std::string>{}, loop.header));
+            copies.push_back(Block(body, false));
+        }
+
+        unrolled.insert(loop.header);
+        unrolled.insert(main_header);
+
+#ifdef DEBUG
+        std::cout << "Unrolled the loop at " << loop.header << " " << factor << " times\n";
+#endif
+    }
+
+    auto &preheader = get_block(loop.preheader.value());
+    preheader.set_instr(pre_instr);
+
+    // the copies go right before the original loop
+    auto at = block_index.at(loop.header).second;
+    proc.blocks.insert(proc.blocks.begin() + at, std::make_move_iterator(copies.begin()), std::make_move_iterator(copies.end()));
+    reindex(&proc - procs.data());
+    for (auto &block : proc.blocks)
+        relink(block);
+    uce(proc);
+    return true;
+}
+
+};
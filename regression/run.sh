@@ -0,0 +1,52 @@
+#!/bin/bash
+# Compiles every program in regression/ at -O0, -O1 and -O2, after the helpers in
+# regression/lib/. A program rejected at -O0 must be rejected at every level, the
+# others must print the same at every level, and what is in the .out file next to
+# them when there is one.
+# Usage: regression/run.sh [bxc] [programs...]
+
+cd "$(dirname "$0")/.."
+BXC=$(realpath "${1:-bxc.exe}")
+shift
+PROGRAMS=("$@")
+[ ${#PROGRAMS[@]} -eq 0 ] && PROGRAMS=(regression/*.bx)
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# prints the output of the program compiled with $2, or "rejected"
+run() {
+    local dir="$WORK/$2"
+    mkdir -p "$dir"
+    cat regression/lib/*.bx "$1" > "$dir/prog.bx"
+    if ! (cd "$dir" && "$BXC" prog.bx "$2") > "$dir/compile.log" 2>&1; then
+        echo "rejected"
+        return
+    fi
+    gcc -no-pie -o "$dir/prog" "$dir/prog.s" bxruntime.c 2> /dev/null || { echo "link failed"; return; }
+    timeout 5 "$dir/prog"
+    echo "exit $?"
+}
+
+failed=0
+for program in "${PROGRAMS[@]}"; do
+    expected=$(run "$program" -O0)
+    if [ -f "${program%.bx}.out" ] && [ "$expected" != "$(cat "${program%.bx}.out")" ]; then
+        echo "FAIL $program at -O0"
+        diff "${program%.bx}.out" <(echo "$expected") | head -10
+        failed=$((failed + 1))
+        continue
+    fi
+    for level in -O1 -O2; do
+        got=$(run "$program" $level)
+        if [ "$got" != "$expected" ]; then
+            echo "FAIL $program at $level"
+            diff <(echo "$expected") <(echo "$got") | head -10
+            failed=$((failed + 1))
+            break
+        fi
+    done
+done
+
+echo "$((${#PROGRAMS[@]} - failed)) of ${#PROGRAMS[@]} programs passed"
+[ $failed -eq 0 ]
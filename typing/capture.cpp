@@ -0,0 +1,186 @@
+#include "capture.h"
+#include <algorithm>
+#include <iostream>
+
+namespace AST {
+
+void Captures::declare(const std::string& name, bool is_function, Lambda* lambda) {
+    auto &binding = bindings.emplace_back(std::make_unique<Binding>(Binding{name, stack.size(), is_function, lambda}));
+    scopes.back()[name] = binding.get();
+}
+
+[[nodiscard]] Binding* Captures::resolve(const std::string& name) const {
+    for (auto it = scopes.rbegin(); it != scopes.rend(); it++) {
+        if (auto found = it->find(name); found != it->end())
+            return found->second;
+    }
+    return nullptr;
+}
+
+void Captures::use(Binding* binding) {
+    for (auto i = binding->depth; i < stack.size(); i++) {
+        auto &captured = uses[stack[i]].captures;
+        if (std::find(captured.begin(), captured.end(), binding) == captured.end())
+            captured.push_back(binding);
+    }
+}
+
+void Captures::call(Binding* binding) {
+    use(binding);
+    if (!binding->lambda)
+        return;
+
+    // the call site passes the captures of a lifted lambda by name
+    auto &callee = uses[binding->lambda];
+    for (auto capture : std::vector<Binding*>(callee.captures)) {
+        if (resolve(capture->name) != capture)
+            callee.shadowed = true;
+        else
+            use(capture);
+    }
+}
+
+void Captures::decide() {
+    for (auto &[lambda, lambda_uses] : uses) {
+        lambda->lifted.clear();
+        if (lambda_uses.captures.empty()) {
+            lambda->capture_kind = Lambda::NO_CAPTURE;
+            continue;
+        }
+
+        bool read_only = std::none_of(lambda_uses.captures.begin(), lambda_uses.captures.end(), [](Binding* binding) {
+            return binding->written_in_lambda;
+        });
+        if (!read_only || lambda_uses.escapes || lambda_uses.shadowed) {
+            lambda->capture_kind = Lambda::STATIC_LINK;
+            continue;
+        }
+
+        lambda->capture_kind = Lambda::LIFTED;
+        for (auto binding : lambda_uses.captures)
+            lambda->lifted.push_back({binding->name, binding->is_function});
+
+#ifdef DEBUG
+        std::cout << "Lambda " << lambda->name << " lifted with " << lambda->lifted.size() << " captures\n";
+#endif
+    }
+}
+
+/*
+Expressions
+*/
+
+void IdentExpression::capture(Captures& captures) {
+    auto binding = captures.resolve(name);
+    if (!binding)
+        return;
+    captures.use(binding);
+
+    // a lambda named outside of a call is an argument
+    if (binding->lambda)
+        captures.uses[binding->lambda].escapes = true;
+}
+
+void UniOpExpression::capture(Captures& captures) {
+    expr->capture(captures);
+}
+
+void BinOpExpression::capture(Captures& captures) {
+    left->capture(captures);
+    right->capture(captures);
+}
+
+void Eval::capture(Captures& captures) {
+    for (auto &expr : params)
+        expr->capture(captures);
+    if (auto binding = captures.resolve(name))
+        captures.call(binding);
+}
+
+/*
+Statements
+*/
+
+void ExpressionStatement::capture(Captures& captures) {
+    expr->capture(captures);
+}
+
+void VarDecl::capture(Captures& captures) {
+    for (auto &[name, expr] : var_inits) {
+        expr->capture(captures);
+        captures.declare(name, false);
+    }
+}
+
+void Assign::capture(Captures& captures) {
+    expr->capture(captures);
+    auto binding = captures.resolve(name);
+    if (!binding)
+        return;
+    captures.use(binding);
+    if (binding->depth != captures.stack.size())
+        binding->written_in_lambda = true;
+}
+
+void Call::capture(Captures& captures) {
+    eval->capture(captures);
+}
+
+void Return::capture(Captures& captures) {
+    if (expr)
+        expr->capture(captures);
+}
+
+void Block::capture(Captures& captures) {
+    captures.push_scope();
+    for (auto &statement : statements)
+        statement->capture(captures);
+    captures.pop_scope();
+}
+
+void IfElse::capture(Captures& captures) {
+    expr->capture(captures);
+    then_branch->capture(captures);
+    if (else_branch.has_value())
+        else_branch.value()->capture(captures);
+}
+
+void While::capture(Captures& captures) {
+    expr->capture(captures);
+    block->capture(captures);
+}
+
+/*
+Lambdas
+*/
+
+void Lambda::capture(Captures& captures) {
+    captures.uses[this];
+    captures.stack.push_back(this);
+    captures.push_scope();
+
+    for (auto &param : params)
+        captures.declare(param.name, param.type.is_function());
+    block->capture(captures);
+
+    captures.pop_scope();
+    captures.stack.pop_back();
+
+    captures.declare(name, true, this);
+}
+
+/*
+Declarations
+*/
+
+void ProcDecl::analyze_captures() {
+    Captures captures;
+    captures.push_scope();
+    for (auto &param : params)
+        captures.declare(param.name, param.type.is_function());
+
+    block->capture(captures);
+    captures.decide();
+}
+
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include "../ast/ast.h"
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace AST {
+
+// a variable, parameter or lambda declared inside a procedure
+struct Binding {
+    std::string name;
+    // how many lambdas deep it is declared, 0 for the procedure itself
+    std::size_t depth;
+    bool is_function;
+    // the lambda it names, if any
+    Lambda* lambda = nullptr;
+    // assigned from inside a lambda, so a copy of it could go stale
+    bool written_in_lambda = false;
+};
+
+// what a lambda uses from the functions around it
+struct LambdaUses {
+    std::vector<Binding*> captures;
+    // passed as an argument, whoever calls it doesn't know about extra parameters
+    bool escapes = false;
+    // called from somewhere one of its captures means something else
+    bool shadowed = false;
+};
+
+// free variables of every lambda of a procedure, names are resolved the same way
+// the muncher does, a lambda only becomes visible after its body
+struct Captures {
+    std::vector<std::unique_ptr<Binding>> bindings;
+    std::vector<std::map<std::string, Binding*>> scopes;
+    std::map<Lambda*, LambdaUses> uses;
+    // the lambdas being walked, innermost last
+    std::vector<Lambda*> stack;
+
+    void push_scope() { scopes.emplace_back(); }
+
+    void pop_scope() { scopes.pop_back(); }
+
+    void declare(const std::string& name, bool is_function, Lambda* lambda = nullptr);
+
+    // nullptr for globals and procedures
+    [[nodiscard]] Binding* resolve(const std::string& name) const;
+
+    // every lambda between the use and the declaration captures it
+    void use(Binding* binding);
+
+    // calling a lambda also uses what it captures
+    void call(Binding* binding);
+
+    // fills capture_kind and lifted of every lambda seen
+    void decide();
+};
+
+};
@@ -50,6 +50,10 @@ public:
         s.insert(x);
     }
 
+    void erase(const T& x) {
+        s.erase(x);
+    }
+
     [[nodiscard]] int count(const T x) const {
         return s.count(x);
     }
@@ -57,6 +61,10 @@ public:
     std::set<T> &get_set() {
         return s;
     }
+
+    const std::set<T> &get_set() const {
+        return s;
+    }
 };
 
 }; // namespace utils
\ No newline at end of file